@@ -0,0 +1,527 @@
+// Benchmarks the engine through the API in db.h, built with `make bench`:
+//
+//   ./bench --rows 10000,100000 --cache-size 100,2000 --json > before.json
+//
+// For every row count and cache size it runs these, in this order:
+//   insert-seq     inserts ids 1 to `rows` in order into a new file
+//   insert-random  inserts them shuffled into another, which the rest read
+//   lookup         `--ops` selects of one random id, reopened with a cold cache
+//   range          `--ops` / 10 selects of 100 rows from a random id
+//   scan           `--scans` selects of every row
+//   mixed          `--threads` threads sharing the handle for `--ops` in
+//                  all, 90% lookups and 10% inserts of new ids
+// Inserts commit every `--batch` rows, those of `mixed` one at a time.
+//
+// Each reports its throughput, the latency percentiles of its operations,
+// the pages it read and wrote and the peak RSS of the process. `--json`
+// prints them one per line so that two runs diff line by line. Ids and
+// the order of operations come from `--seed`: runs with the same
+// arguments do the same work.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "db.h"
+
+#define MAX_CONFIGS 16  // values of `--rows` or `--cache-size`
+#define RANGE_ROWS 100  // rows a range select returns
+#define MIXED_INSERT_PERCENT 10
+
+struct Options_t {
+  uint32_t rows[MAX_CONFIGS];
+  uint32_t num_rows;
+  uint32_t cache_sizes[MAX_CONFIGS];
+  uint32_t num_cache_sizes;
+  uint32_t ops;
+  uint32_t scans;
+  uint32_t batch;
+  uint32_t threads;
+  uint64_t seed;
+  bool mmap;
+  bool wal;
+  bool direct;
+  bool json;
+  const char* filename;
+};
+typedef struct Options_t Options;
+
+// HISTOGRAM
+
+// Latencies in nanoseconds, log-linear: each power of two is split into
+// 2^HISTOGRAM_SUB_BITS buckets, so a percentile is within 1/32 of the
+// latency it stands for.
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+struct Histogram_t {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t count;
+  uint64_t max;
+};
+typedef struct Histogram_t Histogram;
+
+uint32_t histogram_bucket(uint64_t value) {
+  if (value < HISTOGRAM_SUB_COUNT) {
+    return value;
+  }
+  uint32_t shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+  return ((shift + 1) << HISTOGRAM_SUB_BITS) + (value >> shift) - HISTOGRAM_SUB_COUNT;
+}
+
+// the largest value that falls in `bucket`
+uint64_t histogram_bucket_max(uint32_t bucket) {
+  if (bucket < HISTOGRAM_SUB_COUNT) {
+    return bucket;
+  }
+  uint32_t shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+  uint64_t low = (uint64_t) ((bucket & (HISTOGRAM_SUB_COUNT - 1)) + HISTOGRAM_SUB_COUNT) << shift;
+  return low + ((uint64_t) 1 << shift) - 1;
+}
+
+void histogram_record(Histogram* h, uint64_t value) {
+  h->counts[histogram_bucket(value)] += 1;
+  h->count += 1;
+  if (value > h->max) {
+    h->max = value;
+  }
+}
+
+void histogram_merge(Histogram* into, const Histogram* from) {
+  for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    into->counts[i] += from->counts[i];
+  }
+  into->count += from->count;
+  if (from->max > into->max) {
+    into->max = from->max;
+  }
+}
+
+// the latency `fraction` of the operations took at most
+uint64_t histogram_percentile(const Histogram* h, double fraction) {
+  uint64_t rank = (uint64_t) (fraction * h->count + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      uint64_t value = histogram_bucket_max(i);
+      return value < h->max ? value : h->max;
+    }
+  }
+  return h->max;
+}
+
+// MEASURING
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*, so that a seed means the same ids everywhere
+uint64_t next_random(uint64_t* state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+uint64_t resident_kb() {
+  long size, pages = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm != NULL) {
+    if (fscanf(statm, "%ld %ld", &size, &pages) != 2) {
+      pages = 0;
+    }
+    fclose(statm);
+  }
+  return (uint64_t) pages * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+uint64_t peak_resident_kb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+struct Result_t {
+  const char* workload;
+  uint32_t rows;
+  uint32_t cache_size;
+  uint64_t ops;
+  uint64_t rows_read;  // by selects
+  uint64_t elapsed_ns;
+  Histogram latency;
+  DbStats start_stats;
+  DbStats stats;  // what the workload itself did
+  uint64_t rss_kb;
+  uint64_t peak_rss_kb;
+};
+typedef struct Result_t Result;
+
+void result_start(Result* r, Db* db, const char* workload, uint32_t rows, uint32_t cache_size) {
+  memset(r, 0, sizeof(Result));
+  r->workload = workload;
+  r->rows = rows;
+  r->cache_size = cache_size;
+  db_stats(db, &r->start_stats);
+  r->elapsed_ns = now_ns();
+}
+
+void result_finish(Result* r, Db* db) {
+  r->elapsed_ns = now_ns() - r->elapsed_ns;
+  db_stats(db, &r->stats);
+  r->stats.pages_read -= r->start_stats.pages_read;
+  r->stats.pages_written -= r->start_stats.pages_written;
+  r->rss_kb = resident_kb();
+  r->peak_rss_kb = peak_resident_kb();
+}
+
+uint32_t num_printed = 0;
+
+void print_result(const Options* options, const Result* r) {
+  double seconds = r->elapsed_ns / 1e9;
+  double ops_per_sec = seconds > 0 ? r->ops / seconds : 0;
+  double rows_per_sec = seconds > 0 ? r->rows_read / seconds : 0;
+  double p50 = histogram_percentile(&r->latency, 0.50) / 1e3;
+  double p99 = histogram_percentile(&r->latency, 0.99) / 1e3;
+  double p999 = histogram_percentile(&r->latency, 0.999) / 1e3;
+  if (options->json) {
+    printf("%s{\"workload\": \"%s\", \"rows\": %u, \"cache_size\": %u, \"ops\": %lu, "
+	   "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"rows_read\": %lu, \"rows_per_sec\": %.1f, "
+	   "\"latency_us\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}, "
+	   "\"pages_read\": %lu, \"pages_written\": %lu, \"rss_kb\": %lu, \"peak_rss_kb\": %lu}",
+	   num_printed > 0 ? ",\n" : "", r->workload, r->rows, r->cache_size, (unsigned long) r->ops,
+	   seconds, ops_per_sec, (unsigned long) r->rows_read, rows_per_sec,
+	   p50, p99, p999, r->latency.max / 1e3,
+	   (unsigned long) r->stats.pages_read, (unsigned long) r->stats.pages_written,
+	   (unsigned long) r->rss_kb, (unsigned long) r->peak_rss_kb);
+  } else {
+    printf("%-14s %9u %6u %12.0f %9.1f %9.1f %9.1f %10lu %10lu %8lu\n",
+	   r->workload, r->rows, r->cache_size, ops_per_sec, p50, p99, p999,
+	   (unsigned long) r->stats.pages_read, (unsigned long) r->stats.pages_written,
+	   (unsigned long) r->peak_rss_kb / 1024);
+  }
+  num_printed += 1;
+  fflush(stdout);
+}
+
+// WORKLOADS
+
+void check(DbResult result, DbResult expected, const char* what) {
+  if (result != expected) {
+    fprintf(stderr, "%s failed with %d: %s\n", what, result,
+	    result == DB_ERROR ? db_error_message() : "unexpected result");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void remove_db(const char* filename) {
+  char wal[1024];
+  snprintf(wal, sizeof(wal), "%s-wal", filename);
+  unlink(filename);
+  unlink(wal);
+}
+
+Db* open_db(const Options* options, uint32_t cache_size) {
+  DbOptions db_options;
+  db_default_options(&db_options);
+  db_options.cache_size = cache_size;
+  db_options.mmap = options->mmap;
+  db_options.wal = options->wal;
+  db_options.direct_io = options->direct;
+  Db* db;
+  check(db_open(options->filename, &db_options, &db), DB_OK, "db_open");
+  return db;
+}
+
+void run_statement(Db* db, const char* sql) {
+  DbStatement* statement;
+  check(db_prepare(db, sql, &statement), DB_OK, sql);
+  check(db_step(statement), DB_DONE, sql);
+  db_finalize(statement);
+}
+
+void insert_row(DbStatement* insert, uint32_t id) {
+  char username[32];
+  char email[64];
+  snprintf(username, sizeof(username), "user%u", id);
+  snprintf(email, sizeof(email), "person%u@example.com", id);
+  db_bind_id(insert, 0, id);
+  db_bind_text(insert, 1, username);
+  db_bind_text(insert, 2, email);
+  check(db_step(insert), DB_DONE, "insert");
+  db_reset(insert);
+}
+
+// inserts `count` ids in batches, timing each insert and the commit that
+// ends its batch with it
+void insert_ids(const Options* options, Db* db, const uint32_t* ids, uint32_t count, Result* r) {
+  DbStatement* insert;
+  check(db_prepare(db, "insert ? ? ?", &insert), DB_OK, "insert");
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t start = now_ns();
+    if (i % options->batch == 0) {
+      run_statement(db, "begin");
+    }
+    insert_row(insert, ids[i]);
+    if ((i + 1) % options->batch == 0 || i + 1 == count) {
+      run_statement(db, "commit");
+    }
+    histogram_record(&r->latency, now_ns() - start);
+  }
+  r->ops = count;
+  db_finalize(insert);
+}
+
+// steps a select to the end, returning how many rows it read
+uint64_t select_all(DbStatement* select) {
+  uint64_t num_rows = 0;
+  DbResult result;
+  while ((result = db_step(select)) == DB_ROW) {
+    num_rows += 1;
+  }
+  check(result, DB_DONE, "select");
+  db_reset(select);
+  return num_rows;
+}
+
+void bench_inserts(const Options* options, uint32_t rows, uint32_t cache_size, bool shuffled) {
+  uint32_t* ids = malloc(rows * sizeof(uint32_t));
+  for (uint32_t i = 0; i < rows; i++) {
+    ids[i] = i + 1;
+  }
+  if (shuffled) {
+    uint64_t state = options->seed;
+    for (uint32_t i = rows - 1; i > 0; i--) {
+      uint32_t j = next_random(&state) % (i + 1);
+      uint32_t id = ids[i];
+      ids[i] = ids[j];
+      ids[j] = id;
+    }
+  }
+  remove_db(options->filename);
+  Db* db = open_db(options, cache_size);
+  Result r;
+  result_start(&r, db, shuffled ? "insert-random" : "insert-seq", rows, cache_size);
+  insert_ids(options, db, ids, rows, &r);
+  result_finish(&r, db);
+  check(db_close(db), DB_OK, "db_close");
+  print_result(options, &r);
+  free(ids);
+}
+
+// point lookups (`limit` 1) or ranges of random ids
+void bench_selects(const Options* options, Db* db, uint32_t rows, uint32_t cache_size,
+		   const char* workload, uint32_t ops, uint32_t limit) {
+  DbStatement* select;
+  check(db_prepare(db, limit == 1 ? "select where id = ?" : "select where id >= ? limit ?", &select),
+	DB_OK, workload);
+  uint64_t state = options->seed + 1;
+  Result r;
+  result_start(&r, db, workload, rows, cache_size);
+  for (uint32_t i = 0; i < ops; i++) {
+    uint64_t start = now_ns();
+    db_bind_id(select, 0, next_random(&state) % rows + 1);
+    if (limit > 1) {
+      db_bind_id(select, 1, limit);
+    }
+    r.rows_read += select_all(select);
+    histogram_record(&r.latency, now_ns() - start);
+  }
+  r.ops = ops;
+  result_finish(&r, db);
+  db_finalize(select);
+  print_result(options, &r);
+}
+
+void bench_scans(const Options* options, Db* db, uint32_t rows, uint32_t cache_size) {
+  DbStatement* select;
+  check(db_prepare(db, "select", &select), DB_OK, "scan");
+  Result r;
+  result_start(&r, db, "scan", rows, cache_size);
+  for (uint32_t i = 0; i < options->scans; i++) {
+    uint64_t start = now_ns();
+    r.rows_read += select_all(select);
+    histogram_record(&r.latency, now_ns() - start);
+  }
+  r.ops = options->scans;
+  result_finish(&r, db);
+  db_finalize(select);
+  print_result(options, &r);
+}
+
+struct MixedThread_t {
+  Db* db;
+  uint32_t index;
+  uint32_t num_threads;
+  uint32_t rows;  // ids taken by the table when it started
+  uint32_t ops;
+  uint64_t seed;
+  uint64_t rows_read;
+  Histogram latency;
+};
+typedef struct MixedThread_t MixedThread;
+
+void* mixed_thread(void* arg) {
+  MixedThread* m = arg;
+  DbStatement* select;
+  DbStatement* insert;
+  check(db_prepare(m->db, "select where id = ?", &select), DB_OK, "mixed");
+  check(db_prepare(m->db, "insert ? ? ?", &insert), DB_OK, "mixed");
+  uint64_t state = m->seed + 2 + m->index;
+  uint32_t next_id = m->rows + 1 + m->index;  // threads take turns with the new ids
+  for (uint32_t i = 0; i < m->ops; i++) {
+    uint64_t start = now_ns();
+    uint64_t random = next_random(&state);
+    if (random % 100 < MIXED_INSERT_PERCENT) {
+      insert_row(insert, next_id);
+      next_id += m->num_threads;
+    } else {
+      db_bind_id(select, 0, (random >> 8) % m->rows + 1);
+      m->rows_read += select_all(select);
+    }
+    histogram_record(&m->latency, now_ns() - start);
+  }
+  db_finalize(select);
+  db_finalize(insert);
+  return NULL;
+}
+
+void bench_mixed(const Options* options, Db* db, uint32_t rows, uint32_t cache_size) {
+  uint32_t num_threads = options->threads;
+  MixedThread* threads = calloc(num_threads, sizeof(MixedThread));
+  pthread_t* handles = malloc(num_threads * sizeof(pthread_t));
+  Result r;
+  result_start(&r, db, "mixed", rows, cache_size);
+  for (uint32_t i = 0; i < num_threads; i++) {
+    threads[i].db = db;
+    threads[i].index = i;
+    threads[i].num_threads = num_threads;
+    threads[i].rows = rows;
+    threads[i].ops = options->ops / num_threads + (i < options->ops % num_threads);
+    threads[i].seed = options->seed;
+    pthread_create(&handles[i], NULL, mixed_thread, &threads[i]);
+  }
+  for (uint32_t i = 0; i < num_threads; i++) {
+    pthread_join(handles[i], NULL);
+    histogram_merge(&r.latency, &threads[i].latency);
+    r.rows_read += threads[i].rows_read;
+  }
+  r.ops = options->ops;
+  result_finish(&r, db);
+  print_result(options, &r);
+  free(threads);
+  free(handles);
+}
+
+void bench(const Options* options, uint32_t rows, uint32_t cache_size) {
+  bench_inserts(options, rows, cache_size, false);
+  bench_inserts(options, rows, cache_size, true);
+
+  Db* db = open_db(options, cache_size);
+  bench_selects(options, db, rows, cache_size, "lookup", options->ops, 1);
+  bench_selects(options, db, rows, cache_size, "range", options->ops / 10, RANGE_ROWS);
+  bench_scans(options, db, rows, cache_size);
+  bench_mixed(options, db, rows, cache_size);
+  check(db_close(db), DB_OK, "db_close");
+  remove_db(options->filename);
+}
+
+// OPTIONS
+
+// parses a comma separated list of positive numbers
+uint32_t parse_list(const char* text, uint32_t* values) {
+  uint32_t count = 0;
+  char* end;
+  do {
+    long value = strtol(text, &end, 10);
+    if (end == text || value <= 0 || count == MAX_CONFIGS) {
+      return 0;
+    }
+    values[count++] = value;
+    text = end + 1;
+  } while (*end == ',');
+  return *end == '\0' ? count : 0;
+}
+
+void usage() {
+  fprintf(stderr,
+	  "Usage: ./bench [--rows n,...] [--cache-size n,...] [--ops n] [--scans n]\n"
+	  "               [--batch n] [--threads n] [--seed n] [--mmap] [--no-wal]\n"
+	  "               [--direct] [--file path] [--json]\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+  Options options = {
+    .rows = { 100000 }, .num_rows = 1,
+    .cache_sizes = { 2000 }, .num_cache_sizes = 1,
+    .ops = 100000, .scans = 5, .batch = 1000, .threads = 4, .seed = 1,
+    .mmap = false, .wal = true, .direct = false, .json = false, .filename = "bench.db",
+  };
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--rows") == 0 && has_value) {
+      options.num_rows = parse_list(argv[++i], options.rows);
+    } else if (strcmp(argv[i], "--cache-size") == 0 && has_value) {
+      options.num_cache_sizes = parse_list(argv[++i], options.cache_sizes);
+    } else if (strcmp(argv[i], "--ops") == 0 && has_value) {
+      options.ops = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--scans") == 0 && has_value) {
+      options.scans = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--batch") == 0 && has_value) {
+      options.batch = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+      options.threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && has_value) {
+      options.seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--file") == 0 && has_value) {
+      options.filename = argv[++i];
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      options.mmap = true;
+    } else if (strcmp(argv[i], "--no-wal") == 0) {
+      options.wal = false;
+    } else if (strcmp(argv[i], "--direct") == 0) {
+      options.direct = true;
+    } else if (strcmp(argv[i], "--json") == 0) {
+      options.json = true;
+    } else {
+      usage();
+    }
+  }
+  if (options.num_rows == 0 || options.num_cache_sizes == 0 || options.batch == 0
+      || options.threads == 0 || options.seed == 0) {
+    usage();
+  }
+
+  if (options.json) {
+    printf("{\"seed\": %lu, \"ops\": %u, \"scans\": %u, \"batch\": %u, \"threads\": %u, "
+	   "\"mmap\": %s, \"wal\": %s, \"direct\": %s, \"results\": [\n",
+	   (unsigned long) options.seed, options.ops, options.scans, options.batch,
+	   options.threads, options.mmap ? "true" : "false", options.wal ? "true" : "false",
+	   options.direct ? "true" : "false");
+  } else {
+    printf("%-14s %9s %6s %12s %9s %9s %9s %10s %10s %8s\n", "workload", "rows", "cache",
+	   "ops/s", "p50 us", "p99 us", "p999 us", "pages rd", "pages wr", "rss MB");
+  }
+  for (uint32_t i = 0; i < options.num_rows; i++) {
+    for (uint32_t j = 0; j < options.num_cache_sizes; j++) {
+      bench(&options, options.rows[i], options.cache_sizes[j]);
+    }
+  }
+  if (options.json) {
+    printf("\n]}\n");
+  }
+  return 0;
+}
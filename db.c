@@ -0,0 +1,6773 @@
+#define _GNU_SOURCE  // qsort_r, IOV_MAX, mremap
+#include <string.h>  // strcmp
+#include <stdbool.h>  // for using true and false keyword
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>  // some functions set `errno` in case of errors
+#include <unistd.h>  // file I/O
+#include <fcntl.h>  // for using file control options
+#include <stdint.h>
+#include <limits.h>  // IOV_MAX
+#include <pthread.h>  // background write-back
+#include <sys/uio.h>  // pwritev
+#include <sys/mman.h>  // memory-mapped pager
+#include <sys/stat.h>  // a backup must not overwrite the db
+#include <time.h>
+#include <setjmp.h>  // unwinding to the public call on failures
+#include <stdarg.h>
+#include <signal.h>  // engine threads block signals
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // AVX2 key search
+#define HAVE_X86_SIMD
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>  // read-ahead, through the raw system calls
+#define HAVE_IO_URING
+#endif
+#endif
+#include "db.h"
+
+// ERRORS
+
+// Failures the engine can't recover from, mostly I/O errors. Inside a
+// public call they unwind to it, see DB_GUARD, anywhere else, e.g. on
+// the write-back thread, they end the process.
+
+static __thread jmp_buf* fail_jump = NULL;
+static __thread char fail_message[256];
+
+__attribute__((noreturn, format(printf, 1, 2)))
+void db_fail(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(fail_message, sizeof(fail_message), format, args);
+  va_end(args);
+  if (fail_jump != NULL) {
+    longjmp(*fail_jump, 1);
+  }
+  printf("%s\n", fail_message);
+  exit(EXIT_FAILURE);
+}
+
+// STATISTICS
+
+// Counters of what the engine does, for `db_stats`. Each thread counts
+// in a block of its own, without locks or atomic read-modify-writes,
+// and `db_stats` sums the blocks. A thread registers its block the first
+// time it counts, its counts move to `stats_retired` when it exits. The
+// counters are shared by every handle in the process.
+
+enum Stat_t {
+	     STAT_CACHE_HITS,
+	     STAT_CACHE_MISSES,
+	     STAT_PAGES_READ,
+	     STAT_PAGES_WRITTEN,
+	     STAT_LEAF_SPLITS,
+	     STAT_INTERNAL_SPLITS,
+	     STAT_ROWS_SCANNED,
+	     STAT_CURSORS,
+	     STAT_READ_AHEAD_USED,
+	     STAT_READ_AHEAD_WASTED,
+	     NUM_STATS
+};
+typedef enum Stat_t Stat;
+
+struct StatBlock_t {
+  uint64_t counts[NUM_STATS];  // written by its thread alone
+  struct StatBlock_t* prev;
+  struct StatBlock_t* next;
+};
+typedef struct StatBlock_t StatBlock;
+
+static __thread StatBlock* thread_stats = NULL;
+// guards the list of blocks and the counts of threads that exited
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static StatBlock* stat_blocks = NULL;
+static uint64_t stats_retired[NUM_STATS];
+static pthread_key_t stats_key;  // retires the block of an exiting thread
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+void stats_retire(void* arg) {
+  StatBlock* block = arg;
+  pthread_mutex_lock(&stats_lock);
+  for (uint32_t i = 0; i < NUM_STATS; i++) {
+    stats_retired[i] += block->counts[i];
+  }
+  if (block->prev != NULL) {
+    block->prev->next = block->next;
+  } else {
+    stat_blocks = block->next;
+  }
+  if (block->next != NULL) {
+    block->next->prev = block->prev;
+  }
+  pthread_mutex_unlock(&stats_lock);
+  free(block);
+  thread_stats = NULL;
+}
+
+void stats_create_key() {
+  pthread_key_create(&stats_key, stats_retire);
+}
+
+StatBlock* stats_register() {
+  pthread_once(&stats_key_once, stats_create_key);
+  StatBlock* block = calloc(1, sizeof(StatBlock));
+  pthread_mutex_lock(&stats_lock);
+  block->prev = NULL;
+  block->next = stat_blocks;
+  if (stat_blocks != NULL) {
+    stat_blocks->prev = block;
+  }
+  stat_blocks = block;
+  pthread_mutex_unlock(&stats_lock);
+  pthread_setspecific(stats_key, block);
+  thread_stats = block;
+  return block;
+}
+
+void stat_add(Stat stat, uint64_t n) {
+  StatBlock* block = thread_stats;
+  if (block == NULL) {
+    block = stats_register();
+  }
+  // only this thread writes it, a reader may see the count a little late
+  __atomic_store_n(&block->counts[stat], block->counts[stat] + n, __ATOMIC_RELAXED);
+}
+
+// the caller holds `stats_lock`
+void stats_sum(uint64_t* counts) {
+  memcpy(counts, stats_retired, sizeof(stats_retired));
+  for (StatBlock* block = stat_blocks; block != NULL; block = block->next) {
+    for (uint32_t i = 0; i < NUM_STATS; i++) {
+      counts[i] += __atomic_load_n(&block->counts[i], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// The pages one statement touches, for `explain`. `db_step` points the
+// thread's `page_trace` at its statement's, and a scan lends it to the
+// pool threads working on it. Only traced statements pay for the lock.
+struct PageTrace_t {
+  pthread_mutex_t lock;
+  uint32_t* pages;  // page number + 1, open addressing, 0 marks an empty slot
+  uint32_t capacity;  // power of two, 0 before the first page
+  uint32_t num_pages;
+  uint32_t num_read;  // times a page missed the cache
+  uint32_t num_read_ahead;  // times a page was found read ahead
+};
+typedef struct PageTrace_t PageTrace;
+
+static __thread PageTrace* page_trace = NULL;
+
+void page_trace_init(PageTrace* trace) {
+  pthread_mutex_init(&trace->lock, NULL);
+  trace->pages = NULL;
+  trace->capacity = 0;
+  trace->num_pages = 0;
+  trace->num_read = 0;
+  trace->num_read_ahead = 0;
+}
+
+void page_trace_clear(PageTrace* trace) {
+  free(trace->pages);
+  trace->pages = NULL;
+  trace->capacity = 0;
+  trace->num_pages = 0;
+  trace->num_read = 0;
+  trace->num_read_ahead = 0;
+}
+
+void page_trace_insert(PageTrace* trace, uint32_t page_num) {
+  uint32_t mask = trace->capacity - 1;
+  uint32_t i = (page_num * 2654435761u) & mask;
+  while (trace->pages[i] != 0) {
+    if (trace->pages[i] == page_num + 1) {
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+  trace->pages[i] = page_num + 1;
+  trace->num_pages += 1;
+}
+
+void page_trace_add(PageTrace* trace, uint32_t page_num, bool read, bool read_ahead) {
+  pthread_mutex_lock(&trace->lock);
+  trace->num_read += read;
+  trace->num_read_ahead += read_ahead;
+  if (2 * (trace->num_pages + 1) > trace->capacity) {
+    // keeps the load factor at most 1/2
+    uint32_t* old_pages = trace->pages;
+    uint32_t old_capacity = trace->capacity;
+    trace->capacity = old_capacity == 0 ? 64 : 2 * old_capacity;
+    trace->pages = calloc(trace->capacity, sizeof(uint32_t));
+    trace->num_pages = 0;
+    for (uint32_t i = 0; i < old_capacity; i++) {
+      if (old_pages[i] != 0) {
+	page_trace_insert(trace, old_pages[i] - 1);
+      }
+    }
+    free(old_pages);
+  }
+  page_trace_insert(trace, page_num);
+  pthread_mutex_unlock(&trace->lock);
+}
+
+int compare_page_nums(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*) a;
+  uint32_t y = *(const uint32_t*) b;
+  return (x > y) - (x < y);
+}
+
+// ARENAS
+
+// Short-lived allocations of a statement, its cursors, come from an
+// arena the statement owns instead of one malloc each. `db_step` points
+// the thread's `statement_arena` at it and rewinds it once the statement
+// has nothing open, keeping the blocks for its next execution. Freed
+// allocations of one size go on a list the next of that size is taken
+// from, so an index scan's cursor per row doesn't grow the arena. Work
+// outside `db_step`, e.g. on the scan pool threads, uses malloc.
+
+#define ARENA_BLOCK_SIZE 4096
+
+struct ArenaBlock_t {
+  struct ArenaBlock_t* next;
+  uint8_t data[ARENA_BLOCK_SIZE];
+};
+typedef struct ArenaBlock_t ArenaBlock;
+
+struct Arena_t {
+  ArenaBlock* first;
+  ArenaBlock* current;  // blocks after it are kept from before a rewind
+  size_t used;  // bytes of the current block handed out
+  void* free_list;  // freed allocations, linked through their first word
+  size_t free_size;  // their size
+};
+typedef struct Arena_t Arena;
+
+static __thread Arena* statement_arena = NULL;
+
+void arena_init(Arena* a) {
+  a->first = NULL;
+  a->current = NULL;
+  a->used = 0;
+  a->free_list = NULL;
+  a->free_size = 0;
+}
+
+void* arena_alloc(Arena* a, size_t size) {
+  size = (size + 15) & ~(size_t) 15;
+  if (size == a->free_size && a->free_list != NULL) {
+    void* p = a->free_list;
+    a->free_list = *(void**) p;
+    return p;
+  }
+  if (a->current == NULL || a->used + size > ARENA_BLOCK_SIZE) {
+    ArenaBlock* next = a->current == NULL ? a->first : a->current->next;
+    if (next == NULL) {
+      next = malloc(sizeof(ArenaBlock));
+      next->next = NULL;
+      if (a->current == NULL) {
+	a->first = next;
+      } else {
+	a->current->next = next;
+      }
+    }
+    a->current = next;
+    a->used = 0;
+  }
+  void* p = a->current->data + a->used;
+  a->used += size;
+  return p;
+}
+
+void arena_free(Arena* a, void* p, size_t size) {
+  size = (size + 15) & ~(size_t) 15;
+  if (a->free_size != size) {
+    a->free_list = NULL;  // only one size is reused, the blocks still hold the rest
+    a->free_size = size;
+  }
+  *(void**) p = a->free_list;
+  a->free_list = p;
+}
+
+// hands everything back at once, nothing allocated may be in use
+void arena_rewind(Arena* a) {
+  a->current = NULL;
+  a->used = 0;
+  a->free_list = NULL;
+}
+
+void arena_release(Arena* a) {
+  while (a->first != NULL) {
+    ArenaBlock* next = a->first->next;
+    free(a->first);
+    a->first = next;
+  }
+  arena_init(a);
+}
+
+// CORE: SQL COMMAND PROCESSOR
+
+#define DEFAULT_CACHE_SIZE 2000  // buffer pool frames
+#define PAGER_MIN_FRAMES 16
+#define DEFAULT_WRITEBACK_THRESHOLD 256  // dirty pages that wake the writer
+#define MMAP_RESERVE_SIZE (1ULL << 40)  // address space kept for the mapping
+#define MMAP_MIN_GROWTH_PAGES 64
+#define HUGE_PAGE_SIZE (2 << 20)  // frames are mapped in multiples of it with `huge_pages`
+#define DEFAULT_FILL_FACTOR 90  // percent of a node filled by `.import`
+#define DEFAULT_READ_AHEAD_PAGES 64  // most leaves a scan reads ahead
+#define size_of_attr(type, attr) sizeof(((type*)0)->attr)
+
+const uint32_t ID_SIZE = size_of_attr(Row, id);
+
+// The page size is chosen when a db file is created and recorded in its
+// header, each pager keeps that of its file. The node layout follows
+// from it: node functions read `node_page_size`, that of the db the
+// thread is working on, set from the handle by DB_GUARD and from the
+// table for scan threads.
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE 65536  // leaves address their cells with 16 bits
+static __thread uint32_t node_page_size = DEFAULT_PAGE_SIZE;
+
+// A row is stored as its id followed by the username and the email, each
+// prefixed by its length, and padded to a multiple of 4 bytes.
+const uint32_t ROW_LENGTH_SIZE = sizeof(uint8_t);
+const uint32_t ROW_ALIGNMENT = sizeof(uint32_t);
+const uint32_t ROW_MAX_SIZE = (ID_SIZE + 2 * ROW_LENGTH_SIZE + COLUMN_USERNAME_SIZE
+			       + COLUMN_EMAIL_SIZE + ROW_ALIGNMENT - 1) & ~(ROW_ALIGNMENT - 1);
+
+enum PrepareResult_t {
+		      PREPARE_SUCCESS,
+		      PREPARE_UNRECOGNIZED_STATEMENT,
+		      PREPARE_SYNTAX_ERROR,
+		      PREPARE_STRING_TOO_LONG,
+		      PREPARE_NEGATIVE_ID
+};
+typedef enum PrepareResult_t PrepareResult;
+
+enum StatementType_t {
+		      STATEMENT_INSERT,
+		      STATEMENT_SELECT,
+		      STATEMENT_BEGIN,
+		      STATEMENT_COMMIT,
+		      STATEMENT_DELETE,
+		      STATEMENT_CREATE_INDEX
+};
+typedef enum StatementType_t StatementType;
+
+// what a select returns, its rows or one value computed over them
+enum Aggregate_t {
+		  AGGREGATE_NONE,
+		  AGGREGATE_COUNT,
+		  AGGREGATE_MIN,
+		  AGGREGATE_MAX,
+		  AGGREGATE_SUM
+};
+typedef enum Aggregate_t Aggregate;
+
+// the text columns, which conditions compare and indexes cover
+enum Column_t {
+	       COLUMN_USERNAME,
+	       COLUMN_EMAIL
+};
+typedef enum Column_t Column;
+
+#define NUM_TEXT_COLUMNS 2
+
+uint32_t column_size(Column column) {
+  return column == COLUMN_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE;
+}
+
+char* column_value(Row* row, Column column) {
+  return column == COLUMN_USERNAME ? row->username : row->email;
+}
+
+struct Statement_t {
+  StatementType type;
+  Row row; // required for insert statement
+  uint32_t id_low, id_high;  // ids a delete or select covers, inclusive
+  uint32_t limit;  // rows a select returns at most
+  uint32_t offset;  // rows a select skips before those
+  Aggregate aggregate;
+  // `where <column> = ...` or `like ...`, the value is in `row`
+  bool match;
+  Column match_column;
+  bool match_prefix;  // `like '<prefix>%'`, the value is the prefix
+  Column index_column;  // of `create index on <column>`
+  bool explain;  // `explain <statement>`, traces the pages it touches
+};
+typedef struct Statement_t Statement;
+
+// `?` placeholders of a statement, see `db_prepare`
+
+#define STATEMENT_MAX_PARAMS 8
+
+enum CompareOp_t {
+		  COMPARE_EQUAL,
+		  COMPARE_GREATER_EQUAL,
+		  COMPARE_LESS_EQUAL,
+		  COMPARE_GREATER,
+		  COMPARE_LESS,
+		  COMPARE_LIKE  // text conditions only
+};
+typedef enum CompareOp_t CompareOp;
+
+enum ParamTarget_t {
+		    PARAM_ROW_ID,
+		    PARAM_USERNAME,
+		    PARAM_EMAIL,
+		    PARAM_CONDITION,  // `id <op> ?` of a delete or select
+		    PARAM_LIMIT,
+		    PARAM_OFFSET
+};
+typedef enum ParamTarget_t ParamTarget;
+
+struct Param_t {
+  ParamTarget target;
+  CompareOp op;  // for PARAM_CONDITION and text conditions
+  uint32_t id;  // bound value of a condition
+  bool is_bound;
+};
+typedef struct Param_t Param;
+
+struct Params_t {
+  uint32_t count;
+  Param items[STATEMENT_MAX_PARAMS];
+};
+typedef struct Params_t Params;
+
+// True if `token` is a placeholder, which is then recorded in `params`
+bool prepare_param(Params* params, char* token, ParamTarget target, CompareOp op,
+		   PrepareResult* result) {
+  if (token == NULL || strcmp(token, "?") != 0) {
+    return false;
+  }
+  if (params->count == STATEMENT_MAX_PARAMS) {
+    *result = PREPARE_SYNTAX_ERROR;
+    return true;
+  }
+  Param* param = &params->items[params->count++];
+  param->target = target;
+  param->op = op;
+  param->is_bound = false;
+  *result = PREPARE_SUCCESS;
+  return true;
+}
+
+// validates the columns of a row, shared by `insert` and `.import`
+PrepareResult prepare_row(char* id_str, char* username, char* email, Row* row) {
+  if (id_str == NULL || username == NULL || email == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  int id = atoi(id_str);
+  if (id < 0) {
+    return PREPARE_NEGATIVE_ID;
+  }
+  if (strlen(username) > COLUMN_USERNAME_SIZE
+      || strlen(email) > COLUMN_EMAIL_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  row->id = id;
+  strcpy(row->username, username);
+  strcpy(row->email, email);
+  return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_insert(char* sql, Statement* s, Params* params) {
+  s->type = STATEMENT_INSERT;
+  char* save;  // the tokenizer's position, threads prepare at the same time
+  strtok_r(sql, " ", &save);  // the keyword
+  char* id_str = strtok_r(NULL, " ", &save);
+  char* username = strtok_r(NULL, " ", &save);
+  char* email = strtok_r(NULL, " ", &save);
+
+  // placeholders validate as blank values until they are bound
+  PrepareResult result = PREPARE_SUCCESS;
+  if (prepare_param(params, id_str, PARAM_ROW_ID, COMPARE_EQUAL, &result)) {
+    id_str = "0";
+  }
+  if (prepare_param(params, username, PARAM_USERNAME, COMPARE_EQUAL, &result)) {
+    username = "";
+  }
+  if (prepare_param(params, email, PARAM_EMAIL, COMPARE_EQUAL, &result)) {
+    email = "";
+  }
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  return prepare_row(id_str, username, email, &s->row);
+}
+
+// parses a whole token as a non-negative id
+PrepareResult prepare_id(char* token, uint32_t* id) {
+  if (token == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  char* end;
+  long value = strtol(token, &end, 10);
+  if (end == token || *end != 0 || value > INT_MAX) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (value < 0) {
+    return PREPARE_NEGATIVE_ID;
+  }
+  *id = value;
+  return PREPARE_SUCCESS;
+}
+
+bool parse_compare_op(char* token, CompareOp* op) {
+  const char* names[] = { "=", ">=", "<=", ">", "<", "like" };
+  for (uint32_t i = 0; token != NULL && i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(token, names[i]) == 0) {
+      *op = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// conditions are and'ed, the id range narrows to their intersection
+void apply_condition(Statement* s, CompareOp op, uint32_t id) {
+  uint32_t low = 0;
+  uint32_t high = UINT32_MAX;
+  switch (op) {
+  case COMPARE_EQUAL:
+    low = id;
+    high = id;
+    break;
+  case COMPARE_GREATER_EQUAL:
+    low = id;
+    break;
+  case COMPARE_LESS_EQUAL:
+    high = id;
+    break;
+  case COMPARE_GREATER:
+    low = id + 1;
+    break;
+  case COMPARE_LESS:
+    if (id > 0) {
+      high = id - 1;
+    } else {
+      low = 1;  // nothing is below 0
+      high = 0;
+    }
+    break;
+  case COMPARE_LIKE:
+    break;
+  }
+  s->id_low = low > s->id_low ? low : s->id_low;
+  s->id_high = high < s->id_high ? high : s->id_high;
+}
+
+// an id compared with `op`, or a placeholder for it
+PrepareResult prepare_condition(char* token, CompareOp op, Statement* s, Params* params) {
+  PrepareResult result;
+  if (prepare_param(params, token, PARAM_CONDITION, op, &result)) {
+    return result;
+  }
+  uint32_t id;
+  result = prepare_id(token, &id);
+  if (result == PREPARE_SUCCESS) {
+    apply_condition(s, op, id);
+  }
+  return result;
+}
+
+// `delete <id>` or `delete where id between <low> and <high>`
+PrepareResult prepare_delete(char* sql, Statement* s, Params* params) {
+  s->type = STATEMENT_DELETE;
+  s->id_low = 0;
+  s->id_high = UINT32_MAX;
+  char* save;
+  strtok_r(sql, " ", &save);  // the keyword
+  char* token = strtok_r(NULL, " ", &save);
+  PrepareResult result;
+  if (token != NULL && strcmp(token, "where") == 0) {
+    char* column = strtok_r(NULL, " ", &save);
+    char* between = strtok_r(NULL, " ", &save);
+    if (column == NULL || strcmp(column, "id") != 0
+	|| between == NULL || strcmp(between, "between") != 0) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    result = prepare_condition(strtok_r(NULL, " ", &save), COMPARE_GREATER_EQUAL, s, params);
+    char* and = strtok_r(NULL, " ", &save);
+    if (result == PREPARE_SUCCESS && (and == NULL || strcmp(and, "and") != 0)) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (result == PREPARE_SUCCESS) {
+      result = prepare_condition(strtok_r(NULL, " ", &save), COMPARE_LESS_EQUAL, s, params);
+    }
+  } else {
+    result = prepare_condition(token, COMPARE_EQUAL, s, params);
+  }
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  return strtok_r(NULL, " ", &save) == NULL ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+bool parse_aggregate(char* token, Aggregate* aggregate) {
+  const char* names[] = { "count(*)", "min(id)", "max(id)", "sum(id)" };
+  for (uint32_t i = 0; token != NULL && i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(token, names[i]) == 0) {
+      *aggregate = AGGREGATE_COUNT + i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Sets the value a text condition compares with. Only a trailing `%`
+// is a wildcard, `like` without one is the same as `=`.
+PrepareResult set_match_value(Statement* s, CompareOp op, const char* text) {
+  size_t length = strlen(text);
+  s->match_prefix = op == COMPARE_LIKE && length > 0 && text[length - 1] == '%';
+  if (s->match_prefix) {
+    length -= 1;
+  }
+  if (length > column_size(s->match_column)) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  char* value = column_value(&s->row, s->match_column);
+  memcpy(value, text, length);
+  value[length] = 0;
+  return PREPARE_SUCCESS;
+}
+
+// `<column> = <value>` or `<column> like <value>`, the value may be
+// quoted with '...' or a placeholder. A select has at most one.
+PrepareResult prepare_text_condition(char* token, Column column, CompareOp op,
+				     Statement* s, Params* params) {
+  if (s->match || (op != COMPARE_EQUAL && op != COMPARE_LIKE)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  s->match = true;
+  s->match_column = column;
+  s->match_prefix = false;
+  PrepareResult result;
+  ParamTarget target = column == COLUMN_USERNAME ? PARAM_USERNAME : PARAM_EMAIL;
+  if (prepare_param(params, token, target, op, &result)) {
+    return result;
+  }
+  if (token == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  size_t length = strlen(token);
+  if (length >= 2 && token[0] == '\'' && token[length - 1] == '\'') {
+    token[length - 1] = 0;
+    token += 1;
+  }
+  return set_match_value(s, op, token);
+}
+
+// `select [count(*)|min(id)|max(id)|sum(id)] [where <cond> [and <cond>]...]
+// [limit <k>] [offset <m>]`, with <cond> either `id <op> <n>`, <op> one of
+// =, >=, <=, >, <, or one `username|email = <value>` or `like <prefix>%`.
+// As in SQL, limit and offset apply to the one row of an aggregate:
+// `limit 0` or any offset leaves none.
+PrepareResult prepare_select(char* sql, Statement* s, Params* params) {
+  s->type = STATEMENT_SELECT;
+  s->id_low = 0;
+  s->id_high = UINT32_MAX;
+  s->limit = UINT32_MAX;
+  s->offset = 0;
+  s->aggregate = AGGREGATE_NONE;
+  s->match = false;
+  char* save;
+  char* keyword = strtok_r(sql, " ", &save);
+  if (strcmp(keyword, "select") != 0) {
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+  }
+  char* token = strtok_r(NULL, " ", &save);
+  if (parse_aggregate(token, &s->aggregate)) {
+    token = strtok_r(NULL, " ", &save);
+  }
+
+  if (token != NULL && strcmp(token, "where") == 0) {
+    do {
+      char* column = strtok_r(NULL, " ", &save);
+      CompareOp op = COMPARE_EQUAL;
+      bool is_op = parse_compare_op(strtok_r(NULL, " ", &save), &op);
+      bool is_username = column != NULL && strcmp(column, "username") == 0;
+      if (is_username || (column != NULL && strcmp(column, "email") == 0)) {
+	if (!is_op) {
+	  return PREPARE_SYNTAX_ERROR;
+	}
+	PrepareResult result = prepare_text_condition(strtok_r(NULL, " ", &save),
+						      is_username ? COLUMN_USERNAME : COLUMN_EMAIL,
+						      op, s, params);
+	if (result != PREPARE_SUCCESS) {
+	  return result;
+	}
+	token = strtok_r(NULL, " ", &save);
+	continue;
+      }
+      PrepareResult result = prepare_condition(strtok_r(NULL, " ", &save), op, s, params);
+      if (result != PREPARE_SUCCESS) {
+	return result;
+      }
+      if (column == NULL || strcmp(column, "id") != 0 || !is_op || op == COMPARE_LIKE) {
+	return PREPARE_SYNTAX_ERROR;
+      }
+      token = strtok_r(NULL, " ", &save);
+    } while (token != NULL && strcmp(token, "and") == 0);
+  }
+
+  if (token != NULL && strcmp(token, "limit") == 0) {
+    PrepareResult result;
+    char* value = strtok_r(NULL, " ", &save);
+    if (!prepare_param(params, value, PARAM_LIMIT, COMPARE_EQUAL, &result)) {
+      result = prepare_id(value, &s->limit);
+    }
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    token = strtok_r(NULL, " ", &save);
+  }
+
+  if (token != NULL && strcmp(token, "offset") == 0) {
+    PrepareResult result;
+    char* value = strtok_r(NULL, " ", &save);
+    if (!prepare_param(params, value, PARAM_OFFSET, COMPARE_EQUAL, &result)) {
+      result = prepare_id(value, &s->offset);
+    }
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    token = strtok_r(NULL, " ", &save);
+  }
+  return token == NULL ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+// `create index on username|email`
+PrepareResult prepare_create_index(char* sql, Statement* s) {
+  s->type = STATEMENT_CREATE_INDEX;
+  char* save;
+  strtok_r(sql, " ", &save);  // the keyword
+  char* index = strtok_r(NULL, " ", &save);
+  char* on = strtok_r(NULL, " ", &save);
+  char* column = strtok_r(NULL, " ", &save);
+  if (index == NULL || strcmp(index, "index") != 0 || on == NULL || strcmp(on, "on") != 0
+      || column == NULL || strtok_r(NULL, " ", &save) != NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (strcmp(column, "username") == 0) {
+    s->index_column = COLUMN_USERNAME;
+  } else if (strcmp(column, "email") == 0) {
+    s->index_column = COLUMN_EMAIL;
+  } else {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return PREPARE_SUCCESS;
+}
+
+// Parses `sql`, which it tokenizes in place. `?` tokens in place of
+// values are recorded in `params` instead of being parsed.
+PrepareResult prepare_sql(char* sql, Statement* s, Params* params) {
+  s->explain = strncmp(sql, "explain ", 8) == 0;
+  if (s->explain) {
+    sql += 8;
+  }
+
+  if (strncmp(sql, "insert", 6) == 0) {
+    return prepare_insert(sql, s, params);
+  }
+
+  if (strncmp(sql, "delete", 6) == 0) {
+    return prepare_delete(sql, s, params);
+  }
+
+  if (strncmp(sql, "select", 6) == 0) {
+    return prepare_select(sql, s, params);
+  }
+
+  if (strncmp(sql, "create", 6) == 0) {
+    return prepare_create_index(sql, s);
+  }
+
+  if (strcmp(sql, "begin") == 0) {
+    s->type = STATEMENT_BEGIN;
+    return PREPARE_SUCCESS;
+  }
+
+  if (strcmp(sql, "commit") == 0) {
+    s->type = STATEMENT_COMMIT;
+    return PREPARE_SUCCESS;
+  }
+
+  return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+
+// BACK END: WRITE-AHEAD LOG
+
+// Committed pages are appended to `<db>-wal` as full page images before
+// they may reach the db file. Layout: a WAL header followed by frames,
+// each a frame header and a page. Frame checksums are chained, so a torn
+// tail is detected and ignored on recovery. The frame that ends a
+// transaction records the db size in pages, frames after the last such
+// commit frame are not replayed.
+
+#define WAL_MAGIC 0x57414c31  // "WAL1"
+#define WAL_AUTOCHECKPOINT 1000  // frames
+
+const uint32_t WAL_HEADER_SIZE = 4 * sizeof(uint32_t);  // magic, page size, salt, unused
+const uint32_t WAL_FRAME_HEADER_SIZE = 4 * sizeof(uint32_t);  // page num, db size, salt, checksum
+
+struct Wal_t {
+  int file_desc;
+  uint32_t page_size;  // of the db, every frame holds one page
+  uint32_t salt;  // changes on every reset, frames of older generations are stale
+  uint32_t checksum;  // checksum of the last frame appended
+  uint64_t end;  // offset where the next frame goes
+  uint32_t num_frames;
+
+  // group commit: one fdatasync covers every frame appended before it
+  // started, concurrent committers wait for it instead of syncing again
+  pthread_mutex_t lock;
+  pthread_cond_t synced_cond;
+  uint64_t synced;  // everything before this offset is durable
+  bool syncing;
+};
+typedef struct Wal_t Wal;
+
+uint32_t wal_checksum(uint32_t page_size, uint32_t seed, uint32_t page_num, uint32_t db_size,
+		      void* page) {
+  // FNV-1a over 32 bit words
+  uint32_t h = seed ^ 2166136261u;
+  h = (h ^ page_num) * 16777619u;
+  h = (h ^ db_size) * 16777619u;
+  uint32_t* words = page;
+  for (uint32_t i = 0; i < page_size / sizeof(uint32_t); i++) {
+    h = (h ^ words[i]) * 16777619u;
+  }
+  return h;
+}
+
+void wal_reset(Wal* wal) {
+  uint32_t header[4] = { WAL_MAGIC, wal->page_size, wal->salt + 1, 0 };
+  if (ftruncate(wal->file_desc, 0) == -1
+      || pwrite(wal->file_desc, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE
+      || fdatasync(wal->file_desc) == -1) {
+    db_fail("Error resetting WAL: %d", errno);
+  }
+  wal->salt = header[2];
+  wal->checksum = wal->salt;
+  wal->end = WAL_HEADER_SIZE;
+  wal->synced = wal->end;
+  wal->num_frames = 0;
+}
+
+// Buffers the db file is read into or written from outside the frames
+// are page aligned too, as a file opened with O_DIRECT needs.
+void* page_buffer_alloc(uint32_t page_size, uint32_t num_pages) {
+  void* buffer;
+  if (posix_memalign(&buffer, page_size, (size_t) num_pages * page_size) != 0) {
+    db_fail("Out of memory.");
+  }
+  return buffer;
+}
+
+// Copies every committed frame into the db file. Returns the db size in
+// pages recorded by the last commit, or 0 if there was nothing to replay.
+uint32_t wal_replay(Wal* wal, int db_file_desc) {
+  uint32_t header[4];
+  if (pread(wal->file_desc, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE
+      || header[0] != WAL_MAGIC || header[1] != wal->page_size) {
+    return 0;
+  }
+  wal->salt = header[2];
+
+  void* page = page_buffer_alloc(wal->page_size, 1);
+  uint32_t frame_header[4];
+  uint32_t checksum = wal->salt;
+  uint64_t offset = WAL_HEADER_SIZE;
+  uint64_t commit_end = offset;
+  uint32_t db_size = 0;
+
+  // first pass finds the end of the last complete transaction
+  while (true) {
+    if (pread(wal->file_desc, frame_header, WAL_FRAME_HEADER_SIZE, offset) != WAL_FRAME_HEADER_SIZE
+	|| pread(wal->file_desc, page, wal->page_size, offset + WAL_FRAME_HEADER_SIZE) != wal->page_size
+	|| frame_header[2] != wal->salt) {
+      break;
+    }
+    checksum = wal_checksum(wal->page_size, checksum, frame_header[0], frame_header[1], page);
+    if (checksum != frame_header[3]) {
+      break;
+    }
+    offset += WAL_FRAME_HEADER_SIZE + wal->page_size;
+    if (frame_header[1] != 0) {
+      commit_end = offset;
+      db_size = frame_header[1];
+    }
+  }
+
+  // second pass copies those frames, later images overwrite earlier ones
+  for (offset = WAL_HEADER_SIZE; offset < commit_end; offset += WAL_FRAME_HEADER_SIZE + wal->page_size) {
+    if (pread(wal->file_desc, frame_header, WAL_FRAME_HEADER_SIZE, offset) != WAL_FRAME_HEADER_SIZE
+	|| pread(wal->file_desc, page, wal->page_size, offset + WAL_FRAME_HEADER_SIZE)
+	   != wal->page_size) {
+      db_fail("Error replaying WAL: %d", errno);
+    }
+    if (pwrite(db_file_desc, page, wal->page_size, (off_t) frame_header[0] * wal->page_size) != wal->page_size) {
+      db_fail("Error replaying WAL: %d", errno);
+    }
+  }
+  free(page);
+
+  if (db_size > 0) {
+    if (ftruncate(db_file_desc, (off_t) db_size * wal->page_size) == -1
+	|| fsync(db_file_desc) == -1) {
+      db_fail("Error replaying WAL: %d", errno);
+    }
+  }
+  return db_size;
+}
+
+// the page size of the frames in `<db>-wal`, 0 if there is no log
+uint32_t wal_page_size(const char* db_filename) {
+  char* filename = malloc(strlen(db_filename) + 5);
+  sprintf(filename, "%s-wal", db_filename);
+  int fd = open(filename, O_RDONLY);
+  free(filename);
+  uint32_t header[4];
+  uint32_t page_size = 0;
+  if (fd != -1 && pread(fd, header, WAL_HEADER_SIZE, 0) == WAL_HEADER_SIZE
+      && header[0] == WAL_MAGIC) {
+    page_size = header[1];
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  return page_size;
+}
+
+// opens `<db>-wal`, replaying it into the db file if the last session
+// did not checkpoint
+Wal* wal_open(const char* db_filename, int db_file_desc, uint32_t page_size) {
+  char* filename = malloc(strlen(db_filename) + 5);
+  sprintf(filename, "%s-wal", db_filename);
+  int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  free(filename);
+  if (fd == -1) {
+    db_fail("Unable to open WAL file.");
+  }
+
+  Wal* wal = malloc(sizeof(Wal));
+  wal->file_desc = fd;
+  wal->page_size = page_size;
+  wal->salt = 0;
+  pthread_mutex_init(&wal->lock, NULL);
+  pthread_cond_init(&wal->synced_cond, NULL);
+  wal->syncing = false;
+
+  wal_replay(wal, db_file_desc);
+  wal_reset(wal);
+  return wal;
+}
+
+void wal_close(Wal* wal, const char* db_filename, bool remove_file) {
+  close(wal->file_desc);
+  if (remove_file) {
+    char* filename = malloc(strlen(db_filename) + 5);
+    sprintf(filename, "%s-wal", db_filename);
+    unlink(filename);
+    free(filename);
+  }
+  pthread_mutex_destroy(&wal->lock);
+  pthread_cond_destroy(&wal->synced_cond);
+  free(wal);
+}
+
+// Appends one transaction, `pages[i]` being the image of `page_nums[i]`.
+// Returns the offset the log has to be synced to for it to be durable.
+// With a `db_size` of 0 the frames are appended without committing.
+uint64_t wal_append(Wal* wal, uint32_t* page_nums, void** pages, uint32_t count, uint32_t db_size) {
+  uint32_t* frame_headers = malloc(count * WAL_FRAME_HEADER_SIZE);
+  struct iovec iov[IOV_MAX];
+  uint32_t num_iov = 0;
+  uint64_t batch_start = wal->end;
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t* frame_header = frame_headers + 4 * i;
+    frame_header[0] = page_nums[i];
+    frame_header[1] = (i == count - 1) ? db_size : 0;
+    frame_header[2] = wal->salt;
+    wal->checksum = wal_checksum(wal->page_size, wal->checksum, frame_header[0], frame_header[1], pages[i]);
+    frame_header[3] = wal->checksum;
+
+    iov[num_iov].iov_base = frame_header;
+    iov[num_iov++].iov_len = WAL_FRAME_HEADER_SIZE;
+    iov[num_iov].iov_base = pages[i];
+    iov[num_iov++].iov_len = wal->page_size;
+    wal->end += WAL_FRAME_HEADER_SIZE + wal->page_size;
+
+    if (num_iov == IOV_MAX || i == count - 1) {
+      ssize_t expected = wal->end - batch_start;
+      if (pwritev(wal->file_desc, iov, num_iov, batch_start) != expected) {
+	db_fail("Error writing WAL: %d", errno);
+      }
+      batch_start = wal->end;
+      num_iov = 0;
+    }
+  }
+  wal->num_frames += count;
+  free(frame_headers);
+  return wal->end;
+}
+
+// blocks until everything up to `lsn` is durable
+void wal_sync(Wal* wal, uint64_t lsn) {
+  pthread_mutex_lock(&wal->lock);
+  while (wal->synced < lsn) {
+    if (wal->syncing) {
+      // another committer is the leader, its sync may cover us
+      pthread_cond_wait(&wal->synced_cond, &wal->lock);
+      continue;
+    }
+    wal->syncing = true;
+    uint64_t target = wal->end;
+    pthread_mutex_unlock(&wal->lock);
+    if (fdatasync(wal->file_desc) == -1) {
+      db_fail("Error syncing WAL: %d", errno);
+    }
+    pthread_mutex_lock(&wal->lock);
+    wal->synced = target;
+    wal->syncing = false;
+    pthread_cond_broadcast(&wal->synced_cond);
+  }
+  pthread_mutex_unlock(&wal->lock);
+}
+
+
+// BACK END: PAGER
+
+enum PagerMode_t {
+		  PAGER_BUFFERED,
+		  PAGER_MMAP
+};
+typedef enum PagerMode_t PagerMode;
+
+// Pages are cached in a fixed pool of frames. A hash table maps page
+// numbers to frames and CLOCK picks the victim when the pool is full.
+// A page stays resident for as long as it is pinned: every `get_page`
+// pins the page and must be paired with a `pager_unpin`. Callers that
+// modify a page call `pager_mark_dirty` first, only dirty pages are
+// ever written back.
+//
+// With a WAL, pages modified by the open transaction are only written
+// to the log on `pager_commit` and are never evicted before that. A
+// committed page may reach the db file once the log is synced past its
+// last frame, `pager_checkpoint` then empties the log. A transaction
+// that outgrows the cache spills pages to the log uncommitted, they are
+// read back from there until the commit copies them into the db file.
+//
+// The frames are one mapping, see `pager_map_frames`. With `direct` the
+// db file is opened O_DIRECT: pages go between the frames and the disk
+// without a second copy in the kernel page cache, which leaves the
+// memory to the frames. The log is still written through the kernel.
+//
+// In PAGER_MMAP mode the whole file is mapped instead, `get_page`
+// returns a pointer into the mapping and the kernel page cache does the
+// caching, pins and dirty bits are not needed. The mapping lives at the
+// start of a large reserved address range so that growing it never
+// moves pages that are already handed out.
+//
+// Several threads may use the pages at once. The frames lock guards the
+// bookkeeping: the frames, the hash chains and the spill table. It is
+// only held for that, and for the reads and writes of evicting a page.
+// What is in a page is guarded by its latch, see `pager_latch`. A page
+// can also be read ahead into its frame without the frames lock, see
+// BACK END: READ-AHEAD.
+
+struct Frame_t {
+  uint32_t page_num;
+  uint32_t pin_count;
+  bool in_use;
+  bool referenced;  // CLOCK reference bit
+  bool dirty;  // differs from the db file
+  bool txn_dirty;  // modified by the open transaction, not logged yet
+  uint64_t lsn;  // WAL offset just past the last frame of this page
+  int32_t next;  // next frame in the same hash bucket, -1 ends the chain
+  pthread_rwlock_t latch;  // guards the page while pinned, see `pager_latch`
+  bool loading;  // being read ahead, accessed atomically
+  bool read_ahead;  // read ahead and not asked for since
+  int load_error;  // errno of a failed read-ahead, 0 if it succeeded
+};
+typedef struct Frame_t Frame;
+
+typedef struct ReadAhead_t ReadAhead;
+typedef struct Snapshot_t Snapshot;
+
+struct Pager_t {
+  PagerMode mode;
+  int file_desc;
+  uint32_t page_size;  // read from the header, or chosen for a new file
+  off_t file_length;  // bytes, past 4 GiB for large tables
+  uint32_t num_pages;
+
+  // PAGER_MMAP
+  void* map;
+  size_t map_size;  // bytes of the file currently mapped
+
+  // PAGER_BUFFERED
+  uint32_t num_frames;
+  void* frame_data;  // num_frames * page_size bytes
+  size_t frame_data_size;  // bytes mapped for them
+  bool direct;  // the file is opened O_DIRECT
+  Frame* frames;
+  int32_t* buckets;  // page number -> first frame of the chain
+  uint32_t num_buckets;
+  uint32_t clock_hand;
+  uint32_t num_dirty;
+
+  Wal* wal;  // NULL when logging is disabled
+  int32_t* txn_frames;  // frames modified by the open transaction
+  uint32_t num_txn_frames;
+
+  // pages of the open transaction spilled to the log, open addressing
+  uint32_t* spilled_pages;  // page number + 1, 0 marks an empty slot
+  uint64_t* spilled_offsets;  // where the latest image of the page is
+  uint32_t spilled_capacity;  // power of two
+  uint32_t num_spilled;
+
+  pthread_mutex_t frames_lock;  // recursive, see `pager_frames_lock`
+
+  // optional background write-back, see `pager_start_writeback`
+  pthread_mutex_t lock;  // the writer lock, see `pager_lock`
+  pthread_cond_t writeback_cond;
+  pthread_t writeback_thread;
+  bool writeback_running;
+  bool writeback_stop;
+  uint32_t writeback_threshold;
+  uint32_t writeback_interval_ms;
+
+  // see BACK END: READ-AHEAD
+  ReadAhead* read_ahead;  // NULL when pages are read in the foreground only
+  uint32_t read_ahead_pages;  // most leaves a scan reads ahead, 0 for none
+  uint64_t read_ahead_used;  // pages read ahead that were then asked for
+  uint64_t read_ahead_wasted;  // and those evicted before they were
+
+  // see BACK END: SNAPSHOTS, set and cleared by the writer
+  Snapshot* snapshot;  // NULL when no backup is running
+};
+typedef struct Pager_t Pager;
+
+// see BACK END: READ-AHEAD
+void read_ahead_wait(Pager* pager, Frame* frame);
+void read_ahead_drain(Pager* pager);
+
+// see BACK END: SNAPSHOTS
+void snapshot_preserve(Pager* pager, uint32_t page_num);
+void snapshot_free(Snapshot* snapshot);
+
+void pager_update_page_count(Pager* pager);  // see the db header
+
+// Maps `size` > 0 bytes for the frames, page aligned. With `huge_pages`
+// they come from the huge pages reserved with `vm.nr_hugepages` if there
+// are enough, else the kernel is asked to back them with transparent huge
+// pages, which saves TLB misses on a large cache.
+void* pager_map_frames(size_t size, bool huge_pages, size_t* mapped_size) {
+  void* frames = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (huge_pages) {
+    size_t huge_size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+    frames = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    *mapped_size = huge_size;
+  }
+#endif
+  if (frames == MAP_FAILED) {
+    frames = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (frames == MAP_FAILED) {
+      db_fail("Unable to allocate the page cache: %d", errno);
+    }
+    *mapped_size = size;
+#ifdef MADV_HUGEPAGE
+    if (size >= HUGE_PAGE_SIZE) {
+      madvise(frames, size, MADV_HUGEPAGE);
+    }
+#endif
+  }
+  return frames;
+}
+
+uint32_t db_file_page_size(const char* filename, int file_desc);  // see header
+
+// `page_size` is that of a new db file, an existing one keeps its own
+Pager* pager_open(const char* filename, uint32_t num_frames, PagerMode mode, bool use_wal,
+		  bool direct, bool huge_pages, uint32_t page_size) {
+  direct = direct && mode == PAGER_BUFFERED;
+  int fd = open(filename, O_RDWR | O_CREAT | (direct ? O_DIRECT : 0), S_IWUSR | S_IRUSR);
+  if (fd == -1 && direct && errno == EINVAL) {
+    // the file system can't bypass its cache, e.g. tmpfs
+    direct = false;
+    fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  }
+  if (fd == -1) {
+    db_fail("Unable to open file.");
+  }
+  uint32_t file_page_size = db_file_page_size(filename, fd);
+  if (file_page_size != 0) {
+    page_size = file_page_size;
+  }
+  if (page_size < MIN_PAGE_SIZE || page_size > MAX_PAGE_SIZE
+      || (page_size & (page_size - 1)) != 0) {
+    db_fail("Page size must be a power of two from %d to %d.", MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+  }
+  // replay whatever the last session left in the log, writes through a
+  // mapping bypass it, so it is only kept open for the buffered pager
+  Wal* wal = wal_open(filename, fd, page_size);
+  if (!use_wal || mode == PAGER_MMAP) {
+    wal_close(wal, filename, true);
+    wal = NULL;
+  }
+  off_t file_length = lseek(fd, 0, SEEK_END);
+
+  Pager* pager = malloc(sizeof(Pager));
+  pager->mode = mode;
+  pager->file_desc = fd;
+  pager->page_size = page_size;
+  pager->wal = wal;
+  pager->file_length = file_length;
+  pager->num_pages = file_length / pager->page_size;
+
+  if (file_length % pager->page_size != 0) {
+    db_fail("Db file is not a whole number of pages. Corrupted file.");
+  }
+
+  pager->map = NULL;
+  pager->map_size = 0;
+  if (mode == PAGER_MMAP) {
+    pager->map = mmap(NULL, MMAP_RESERVE_SIZE, PROT_NONE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pager->map == MAP_FAILED) {
+      db_fail("Unable to reserve address space for mapping: %d", errno);
+    }
+    if (file_length > 0) {
+      void* mapped = mmap(pager->map, file_length, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_FIXED, fd, 0);
+      if (mapped == MAP_FAILED) {
+	db_fail("Unable to map db file: %d", errno);
+      }
+      pager->map_size = file_length;
+    }
+    num_frames = 0;
+  } else if (num_frames < PAGER_MIN_FRAMES) {
+    num_frames = PAGER_MIN_FRAMES;
+  }
+  pager->num_frames = num_frames;
+  pager->direct = direct;
+  pager->frame_data = NULL;
+  pager->frame_data_size = 0;
+  if (num_frames > 0) {
+    pager->frame_data = pager_map_frames((size_t) num_frames * pager->page_size, huge_pages,
+					 &pager->frame_data_size);
+  }
+  pager->frames = malloc(num_frames * sizeof(Frame));
+  for (uint32_t i = 0; i < num_frames; i++) {
+    pager->frames[i].in_use = false;
+    pager->frames[i].pin_count = 0;
+    pager->frames[i].referenced = false;
+    pager->frames[i].dirty = false;
+    pager->frames[i].txn_dirty = false;
+    pager->frames[i].lsn = 0;
+    pager->frames[i].next = -1;
+    pthread_rwlock_init(&pager->frames[i].latch, NULL);
+    pager->frames[i].loading = false;
+    pager->frames[i].read_ahead = false;
+    pager->frames[i].load_error = 0;
+  }
+  pager->txn_frames = malloc(num_frames * sizeof(int32_t));
+  pager->num_txn_frames = 0;
+  pager->spilled_pages = NULL;
+  pager->spilled_offsets = NULL;
+  pager->spilled_capacity = 0;
+  pager->num_spilled = 0;
+
+  // power of two with a load factor of at most 1/2
+  pager->num_buckets = 1;
+  while (pager->num_buckets < 2 * num_frames) {
+    pager->num_buckets <<= 1;
+  }
+  pager->buckets = malloc(pager->num_buckets * sizeof(int32_t));
+  for (uint32_t i = 0; i < pager->num_buckets; i++) {
+    pager->buckets[i] = -1;
+  }
+  pager->clock_hand = 0;
+  pager->num_dirty = 0;
+
+  pthread_mutexattr_t frames_lock_attr;
+  pthread_mutexattr_init(&frames_lock_attr);
+  pthread_mutexattr_settype(&frames_lock_attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&pager->frames_lock, &frames_lock_attr);
+  pthread_mutexattr_destroy(&frames_lock_attr);
+  pthread_mutex_init(&pager->lock, NULL);
+  pthread_cond_init(&pager->writeback_cond, NULL);
+  pager->writeback_running = false;
+  pager->writeback_stop = false;
+  pager->writeback_threshold = DEFAULT_WRITEBACK_THRESHOLD;
+  pager->writeback_interval_ms = 0;
+  pager->read_ahead = NULL;
+  pager->read_ahead_pages = 0;
+  pager->read_ahead_used = 0;
+  pager->read_ahead_wasted = 0;
+  pager->snapshot = NULL;
+
+  return pager;
+}
+
+// Pager functions call each other, so the frames lock is recursive. How
+// deep this thread holds it is tracked for a failure to unwind past.
+static __thread Pager* frames_locked_pager = NULL;
+static __thread uint32_t frames_lock_depth = 0;
+
+void pager_frames_lock(Pager* pager) {
+  pthread_mutex_lock(&pager->frames_lock);
+  frames_locked_pager = pager;
+  frames_lock_depth += 1;
+}
+
+void pager_frames_unlock(Pager* pager) {
+  frames_lock_depth -= 1;
+  pthread_mutex_unlock(&pager->frames_lock);
+}
+
+// releases the frames lock when a failure unwound while it was held
+void pager_frames_unwind() {
+  while (frames_lock_depth > 0) {
+    pager_frames_unlock(frames_locked_pager);
+  }
+}
+
+void* frame_page(Pager* pager, int32_t frame_num) {
+  return pager->frame_data + (size_t) frame_num * pager->page_size;
+}
+
+Frame* page_frame(Pager* pager, void* page) {
+  return &pager->frames[(page - pager->frame_data) / pager->page_size];
+}
+
+uint32_t page_bucket(Pager* pager, uint32_t page_num) {
+  // multiplicative hashing, sequential page numbers spread across buckets
+  return (page_num * 2654435761u) & (pager->num_buckets - 1);
+}
+
+int32_t pager_lookup(Pager* pager, uint32_t page_num) {
+  int32_t f = pager->buckets[page_bucket(pager, page_num)];
+  while (f != -1 && pager->frames[f].page_num != page_num) {
+    f = pager->frames[f].next;
+  }
+  return f;
+}
+
+void pager_hash_insert(Pager* pager, int32_t frame_num) {
+  uint32_t bucket = page_bucket(pager, pager->frames[frame_num].page_num);
+  pager->frames[frame_num].next = pager->buckets[bucket];
+  pager->buckets[bucket] = frame_num;
+}
+
+void pager_hash_remove(Pager* pager, int32_t frame_num) {
+  int32_t* link = &pager->buckets[page_bucket(pager, pager->frames[frame_num].page_num)];
+  while (*link != frame_num) {
+    link = &pager->frames[*link].next;
+  }
+  *link = pager->frames[frame_num].next;
+  pager->frames[frame_num].next = -1;
+}
+
+void pager_extend_file_length(Pager* pager, uint32_t end_page_num) {
+  off_t end = (off_t) end_page_num * pager->page_size;
+  if (end > pager->file_length) {
+    pager->file_length = end;
+  }
+}
+
+void pager_clear_dirty(Pager* pager, int32_t frame_num) {
+  if (pager->frames[frame_num].dirty) {
+    pager->frames[frame_num].dirty = false;
+    pager->num_dirty -= 1;
+  }
+}
+
+void pager_flush(Pager* pager, uint32_t page_num) {
+  int32_t f = pager_lookup(pager, page_num);
+  if (f == -1) {
+    db_fail("Tried to flush NULL page.");
+  }
+
+  ssize_t bytes_written = pwrite(pager->file_desc, frame_page(pager, f), pager->page_size,
+				 (off_t) page_num * pager->page_size);
+  if (bytes_written != (ssize_t) pager->page_size) {
+    db_fail("Error writing: %d", errno);
+  }
+  stat_add(STAT_PAGES_WRITTEN, 1);
+  pager_extend_file_length(pager, page_num + 1);
+  pager_clear_dirty(pager, f);
+}
+
+int compare_frames_by_page(const void* a, const void* b, void* arg) {
+  Pager* pager = arg;
+  uint32_t page_a = pager->frames[*(const int32_t*)a].page_num;
+  uint32_t page_b = pager->frames[*(const int32_t*)b].page_num;
+  return (page_a > page_b) - (page_a < page_b);
+}
+
+// writes `count` frames holding consecutive pages with a single pwritev
+void pager_write_run(Pager* pager, int32_t* run, uint32_t count) {
+  struct iovec iov[IOV_MAX];
+  for (uint32_t i = 0; i < count; i++) {
+    iov[i].iov_base = frame_page(pager, run[i]);
+    iov[i].iov_len = pager->page_size;
+  }
+  uint32_t first_page_num = pager->frames[run[0]].page_num;
+  ssize_t bytes_written = pwritev(pager->file_desc, iov, count,
+				  (off_t) first_page_num * pager->page_size);
+  if (bytes_written != (ssize_t) count * pager->page_size) {
+    db_fail("Error writing: %d", errno);
+  }
+  stat_add(STAT_PAGES_WRITTEN, count);
+  pager_frames_lock(pager);
+  for (uint32_t i = 0; i < count; i++) {
+    pager_clear_dirty(pager, run[i]);
+  }
+  pager_extend_file_length(pager, first_page_num + count);
+  pager_frames_unlock(pager);
+}
+
+// Writes back every dirty page outside the open transaction, contiguous
+// pages are coalesced into one pwritev each, a mapped file is msync'ed
+// instead. Only called by the holder of the writer lock, the pages are
+// pinned while they are written so that readers can't evict them.
+void pager_flush_dirty(Pager* pager) {
+  if (pager->mode == PAGER_MMAP) {
+    if (pager->map_size > 0 && msync(pager->map, pager->map_size, MS_SYNC) == -1) {
+      db_fail("Error syncing mapping: %d", errno);
+    }
+    return;
+  }
+  pager_frames_lock(pager);
+  if (pager->num_dirty == 0) {
+    pager_frames_unlock(pager);
+    return;
+  }
+  int32_t* dirty = malloc(pager->num_dirty * sizeof(int32_t));
+  uint32_t num_dirty = 0;
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    Frame* frame = &pager->frames[i];
+    if (frame->in_use && frame->dirty && !frame->txn_dirty) {
+      frame->pin_count += 1;
+      dirty[num_dirty++] = i;
+    }
+  }
+  pager_frames_unlock(pager);
+  if (pager->wal != NULL) {
+    wal_sync(pager->wal, pager->wal->end);
+  }
+  qsort_r(dirty, num_dirty, sizeof(int32_t), compare_frames_by_page, pager);
+
+  uint32_t run_start = 0;
+  for (uint32_t i = 1; i <= num_dirty; i++) {
+    bool run_ends = i == num_dirty
+      || i - run_start == IOV_MAX
+      || pager->frames[dirty[i]].page_num != pager->frames[dirty[i - 1]].page_num + 1;
+    if (run_ends) {
+      pager_write_run(pager, dirty + run_start, i - run_start);
+      run_start = i;
+    }
+  }
+  pager_frames_lock(pager);
+  for (uint32_t i = 0; i < num_dirty; i++) {
+    pager->frames[dirty[i]].pin_count -= 1;
+  }
+  pager_frames_unlock(pager);
+  free(dirty);
+}
+
+// returns where the spilled image of `page_num` is in the log, or 0
+uint64_t pager_spilled_offset(Pager* pager, uint32_t page_num) {
+  if (pager->num_spilled == 0) {
+    return 0;
+  }
+  uint32_t mask = pager->spilled_capacity - 1;
+  for (uint32_t i = (page_num * 2654435761u) & mask; pager->spilled_pages[i] != 0; i = (i + 1) & mask) {
+    if (pager->spilled_pages[i] == page_num + 1) {
+      return pager->spilled_offsets[i];
+    }
+  }
+  return 0;
+}
+
+void pager_spilled_put(Pager* pager, uint32_t page_num, uint64_t offset) {
+  if (2 * (pager->num_spilled + 1) > pager->spilled_capacity) {
+    // grow, keeping the load factor at most 1/2
+    uint32_t old_capacity = pager->spilled_capacity;
+    uint32_t* old_pages = pager->spilled_pages;
+    uint64_t* old_offsets = pager->spilled_offsets;
+    pager->spilled_capacity = old_capacity == 0 ? 64 : 2 * old_capacity;
+    pager->spilled_pages = calloc(pager->spilled_capacity, sizeof(uint32_t));
+    pager->spilled_offsets = malloc(pager->spilled_capacity * sizeof(uint64_t));
+    pager->num_spilled = 0;
+    for (uint32_t i = 0; i < old_capacity; i++) {
+      if (old_pages[i] != 0) {
+	pager_spilled_put(pager, old_pages[i] - 1, old_offsets[i]);
+      }
+    }
+    free(old_pages);
+    free(old_offsets);
+  }
+  uint32_t mask = pager->spilled_capacity - 1;
+  uint32_t i = (page_num * 2654435761u) & mask;
+  while (pager->spilled_pages[i] != 0 && pager->spilled_pages[i] != page_num + 1) {
+    i = (i + 1) & mask;
+  }
+  if (pager->spilled_pages[i] == 0) {
+    pager->spilled_pages[i] = page_num + 1;
+    pager->num_spilled += 1;
+  }
+  pager->spilled_offsets[i] = offset;
+}
+
+// Appends the unpinned pages of the open transaction to the log without
+// committing them, after which their frames can be evicted. Returns
+// false if there was nothing to spill.
+bool pager_spill(Pager* pager) {
+  uint32_t count = 0;
+  uint32_t num_kept = 0;
+  int32_t* spilled = malloc(pager->num_txn_frames * sizeof(int32_t));
+  for (uint32_t i = 0; i < pager->num_txn_frames; i++) {
+    int32_t f = pager->txn_frames[i];
+    if (pager->frames[f].pin_count > 0) {
+      pager->txn_frames[num_kept++] = f;
+    } else {
+      spilled[count++] = f;
+    }
+  }
+  if (count == 0) {
+    free(spilled);
+    return false;
+  }
+  pager->num_txn_frames = num_kept;
+
+  qsort_r(spilled, count, sizeof(int32_t), compare_frames_by_page, pager);
+  uint32_t* page_nums = malloc(count * sizeof(uint32_t));
+  void** pages = malloc(count * sizeof(void*));
+  for (uint32_t i = 0; i < count; i++) {
+    page_nums[i] = pager->frames[spilled[i]].page_num;
+    pages[i] = frame_page(pager, spilled[i]);
+  }
+  uint64_t start = pager->wal->end;
+  wal_append(pager->wal, page_nums, pages, count, 0);
+  stat_add(STAT_PAGES_WRITTEN, count);
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t offset = start + (uint64_t) i * (WAL_FRAME_HEADER_SIZE + pager->page_size) + WAL_FRAME_HEADER_SIZE;
+    pager_spilled_put(pager, page_nums[i], offset);
+    // the image lives on in the log, the frame may be dropped
+    pager->frames[spilled[i]].txn_dirty = false;
+    pager_clear_dirty(pager, spilled[i]);
+  }
+  free(page_nums);
+  free(pages);
+  free(spilled);
+  return true;
+}
+
+// CLOCK: sweep the frames, giving referenced pages a second chance
+int32_t pager_find_victim(Pager* pager) {
+  for (uint32_t scanned = 0; scanned < 2 * pager->num_frames; scanned++) {
+    int32_t f = pager->clock_hand;
+    pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+    Frame* frame = &pager->frames[f];
+    if (!frame->in_use) {
+      return f;
+    }
+    if (frame->pin_count > 0 || frame->txn_dirty
+	|| __atomic_load_n(&frame->loading, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+    if (frame->referenced) {
+      frame->referenced = false;
+      continue;
+    }
+    return f;
+  }
+  if (pager->num_txn_frames > 0 && pager_spill(pager)) {
+    return pager_find_victim(pager);
+  }
+  db_fail("All %d buffer pool frames are pinned.", pager->num_frames);
+}
+
+// CLOCK for a page read ahead, which takes no frame that would have to
+// be written first or spilled: -1 if one sweep finds none
+int32_t pager_find_clean_victim(Pager* pager) {
+  for (uint32_t scanned = 0; scanned < pager->num_frames; scanned++) {
+    int32_t f = pager->clock_hand;
+    pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+    Frame* frame = &pager->frames[f];
+    if (!frame->in_use) {
+      return f;
+    }
+    if (frame->pin_count > 0 || frame->dirty || frame->txn_dirty
+	|| __atomic_load_n(&frame->loading, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+    if (frame->referenced) {
+      frame->referenced = false;
+      continue;
+    }
+    return f;
+  }
+  return -1;
+}
+
+// takes a frame that was picked as a victim from the page it holds
+void pager_evict(Pager* pager, int32_t frame_num) {
+  Frame* frame = &pager->frames[frame_num];
+  if (frame->read_ahead) {
+    frame->read_ahead = false;
+    pager->read_ahead_wasted += 1;
+    stat_add(STAT_READ_AHEAD_WASTED, 1);
+  }
+  pager_hash_remove(pager, frame_num);
+}
+
+// grows the file and the mapping in place so that `page_num` is mapped
+void pager_grow_map(Pager* pager, uint32_t page_num) {
+  size_t needed = ((size_t) page_num + 1) * pager->page_size;
+  size_t new_size = pager->map_size * 2;
+  if (new_size < (size_t) MMAP_MIN_GROWTH_PAGES * pager->page_size) {
+    new_size = (size_t) MMAP_MIN_GROWTH_PAGES * pager->page_size;
+  }
+  if (new_size < needed) {
+    new_size = needed;
+  }
+  if (new_size > MMAP_RESERVE_SIZE) {
+    db_fail("Db file too large to map.");
+  }
+
+  if (ftruncate(pager->file_desc, new_size) == -1) {
+    db_fail("Error growing db file: %d", errno);
+  }
+  void* mapped;
+  if (pager->map_size == 0) {
+    mapped = mmap(pager->map, new_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_FIXED, pager->file_desc, 0);
+  } else {
+    // hand the reserved range after the mapping back so mremap can
+    // extend in place
+    munmap(pager->map + pager->map_size, new_size - pager->map_size);
+    mapped = mremap(pager->map, pager->map_size, new_size, 0);
+  }
+  if (mapped != pager->map) {
+    db_fail("Unable to grow mapping: %d", errno);
+  }
+  pager->map_size = new_size;
+  pager->file_length = new_size;
+}
+
+void* get_page(Pager* pager, uint32_t page_num) {
+  if (pager->mode == PAGER_MMAP) {
+    if ((size_t) (page_num + 1) * pager->page_size > pager->map_size) {
+      pager_grow_map(pager, page_num);
+    }
+    if (page_num >= pager->num_pages) {
+      pager->num_pages = page_num + 1;
+    }
+    if (page_trace != NULL) {
+      page_trace_add(page_trace, page_num, false, false);
+    }
+    return pager->map + (size_t) page_num * pager->page_size;
+  }
+
+  pager_frames_lock(pager);
+  int32_t f = pager_lookup(pager, page_num);
+  bool missed = f == -1;
+  if (missed) {
+    f = pager_find_victim(pager);
+    Frame* frame = &pager->frames[f];
+    if (frame->in_use) {
+      if (frame->dirty) {
+	if (pager->wal != NULL) {
+	  wal_sync(pager->wal, frame->lsn);
+	}
+	pager_flush(pager, frame->page_num);
+      }
+      pager_evict(pager, f);
+    }
+
+    void* page = frame_page(pager, f);
+    uint32_t num_pages_in_file = pager->file_length / pager->page_size;
+    uint64_t spilled_offset = pager_spilled_offset(pager, page_num);
+    if (spilled_offset != 0) {
+      if (pread(pager->wal->file_desc, page, pager->page_size, spilled_offset) != pager->page_size) {
+	db_fail("Error reading WAL: %d", errno);
+      }
+      stat_add(STAT_PAGES_READ, 1);
+    } else if (page_num < num_pages_in_file) {
+      ssize_t bytes_read = pread(pager->file_desc, page, pager->page_size,
+				 (off_t) page_num * pager->page_size);
+      if (bytes_read == -1) {
+	db_fail("Error reading file: %d", errno);
+      }
+      stat_add(STAT_PAGES_READ, 1);
+    } else {
+      memset(page, 0, pager->page_size);
+    }
+
+    frame->page_num = page_num;
+    frame->in_use = true;
+    frame->pin_count = 0;
+    frame->load_error = 0;
+    pager_hash_insert(pager, f);
+    if (page_num >= pager->num_pages) {
+      pager->num_pages = page_num + 1;
+    }
+  }
+  Frame* frame = &pager->frames[f];
+  frame->pin_count += 1;
+  frame->referenced = true;
+  bool read_ahead = frame->read_ahead;
+  if (read_ahead) {
+    frame->read_ahead = false;
+    pager->read_ahead_used += 1;
+    stat_add(STAT_READ_AHEAD_USED, 1);
+  }
+  bool loading = __atomic_load_n(&frame->loading, __ATOMIC_ACQUIRE);
+  pager_frames_unlock(pager);
+  stat_add(missed ? STAT_CACHE_MISSES : STAT_CACHE_HITS, 1);
+  if (page_trace != NULL) {
+    page_trace_add(page_trace, page_num, missed, read_ahead);
+  }
+  if (loading) {
+    read_ahead_wait(pager, frame);
+  }
+  if (frame->load_error != 0) {
+    db_fail("Error reading file: %d", frame->load_error);
+  }
+  return frame_page(pager, f);
+}
+
+void pager_unpin(Pager* pager, uint32_t page_num) {
+  if (pager->mode == PAGER_MMAP) {
+    return;
+  }
+  pager_frames_lock(pager);
+  int32_t f = pager_lookup(pager, page_num);
+  if (f == -1 || pager->frames[f].pin_count == 0) {
+    db_fail("Tried to unpin page %d which is not pinned.", page_num);
+  }
+  pager->frames[f].pin_count -= 1;
+  pager_frames_unlock(pager);
+}
+
+// must be called on a pinned page before modifying it
+void pager_mark_dirty(Pager* pager, uint32_t page_num) {
+  if (pager->snapshot != NULL) {
+    snapshot_preserve(pager, page_num);
+  }
+  if (pager->mode == PAGER_MMAP) {
+    return;
+  }
+  pager_frames_lock(pager);
+  int32_t f = pager_lookup(pager, page_num);
+  if (f == -1 || pager->frames[f].pin_count == 0) {
+    db_fail("Tried to dirty page %d which is not pinned.", page_num);
+  }
+  if (!pager->frames[f].dirty) {
+    pager->frames[f].dirty = true;
+    pager->num_dirty += 1;
+    if (pager->writeback_running && pager->num_dirty >= pager->writeback_threshold) {
+      pthread_cond_signal(&pager->writeback_cond);
+    }
+  }
+  if (pager->wal != NULL && !pager->frames[f].txn_dirty) {
+    pager->frames[f].txn_dirty = true;
+    pager->txn_frames[pager->num_txn_frames++] = f;
+  }
+  pager_frames_unlock(pager);
+}
+
+// Latches keep readers from seeing a page half modified. A page is
+// latched while pinned: shared to read it, exclusive to modify it. A
+// mapped file has no frames to hold latches, there a writer has the
+// tree to itself instead, see `db_lock`.
+void* pager_latch(Pager* pager, uint32_t page_num, bool exclusive) {
+  void* page = get_page(pager, page_num);
+  if (pager->mode == PAGER_BUFFERED) {
+    pthread_rwlock_t* latch = &page_frame(pager, page)->latch;
+    if (exclusive) {
+      pthread_rwlock_wrlock(latch);
+    } else {
+      pthread_rwlock_rdlock(latch);
+    }
+  }
+  return page;
+}
+
+// Latches shared unless a writer has the page, for a thread that already
+// holds latches below it: waiting could deadlock with that writer.
+// Returns NULL, with the page unpinned, if it did not get the latch.
+void* pager_try_latch(Pager* pager, uint32_t page_num) {
+  void* page = get_page(pager, page_num);
+  if (pager->mode == PAGER_BUFFERED
+      && pthread_rwlock_tryrdlock(&page_frame(pager, page)->latch) != 0) {
+    pager_unpin(pager, page_num);
+    return NULL;
+  }
+  return page;
+}
+
+// releases the latch and the pin `pager_latch` took
+void pager_unlatch(Pager* pager, uint32_t page_num) {
+  if (pager->mode == PAGER_BUFFERED) {
+    pager_frames_lock(pager);
+    int32_t f = pager_lookup(pager, page_num);
+    pager_frames_unlock(pager);
+    pthread_rwlock_unlock(&pager->frames[f].latch);
+  }
+  pager_unpin(pager, page_num);
+}
+
+bool pager_in_transaction(Pager* pager) {
+  pager_frames_lock(pager);
+  bool in_transaction = pager->num_txn_frames > 0 || pager->num_spilled > 0;
+  pager_frames_unlock(pager);
+  return in_transaction;
+}
+
+// copies the db file up to date and empties the log
+void pager_checkpoint(Pager* pager) {
+  if (pager->wal == NULL || pager_in_transaction(pager)) {
+    return;
+  }
+  pager_flush_dirty(pager);
+  if (fsync(pager->file_desc) == -1) {
+    db_fail("Error syncing db file: %d", errno);
+  }
+  pager_frames_lock(pager);
+  wal_reset(pager->wal);
+  pager_frames_unlock(pager);
+}
+
+// Copies the spilled pages of a transaction that just committed from the
+// log into the db file. Pages modified again since are logged and cached
+// as well, their newer image is written back later.
+void pager_copy_spilled(Pager* pager) {
+  if (pager->num_spilled == 0) {
+    return;
+  }
+  void* page = page_buffer_alloc(pager->page_size, 1);
+  for (uint32_t i = 0; i < pager->spilled_capacity; i++) {
+    if (pager->spilled_pages[i] == 0) {
+      continue;
+    }
+    uint32_t page_num = pager->spilled_pages[i] - 1;
+    if (pread(pager->wal->file_desc, page, pager->page_size, pager->spilled_offsets[i]) != pager->page_size
+	|| pwrite(pager->file_desc, page, pager->page_size, (off_t) page_num * pager->page_size) != pager->page_size) {
+      db_fail("Error writing: %d", errno);
+    }
+    stat_add(STAT_PAGES_READ, 1);
+    stat_add(STAT_PAGES_WRITTEN, 1);
+    pager_extend_file_length(pager, page_num + 1);
+    pager->spilled_pages[i] = 0;
+  }
+  pager->num_spilled = 0;
+  free(page);
+}
+
+// Logs every page modified since the last commit as one transaction and
+// waits for it to be durable, readers carry on while it syncs.
+void pager_commit(Pager* pager) {
+  pager_update_page_count(pager);
+  if (pager->wal == NULL) {
+    return;
+  }
+  pager_frames_lock(pager);
+  if (!pager_in_transaction(pager)) {
+    pager_frames_unlock(pager);
+    return;
+  }
+  if (pager->num_txn_frames == 0) {
+    // everything was spilled, log one page again to carry the commit
+    uint32_t page_num = 0;
+    while (pager_spilled_offset(pager, page_num) == 0) {
+      page_num += 1;
+    }
+    get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    pager_unpin(pager, page_num);
+  }
+  uint32_t count = pager->num_txn_frames;
+  qsort_r(pager->txn_frames, count, sizeof(int32_t), compare_frames_by_page, pager);
+  uint32_t* page_nums = malloc(count * sizeof(uint32_t));
+  void** pages = malloc(count * sizeof(void*));
+  for (uint32_t i = 0; i < count; i++) {
+    page_nums[i] = pager->frames[pager->txn_frames[i]].page_num;
+    pages[i] = frame_page(pager, pager->txn_frames[i]);
+  }
+  uint64_t lsn = wal_append(pager->wal, page_nums, pages, count, pager->num_pages);
+  stat_add(STAT_PAGES_WRITTEN, count);
+  for (uint32_t i = 0; i < count; i++) {
+    pager->frames[pager->txn_frames[i]].txn_dirty = false;
+    pager->frames[pager->txn_frames[i]].lsn = lsn;
+  }
+  pager->num_txn_frames = 0;
+  free(page_nums);
+  free(pages);
+  pager_frames_unlock(pager);
+
+  wal_sync(pager->wal, lsn);
+  pager_frames_lock(pager);
+  pager_copy_spilled(pager);
+  bool checkpoint = pager->wal->num_frames >= WAL_AUTOCHECKPOINT;
+  pager_frames_unlock(pager);
+  if (checkpoint) {
+    pager_checkpoint(pager);
+  }
+}
+
+// The pager lock is the writer lock, held by whoever modifies pages: a
+// statement that writes, from its start to its commit, and the
+// write-back thread while flushing. Readers don't take it.
+void pager_lock(Pager* pager) {
+  pthread_mutex_lock(&pager->lock);
+}
+
+void pager_unlock(Pager* pager) {
+  pthread_mutex_unlock(&pager->lock);
+}
+
+void* pager_writeback_loop(void* arg) {
+  Pager* pager = arg;
+  pager_lock(pager);
+  while (!pager->writeback_stop) {
+    if (pager->writeback_interval_ms == 0) {
+      pthread_cond_wait(&pager->writeback_cond, &pager->lock);
+    } else {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += pager->writeback_interval_ms / 1000;
+      deadline.tv_nsec += (long) (pager->writeback_interval_ms % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+	deadline.tv_sec += 1;
+	deadline.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&pager->writeback_cond, &pager->lock, &deadline);
+    }
+    if (!pager->writeback_stop) {
+      pager_flush_dirty(pager);
+    }
+  }
+  pager_unlock(pager);
+  return NULL;
+}
+
+// Starts a thread that writes dirty pages back every `interval_ms`
+// (0 disables the timer) or as soon as `threshold` pages are dirty.
+// Threads the engine starts block every signal, those are for the
+// application's threads to handle, e.g. with `sigwait`.
+bool start_thread(pthread_t* thread, void* (*run)(void*), void* arg) {
+  sigset_t all, previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &previous);
+  bool started = pthread_create(thread, NULL, run, arg) == 0;
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  return started;
+}
+
+void pager_start_writeback(Pager* pager, uint32_t interval_ms, uint32_t threshold) {
+  pager->writeback_interval_ms = interval_ms;
+  pager->writeback_threshold = threshold;
+  pager->writeback_stop = false;
+  if (!start_thread(&pager->writeback_thread, pager_writeback_loop, pager)) {
+    db_fail("Unable to start write-back thread.");
+  }
+  pager->writeback_running = true;
+}
+
+void pager_stop_writeback(Pager* pager) {
+  if (!pager->writeback_running) {
+    return;
+  }
+  pager_lock(pager);
+  pager->writeback_stop = true;
+  pthread_cond_signal(&pager->writeback_cond);
+  pager_unlock(pager);
+  pthread_join(pager->writeback_thread, NULL);
+  pager->writeback_running = false;
+}
+
+// Forgets every cached page after the db file was rewritten behind the
+// cache, which must hold no pinned or dirty pages. The file now holds
+// `num_pages` pages.
+void pager_reset(Pager* pager, uint32_t num_pages) {
+  read_ahead_drain(pager);
+  pager_frames_lock(pager);
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    if (pager->frames[i].pin_count > 0 || pager->frames[i].dirty) {
+      db_fail("Tried to reset the cache while page %d is in use.", pager->frames[i].page_num);
+    }
+    pager->frames[i].in_use = false;
+    pager->frames[i].referenced = false;
+    pager->frames[i].read_ahead = false;
+    pager->frames[i].next = -1;
+  }
+  for (uint32_t i = 0; i < pager->num_buckets; i++) {
+    pager->buckets[i] = -1;
+  }
+  pager->num_pages = num_pages;
+  if (pager->mode == PAGER_MMAP) {
+    if ((size_t) num_pages * pager->page_size > pager->map_size) {
+      pager_grow_map(pager, num_pages - 1);
+    }
+  } else {
+    pager_extend_file_length(pager, num_pages);
+  }
+  pager_frames_unlock(pager);
+}
+
+// The first page of the file is the db header: the format version, the
+// keys an internal node holds, the page size, the root and the number of
+// pages in the file. Freed pages
+// are kept on a freelist: trunk pages, each listing up to
+// `freelist_trunk_max_pages` free pages and linking to the next trunk, the
+// header points to the first one. The roots of the indexes follow, 0 for
+// a column without one.
+
+#define DB_MAGIC 0x53514c43  // "SQLC"
+#define DB_FORMAT_VERSION 7  // 6 had no fan-out, 5 no version, page size or page count
+
+const uint32_t HEADER_PAGE_NUM = 0;
+const uint32_t HEADER_MAGIC_OFFSET = 0;
+const uint32_t HEADER_VERSION_OFFSET = HEADER_MAGIC_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_FANOUT_OFFSET = HEADER_VERSION_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_PAGE_SIZE_OFFSET = HEADER_FANOUT_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_ROOT_PAGE_OFFSET = HEADER_PAGE_SIZE_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_PAGE_COUNT_OFFSET = HEADER_ROOT_PAGE_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_FREELIST_TRUNK_OFFSET = HEADER_PAGE_COUNT_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_FREELIST_COUNT_OFFSET = HEADER_FREELIST_TRUNK_OFFSET + sizeof(uint32_t);
+const uint32_t HEADER_INDEX_ROOTS_OFFSET = HEADER_FREELIST_COUNT_OFFSET + sizeof(uint32_t);
+
+const uint32_t FREELIST_TRUNK_NEXT_OFFSET = 0;
+const uint32_t FREELIST_TRUNK_COUNT_OFFSET = FREELIST_TRUNK_NEXT_OFFSET + sizeof(uint32_t);
+const uint32_t FREELIST_TRUNK_HEADER_SIZE = FREELIST_TRUNK_COUNT_OFFSET + sizeof(uint32_t);
+uint32_t freelist_trunk_max_pages(Pager* pager) {
+  return (pager->page_size - FREELIST_TRUNK_HEADER_SIZE) / sizeof(uint32_t);
+}
+
+uint32_t* header_magic(void* header) {
+  return header + HEADER_MAGIC_OFFSET;
+}
+
+uint32_t* header_version(void* header) {
+  return header + HEADER_VERSION_OFFSET;
+}
+
+// `internal_node_max_cells` of the build that created the file, which
+// places the children and counts of internal nodes
+uint32_t* header_fanout(void* header) {
+  return header + HEADER_FANOUT_OFFSET;
+}
+
+uint32_t* header_page_size(void* header) {
+  return header + HEADER_PAGE_SIZE_OFFSET;
+}
+
+uint32_t* header_root_page_num(void* header) {
+  return header + HEADER_ROOT_PAGE_OFFSET;
+}
+
+uint32_t* header_page_count(void* header) {
+  return header + HEADER_PAGE_COUNT_OFFSET;  // pages the file holds
+}
+
+uint32_t* header_freelist_trunk(void* header) {
+  return header + HEADER_FREELIST_TRUNK_OFFSET;  // 0 if the freelist is empty
+}
+
+uint32_t* header_freelist_count(void* header) {
+  return header + HEADER_FREELIST_COUNT_OFFSET;  // free pages, trunks included
+}
+
+uint32_t* header_index_root_page_num(void* header, Column column) {
+  return (uint32_t*) (header + HEADER_INDEX_ROOTS_OFFSET) + column;
+}
+
+// Reads the page size of an existing db file from its header, or from
+// the log of one that never made it to the file. 0 for a new file, or
+// one that is not a db file, which the caller finds out.
+uint32_t db_file_page_size(const char* filename, int file_desc) {
+  uint32_t page_size = 0;
+  if (lseek(file_desc, 0, SEEK_END) >= MIN_PAGE_SIZE) {
+    void* header;
+    if (posix_memalign(&header, MIN_PAGE_SIZE, MIN_PAGE_SIZE) != 0) {
+      db_fail("Out of memory.");
+    }
+    if (pread(file_desc, header, MIN_PAGE_SIZE, 0) == MIN_PAGE_SIZE
+	&& *header_magic(header) == DB_MAGIC) {
+      page_size = *header_page_size(header);
+    }
+    free(header);
+  } else {
+    page_size = wal_page_size(filename);
+  }
+  return page_size;
+}
+
+uint32_t* freelist_trunk_next(void* trunk) {
+  return trunk + FREELIST_TRUNK_NEXT_OFFSET;
+}
+
+uint32_t* freelist_trunk_count(void* trunk) {
+  return trunk + FREELIST_TRUNK_COUNT_OFFSET;
+}
+
+uint32_t* freelist_trunk_page(void* trunk, uint32_t index) {
+  return trunk + FREELIST_TRUNK_HEADER_SIZE + index * sizeof(uint32_t);
+}
+
+// Takes a page off the freelist, or returns the page past the end of the
+// file if it is empty. The caller initializes the page.
+uint32_t get_unused_page_num(Pager* pager) {
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  uint32_t trunk_page_num = *header_freelist_trunk(header);
+  if (trunk_page_num == 0) {
+    pager_unpin(pager, HEADER_PAGE_NUM);
+    return pager->num_pages;  // counted in the header on commit
+  }
+  pager_mark_dirty(pager, HEADER_PAGE_NUM);
+  *header_freelist_count(header) -= 1;
+
+  uint32_t page_num;
+  void* trunk = get_page(pager, trunk_page_num);
+  uint32_t count = *freelist_trunk_count(trunk);
+  if (count > 0) {
+    pager_mark_dirty(pager, trunk_page_num);
+    page_num = *freelist_trunk_page(trunk, count - 1);
+    *freelist_trunk_count(trunk) = count - 1;
+  } else {
+    // an empty trunk is handed out itself
+    *header_freelist_trunk(header) = *freelist_trunk_next(trunk);
+    page_num = trunk_page_num;
+  }
+  pager_unpin(pager, trunk_page_num);
+  pager_unpin(pager, HEADER_PAGE_NUM);
+  return page_num;
+}
+
+// The page count in the header is brought up to date when a transaction
+// commits rather than with every page added, opening checks the file
+// holds that many.
+void pager_update_page_count(Pager* pager) {
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  if (*header_page_count(header) != pager->num_pages) {
+    pager_mark_dirty(pager, HEADER_PAGE_NUM);
+    *header_page_count(header) = pager->num_pages;
+  }
+  pager_unpin(pager, HEADER_PAGE_NUM);
+}
+
+// puts a page that is no longer referenced on the freelist
+void pager_free_page(Pager* pager, uint32_t page_num) {
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, HEADER_PAGE_NUM);
+  *header_freelist_count(header) += 1;
+
+  uint32_t trunk_page_num = *header_freelist_trunk(header);
+  if (trunk_page_num != 0) {
+    void* trunk = get_page(pager, trunk_page_num);
+    uint32_t count = *freelist_trunk_count(trunk);
+    if (count < freelist_trunk_max_pages(pager)) {
+      pager_mark_dirty(pager, trunk_page_num);
+      *freelist_trunk_page(trunk, count) = page_num;
+      *freelist_trunk_count(trunk) = count + 1;
+      pager_unpin(pager, trunk_page_num);
+      pager_unpin(pager, HEADER_PAGE_NUM);
+      return;
+    }
+    pager_unpin(pager, trunk_page_num);
+  }
+
+  // the first trunk is full, the freed page becomes the new one
+  void* trunk = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  *freelist_trunk_next(trunk) = trunk_page_num;
+  *freelist_trunk_count(trunk) = 0;
+  *header_freelist_trunk(header) = page_num;
+  pager_unpin(pager, page_num);
+  pager_unpin(pager, HEADER_PAGE_NUM);
+}
+
+
+// BACK END: READ-AHEAD
+
+// Pages soon needed are read in the background, see `cursor_read_ahead`
+// for which. `pager_read_ahead` gives each page that is not cached a
+// frame marked loading and has the read done by the kernel through an
+// io_uring, or where there is none by a few threads doing preads. Its
+// caller does not wait: a reader that gets to the page before it is read
+// waits in `get_page`, and CLOCK passes loading frames by. Finishing a
+// read only takes the read-ahead lock, so a thread may wait for one with
+// the frames lock held.
+//
+// No thread waits on the ring. Whoever waits for a read takes what has
+// completed off it, as does the next `pager_read_ahead`: a page the
+// kernel had cached is usually done by the time the reader gets to it,
+// and costs no switch to another thread.
+//
+// With PAGER_MMAP the kernel is asked to read the pages with madvise.
+
+#define READ_AHEAD_THREADS 4  // pread threads, without io_uring
+#define READ_AHEAD_MIN_WINDOW 4  // leaves a reader reads ahead at first
+
+#ifdef HAVE_IO_URING
+// the rings shared with the kernel, set up with the system calls rather
+// than liburing
+struct Uring_t {
+  int fd;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;  // the same mapping as `sq_ring` on newer kernels
+  size_t cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  uint32_t* sq_head;
+  uint32_t* sq_tail;
+  uint32_t* sq_mask;
+  uint32_t* sq_array;
+  uint32_t* cq_head;
+  uint32_t* cq_tail;
+  uint32_t* cq_mask;
+  struct io_uring_cqe* cqes;
+};
+typedef struct Uring_t Uring;
+
+void uring_close(Uring* ring) {
+  if (ring->sqes != MAP_FAILED) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring != MAP_FAILED) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  close(ring->fd);
+}
+
+// false if the kernel has no io_uring or won't let us use it
+bool uring_open(Uring* ring, uint32_t entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) {
+    return false;
+  }
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_map && ring->cq_ring_size > ring->sq_ring_size) {
+    ring->sq_ring_size = ring->cq_ring_size;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = single_map ? ring->sq_ring
+    : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+	   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    uring_close(ring);
+    return false;
+  }
+  ring->sq_head = ring->sq_ring + params.sq_off.head;
+  ring->sq_tail = ring->sq_ring + params.sq_off.tail;
+  ring->sq_mask = ring->sq_ring + params.sq_off.ring_mask;
+  ring->sq_array = ring->sq_ring + params.sq_off.array;
+  ring->cq_head = ring->cq_ring + params.cq_off.head;
+  ring->cq_tail = ring->cq_ring + params.cq_off.tail;
+  ring->cq_mask = ring->cq_ring + params.cq_off.ring_mask;
+  ring->cqes = ring->cq_ring + params.cq_off.cqes;
+  return true;
+}
+
+// queues a readv of `iov` for the next `uring_submit`
+void uring_push(Uring* ring, int fd, struct iovec* iov, off_t offset, uint64_t user_data) {
+  uint32_t tail = *ring->sq_tail;
+  uint32_t index = tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->off = offset;
+  sqe->addr = (uintptr_t) iov;
+  sqe->len = 1;
+  sqe->user_data = user_data;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Hands the queued requests to the kernel. On an error it can't retry,
+// those it did not take are dropped, their `user_data` is added to
+// `dropped` and the errno returned.
+int uring_submit(Uring* ring, uint64_t* dropped, uint32_t* num_dropped) {
+  *num_dropped = 0;
+  while (true) {
+    uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    uint32_t tail = *ring->sq_tail;
+    if (head == tail) {
+      return 0;
+    }
+    if (syscall(__NR_io_uring_enter, ring->fd, tail - head, 0, 0, NULL, 0) >= 0
+	|| errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+      continue;
+    }
+    int error = errno;
+    for (uint32_t i = head; i != tail; i++) {
+      dropped[(*num_dropped)++] = ring->sqes[ring->sq_array[i & *ring->sq_mask]].user_data;
+    }
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+    return error;
+  }
+}
+#endif
+
+struct ReadAhead_t {
+  Pager* pager;
+  uint32_t max_loading;  // frames read ahead at once, a quarter of the pool
+  pthread_mutex_t lock;  // guards the fields below and ends of loading
+  pthread_cond_t done;  // a read finished
+  pthread_cond_t queued;  // a read was queued for the threads, or they stop
+  uint32_t num_loading;
+  bool stopping;
+  // pread threads, when there is no ring
+  int32_t* queue;  // frames to read, a ring of `max_loading`
+  uint32_t queue_head;
+  uint32_t queue_length;
+  pthread_t* threads;
+  uint32_t num_threads;
+#ifdef HAVE_IO_URING
+  bool use_ring;
+  Uring ring;
+  uint32_t num_in_ring;  // submitted and not taken off it
+  bool reaping;  // a thread is taking completions off the ring
+  struct iovec* iovecs;  // of each frame, while it is read
+  uint64_t* dropped;  // scratch for `uring_submit`
+#endif
+};
+
+void read_ahead_finish(ReadAhead* ra, int32_t frame_num, int error) {
+  Frame* frame = &ra->pager->frames[frame_num];
+  frame->load_error = error;
+  if (error == 0) {
+    stat_add(STAT_PAGES_READ, 1);
+  }
+  pthread_mutex_lock(&ra->lock);
+  __atomic_store_n(&frame->loading, false, __ATOMIC_RELEASE);
+  ra->num_loading -= 1;
+  pthread_cond_broadcast(&ra->done);
+  pthread_mutex_unlock(&ra->lock);
+}
+
+// reads the page of a loading frame in the calling thread
+void read_ahead_pread(ReadAhead* ra, int32_t frame_num) {
+  Pager* pager = ra->pager;
+  ssize_t bytes_read = pread(pager->file_desc, frame_page(pager, frame_num), pager->page_size,
+			     (off_t) pager->frames[frame_num].page_num * pager->page_size);
+  read_ahead_finish(ra, frame_num, bytes_read == pager->page_size ? 0 : bytes_read == -1 ? errno : EIO);
+}
+
+void* read_ahead_loop(void* arg) {
+  ReadAhead* ra = arg;
+  pthread_mutex_lock(&ra->lock);
+  while (true) {
+    while (ra->queue_length == 0 && !ra->stopping) {
+      pthread_cond_wait(&ra->queued, &ra->lock);
+    }
+    if (ra->queue_length == 0) {
+      break;
+    }
+    int32_t f = ra->queue[ra->queue_head];
+    ra->queue_head = (ra->queue_head + 1) % ra->max_loading;
+    ra->queue_length -= 1;
+    pthread_mutex_unlock(&ra->lock);
+    read_ahead_pread(ra, f);
+    pthread_mutex_lock(&ra->lock);
+  }
+  pthread_mutex_unlock(&ra->lock);
+  return NULL;
+}
+
+#ifdef HAVE_IO_URING
+// Finishes the reads that completed, after waiting for one if `wait` and
+// there are none. A read that came up short is retried with pread, which
+// reports what went wrong. Called with the read-ahead lock held, which it
+// lets go of meanwhile.
+void read_ahead_reap(ReadAhead* ra, bool wait) {
+  if (ra->reaping || ra->num_in_ring == 0) {
+    return;
+  }
+  ra->reaping = true;
+  pthread_mutex_unlock(&ra->lock);
+  Uring* ring = &ra->ring;
+  uint32_t num_reaped = 0;
+  uint32_t head = *ring->cq_head;
+  uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail && wait) {
+    syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  }
+  for (; head != tail; head++) {
+    struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+    int32_t frame_num = cqe->user_data;
+    int32_t result = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    if (result == ra->pager->page_size) {
+      read_ahead_finish(ra, frame_num, 0);
+    } else {
+      read_ahead_pread(ra, frame_num);
+    }
+    num_reaped += 1;
+  }
+  pthread_mutex_lock(&ra->lock);
+  ra->num_in_ring -= num_reaped;
+  ra->reaping = false;
+  pthread_cond_broadcast(&ra->done);
+}
+#endif
+
+// Blocks, holding the read-ahead lock, until `done` says so. With a ring
+// one waiting thread at a time reaps it, the others wait for it to, as
+// do all of them while what they wait for is not submitted yet.
+void read_ahead_wait_until(ReadAhead* ra, bool (*done)(ReadAhead*, void*), void* arg) {
+  while (!done(ra, arg)) {
+#ifdef HAVE_IO_URING
+    if (ra->use_ring && !ra->reaping && ra->num_in_ring > 0) {
+      read_ahead_reap(ra, true);
+      continue;
+    }
+#endif
+    pthread_cond_wait(&ra->done, &ra->lock);
+  }
+}
+
+// Starts reading ahead, with an io_uring if the kernel has one for us.
+// `pages` is the most leaves a scan reads ahead.
+void pager_start_read_ahead(Pager* pager, uint32_t pages) {
+  pager->read_ahead_pages = pages;
+  if (pages == 0 || pager->mode == PAGER_MMAP) {
+    return;
+  }
+  ReadAhead* ra = malloc(sizeof(ReadAhead));
+  ra->pager = pager;
+  ra->max_loading = pager->num_frames / 4;
+  pthread_mutex_init(&ra->lock, NULL);
+  pthread_cond_init(&ra->done, NULL);
+  pthread_cond_init(&ra->queued, NULL);
+  ra->num_loading = 0;
+  ra->stopping = false;
+  ra->queue = NULL;
+  ra->queue_head = 0;
+  ra->queue_length = 0;
+  ra->threads = NULL;
+  ra->num_threads = 0;
+  pager->read_ahead = ra;
+#ifdef HAVE_IO_URING
+  ra->use_ring = uring_open(&ra->ring, ra->max_loading);
+  if (ra->use_ring) {
+    ra->num_in_ring = 0;
+    ra->reaping = false;
+    ra->iovecs = malloc(pager->num_frames * sizeof(struct iovec));
+    ra->dropped = malloc(ra->max_loading * sizeof(uint64_t));
+    return;
+  }
+#endif
+  ra->queue = malloc(ra->max_loading * sizeof(int32_t));
+  ra->threads = malloc(READ_AHEAD_THREADS * sizeof(pthread_t));
+  while (ra->num_threads < READ_AHEAD_THREADS) {
+    if (!start_thread(&ra->threads[ra->num_threads], read_ahead_loop, ra)) {
+      db_fail("Unable to start read-ahead thread.");
+    }
+    ra->num_threads += 1;
+  }
+}
+
+bool frame_loaded(ReadAhead* ra, void* frame) {
+  return !__atomic_load_n(&((Frame*) frame)->loading, __ATOMIC_ACQUIRE);
+}
+
+bool nothing_loading(ReadAhead* ra, void* arg) {
+  return ra->num_loading == 0;
+}
+
+// blocks until `frame`, pinned by the caller, is read
+void read_ahead_wait(Pager* pager, Frame* frame) {
+  ReadAhead* ra = pager->read_ahead;
+  pthread_mutex_lock(&ra->lock);
+  read_ahead_wait_until(ra, frame_loaded, frame);
+  pthread_mutex_unlock(&ra->lock);
+}
+
+// blocks until no page is being read ahead
+void read_ahead_drain(Pager* pager) {
+  ReadAhead* ra = pager->read_ahead;
+  if (ra == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&ra->lock);
+  read_ahead_wait_until(ra, nothing_loading, NULL);
+  pthread_mutex_unlock(&ra->lock);
+}
+
+void pager_stop_read_ahead(Pager* pager) {
+  ReadAhead* ra = pager->read_ahead;
+  if (ra == NULL) {
+    return;
+  }
+  read_ahead_drain(pager);
+#ifdef HAVE_IO_URING
+  if (ra->use_ring) {
+    uring_close(&ra->ring);
+    free(ra->iovecs);
+    free(ra->dropped);
+  }
+#endif
+  pthread_mutex_lock(&ra->lock);
+  ra->stopping = true;
+  pthread_cond_broadcast(&ra->queued);
+  pthread_mutex_unlock(&ra->lock);
+  for (uint32_t i = 0; i < ra->num_threads; i++) {
+    pthread_join(ra->threads[i], NULL);
+  }
+  free(ra->queue);
+  free(ra->threads);
+  pthread_mutex_destroy(&ra->lock);
+  pthread_cond_destroy(&ra->done);
+  pthread_cond_destroy(&ra->queued);
+  free(ra);
+  pager->read_ahead = NULL;
+}
+
+// Starts reading those of `count` pages that are in the file and not
+// cached, as far as there are clean frames for them, and returns at once.
+void pager_read_ahead(Pager* pager, const uint32_t* page_nums, uint32_t count) {
+  if (pager->mode == PAGER_MMAP) {
+    for (uint32_t i = 0; i < count; i++) {
+      // consecutive pages in one call
+      uint32_t run = 1;
+      while (i + run < count && page_nums[i + run] == page_nums[i] + run) {
+	run += 1;
+      }
+      if ((size_t) (page_nums[i] + run) * pager->page_size <= pager->map_size) {
+	madvise(pager->map + (size_t) page_nums[i] * pager->page_size,
+		(size_t) run * pager->page_size, MADV_WILLNEED);
+      }
+      i += run - 1;
+    }
+    return;
+  }
+  ReadAhead* ra = pager->read_ahead;
+  if (ra == NULL || count == 0) {
+    return;
+  }
+#ifdef HAVE_IO_URING
+  if (ra->use_ring) {
+    pthread_mutex_lock(&ra->lock);
+    read_ahead_reap(ra, false);
+    pthread_mutex_unlock(&ra->lock);
+  }
+#endif
+
+  int32_t* claimed = malloc(count * sizeof(int32_t));
+  uint32_t num_claimed = 0;
+  pager_frames_lock(pager);
+  pthread_mutex_lock(&ra->lock);
+  uint32_t room = ra->max_loading - ra->num_loading;
+  pthread_mutex_unlock(&ra->lock);
+  uint32_t num_pages_in_file = pager->file_length / pager->page_size;
+  for (uint32_t i = 0; i < count && num_claimed < room; i++) {
+    uint32_t page_num = page_nums[i];
+    if (page_num >= num_pages_in_file || pager_lookup(pager, page_num) != -1
+	|| pager_spilled_offset(pager, page_num) != 0) {
+      continue;
+    }
+    int32_t f = pager_find_clean_victim(pager);
+    if (f == -1) {
+      break;
+    }
+    Frame* frame = &pager->frames[f];
+    if (frame->in_use) {
+      pager_evict(pager, f);
+    }
+    frame->page_num = page_num;
+    frame->in_use = true;
+    frame->pin_count = 0;
+    frame->referenced = true;  // a sweep's grace for the reader to get here
+    frame->read_ahead = true;
+    frame->load_error = 0;
+    __atomic_store_n(&frame->loading, true, __ATOMIC_RELEASE);
+    pager_hash_insert(pager, f);
+    claimed[num_claimed++] = f;
+  }
+  pthread_mutex_lock(&ra->lock);
+  ra->num_loading += num_claimed;
+  pthread_mutex_unlock(&ra->lock);
+  pager_frames_unlock(pager);
+
+#ifdef HAVE_IO_URING
+  if (ra->use_ring) {
+    pthread_mutex_lock(&ra->lock);
+    for (uint32_t i = 0; i < num_claimed; i++) {
+      int32_t f = claimed[i];
+      ra->iovecs[f].iov_base = frame_page(pager, f);
+      ra->iovecs[f].iov_len = pager->page_size;
+      uring_push(&ra->ring, pager->file_desc, &ra->iovecs[f],
+		 (off_t) pager->frames[f].page_num * pager->page_size, f);
+    }
+    uint32_t num_dropped;
+    int error = uring_submit(&ra->ring, ra->dropped, &num_dropped);
+    ra->num_in_ring += num_claimed - num_dropped;
+    pthread_cond_broadcast(&ra->done);
+    pthread_mutex_unlock(&ra->lock);
+    for (uint32_t i = 0; i < num_dropped; i++) {
+      read_ahead_finish(ra, ra->dropped[i], error);
+    }
+    free(claimed);
+    return;
+  }
+#endif
+  pthread_mutex_lock(&ra->lock);
+  for (uint32_t i = 0; i < num_claimed; i++) {
+    ra->queue[(ra->queue_head + ra->queue_length) % ra->max_loading] = claimed[i];
+    ra->queue_length += 1;
+  }
+  pthread_cond_broadcast(&ra->queued);
+  pthread_mutex_unlock(&ra->lock);
+  free(claimed);
+}
+
+// BACK END: SNAPSHOTS
+
+// A snapshot keeps the pages as they were when it was taken, for a
+// backup to copy while writers carry on. It is taken between writes, so
+// it holds only committed changes. The first time a writer dirties a
+// page the backup has not copied yet, `pager_mark_dirty` keeps a copy of
+// it aside, which the backup takes instead of the page. Pages the backup
+// has copied, and those added since, are left alone.
+//
+// The backup copies the pages in order, a run of them at a time with the
+// snapshot's lock held, and a writer waits for the lock only if it is
+// about to change a page that is left to copy. Pages the backup finds in
+// the page cache are copied from there, the others are read from the db
+// file in one pread per run, without going through the cache.
+//
+// `.import` and deletes write pages wholesale, and an insert that has
+// the tree to itself may too, a backup keeps them waiting, see
+// `db_backup`.
+
+#define SNAPSHOT_RUN_PAGES 64  // pages copied per hold of the lock
+
+struct Snapshot_t {
+  uint32_t num_pages;
+  uint32_t next;  // pages below it are copied, accessed atomically
+  void** copies;  // page number -> page as it was, NULL if unchanged
+  uint32_t num_copies;
+  pthread_mutex_t lock;
+};
+
+// taken by the writer, between writes
+Snapshot* snapshot_begin(Pager* pager) {
+  Snapshot* snapshot = malloc(sizeof(Snapshot));
+  snapshot->num_pages = pager->num_pages;
+  snapshot->next = 0;
+  snapshot->copies = calloc(snapshot->num_pages, sizeof(void*));
+  snapshot->num_copies = 0;
+  pthread_mutex_init(&snapshot->lock, NULL);
+  pager->snapshot = snapshot;
+  return snapshot;
+}
+
+void snapshot_free(Snapshot* snapshot) {
+  for (uint32_t i = 0; i < snapshot->num_pages; i++) {
+    free(snapshot->copies[i]);
+  }
+  free(snapshot->copies);
+  pthread_mutex_destroy(&snapshot->lock);
+  free(snapshot);
+}
+
+// by the writer, once the backup is done with it
+void snapshot_end(Pager* pager) {
+  snapshot_free(pager->snapshot);
+  pager->snapshot = NULL;
+}
+
+// Copies `page_num` aside if the backup still needs it as it is. Called
+// on a pinned page before the writer modifies it, without the frames
+// lock: the backup takes the frames lock with the snapshot's held. The
+// one page a commit dirties with the frames lock held was changed by the
+// transaction already, it is never copied here.
+void snapshot_preserve(Pager* pager, uint32_t page_num) {
+  Snapshot* snapshot = pager->snapshot;
+  if (page_num >= snapshot->num_pages
+      || page_num < __atomic_load_n(&snapshot->next, __ATOMIC_ACQUIRE)
+      || __atomic_load_n(&snapshot->copies[page_num], __ATOMIC_ACQUIRE) != NULL) {
+    return;
+  }
+  void* page;
+  if (pager->mode == PAGER_MMAP) {
+    page = pager->map + (size_t) page_num * pager->page_size;
+  } else {
+    pager_frames_lock(pager);
+    int32_t f = pager_lookup(pager, page_num);
+    pager_frames_unlock(pager);
+    if (f == -1) {
+      return;  // not pinned, `pager_mark_dirty` fails
+    }
+    page = frame_page(pager, f);
+  }
+  pthread_mutex_lock(&snapshot->lock);
+  if (page_num >= snapshot->next && snapshot->copies[page_num] == NULL) {
+    void* copy = malloc(pager->page_size);
+    memcpy(copy, page, pager->page_size);
+    __atomic_store_n(&snapshot->copies[page_num], copy, __ATOMIC_RELEASE);
+    snapshot->num_copies += 1;
+  }
+  pthread_mutex_unlock(&snapshot->lock);
+}
+
+// Copies the next `count` pages of the snapshot to `dest`, which holds
+// as many and is page aligned.
+void snapshot_read(Pager* pager, Snapshot* snapshot, void* dest, uint32_t count) {
+  pthread_mutex_lock(&snapshot->lock);
+  uint32_t first = snapshot->next;
+  uint32_t run_start = 0;
+  uint32_t run_length = 0;  // pages to read from the file
+  for (uint32_t i = 0; i <= count; i++) {
+    uint32_t page_num = first + i;
+    bool from_file = false;
+    if (i < count) {
+      void* page = dest + (size_t) i * pager->page_size;
+      // a page evicted since is in the file, the file length says so
+      // under the same lock
+      bool cached = pager->mode == PAGER_MMAP;
+      uint32_t num_pages_in_file = pager->num_pages;
+      if (!cached) {
+	pager_frames_lock(pager);
+	cached = pager_lookup(pager, page_num) != -1;
+	num_pages_in_file = pager->file_length / pager->page_size;
+	pager_frames_unlock(pager);
+      }
+      if (snapshot->copies[page_num] != NULL) {
+	memcpy(page, snapshot->copies[page_num], pager->page_size);
+	free(snapshot->copies[page_num]);
+	snapshot->copies[page_num] = NULL;
+      } else if (cached) {
+	// the page can't change until the lock is let go
+	memcpy(page, get_page(pager, page_num), pager->page_size);
+	pager_unpin(pager, page_num);
+      } else if (page_num < num_pages_in_file) {
+	from_file = true;
+      } else {
+	memset(page, 0, pager->page_size);
+      }
+    }
+    if (from_file) {
+      if (run_length == 0) {
+	run_start = i;
+      }
+      run_length += 1;
+    } else if (run_length > 0) {
+      size_t size = (size_t) run_length * pager->page_size;
+      if (pread(pager->file_desc, dest + (size_t) run_start * pager->page_size, size,
+		(off_t) (first + run_start) * pager->page_size) != (ssize_t) size) {
+	pthread_mutex_unlock(&snapshot->lock);
+	db_fail("Error reading file: %d", errno);
+      }
+      stat_add(STAT_PAGES_READ, run_length);
+      run_length = 0;
+    }
+  }
+  __atomic_store_n(&snapshot->next, first + count, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&snapshot->lock);
+}
+
+// Writes the snapshot to `file_desc` from the first page to the last.
+// Returns false if writing failed, with errno set.
+bool snapshot_write(Pager* pager, Snapshot* snapshot, int file_desc) {
+  void* buffer = page_buffer_alloc(pager->page_size, SNAPSHOT_RUN_PAGES);
+  bool written = true;
+  while (written && snapshot->next < snapshot->num_pages) {
+    uint32_t first = snapshot->next;
+    uint32_t count = snapshot->num_pages - first;
+    if (count > SNAPSHOT_RUN_PAGES) {
+      count = SNAPSHOT_RUN_PAGES;
+    }
+    snapshot_read(pager, snapshot, buffer, count);
+    size_t size = (size_t) count * pager->page_size;
+    written = pwrite(file_desc, buffer, size, (off_t) first * pager->page_size) == (ssize_t) size;
+  }
+  free(buffer);
+  return written && fsync(file_desc) == 0;
+}
+
+
+// BACK END
+
+// common node header layout
+const uint32_t NODE_TYPE_SIZE = sizeof(uint32_t);
+const uint32_t NODE_TYPE_OFFSET = 0;
+const uint32_t IS_ROOT_SIZE = sizeof(uint32_t);
+const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
+const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
+const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
+const uint32_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+
+// leaf node header layout
+const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
+  LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET =
+  LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_FRAGMENTED_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_FRAGMENTED_OFFSET =
+  LEAF_NODE_CONTENT_START_OFFSET + LEAF_NODE_CONTENT_START_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE
+  + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE
+  + LEAF_NODE_CONTENT_START_SIZE + LEAF_NODE_FRAGMENTED_SIZE;
+
+// leaf node body layout, a slotted page: the keys of the cells, in order,
+// follow the header as a dense array so that searches touch few cache
+// lines, then come the offsets of the cells in the same order. The cells
+// themselves, serialized rows, are packed from the end of the page
+// towards them. Removing a cell leaves a hole until the page is compacted.
+const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_KEYS_OFFSET = LEAF_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_CELL_OFFSET_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_SLOT_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_CELL_OFFSET_SIZE;
+
+uint32_t leaf_node_space_for_cells() {
+  return node_page_size - LEAF_NODE_HEADER_SIZE;
+}
+
+// internal node header layout
+const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
+  INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_COUNT_OFFSET =
+  INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE
+  + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE
+  + INTERNAL_NODE_RIGHT_COUNT_SIZE;
+
+// internal node body layout: a dense array of keys followed by the array
+// of children to their left and the array of the number of rows under
+// each of those, the right child and its count are in the header. The
+// counts make the tree an order statistic tree: the rows before a key,
+// or the row at a position, are found on the way down to a leaf.
+const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CELL_SIZE =
+  INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_COUNT_SIZE;
+const uint32_t INTERNAL_NODE_KEYS_OFFSET = INTERNAL_NODE_HEADER_SIZE;
+
+uint32_t internal_node_max_cells() {
+#ifdef INTERNAL_NODE_TEST_MAX_CELLS
+  // e.g. -DINTERNAL_NODE_TEST_MAX_CELLS=3 to exercise internal splits with few rows
+  return INTERNAL_NODE_TEST_MAX_CELLS;
+#else
+  return (node_page_size - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE;
+#endif
+}
+
+enum NodeType_t {
+		 NODE_LEAF,
+		 NODE_INTERNAL,
+		 NODE_INDEX_LEAF,  // see SECONDARY INDEXES
+		 NODE_INDEX_INTERNAL
+};
+typedef enum NodeType_t NodeType;
+
+bool is_node_root(void* node) {
+  uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
+  return (bool) value;
+}
+
+void set_node_root(void* node, bool is_root) {
+  uint8_t value = is_root;
+  *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+}
+
+// accessing leaf nodes
+uint32_t* leaf_node_num_cells(void* node) {
+  return node + LEAF_NODE_NUM_CELLS_OFFSET;
+}
+
+uint32_t* leaf_node_keys(void* node) {
+  return node + LEAF_NODE_KEYS_OFFSET;
+}
+
+uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
+  return leaf_node_keys(node) + cell_num;
+}
+
+// the offsets start right after the last key, so they move as cells are
+// added or removed
+uint16_t* leaf_node_cell_offsets(void* node) {
+  return (void*) (leaf_node_keys(node) + *leaf_node_num_cells(node));
+}
+
+uint16_t* leaf_node_slot(void* node, uint32_t cell_num) {
+  return leaf_node_cell_offsets(node) + cell_num;
+}
+
+// the serialized row, which starts with its id, a copy of the key
+void* leaf_node_cell(void* node, uint32_t cell_num) {
+  return node + *leaf_node_slot(node, cell_num);
+}
+
+void* leaf_node_value(void* node, uint32_t cell_num) {
+  return leaf_node_cell(node, cell_num);
+}
+
+uint32_t* leaf_node_content_start(void* node) {
+  return node + LEAF_NODE_CONTENT_START_OFFSET;  // offset of the lowest cell
+}
+
+uint32_t* leaf_node_fragmented_bytes(void* node) {
+  return node + LEAF_NODE_FRAGMENTED_OFFSET;  // holes left by removed cells
+}
+
+uint32_t* leaf_node_next_leaf(void* node) {
+  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+NodeType get_node_type(void* node) {
+  uint8_t* type = (uint8_t *)(node + NODE_TYPE_OFFSET);
+  return (NodeType)(*type);
+}
+
+void set_node_type(void* node, NodeType type) {
+  uint8_t value = type;
+  *((uint8_t *)(node + NODE_TYPE_OFFSET)) = value;
+}
+
+uint32_t* internal_node_num_keys(void* node) {
+  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
+
+uint32_t* internal_node_right_child(void* node) {
+  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+uint32_t* internal_node_keys(void* node) {
+  return node + INTERNAL_NODE_KEYS_OFFSET;
+}
+
+// the child left of key `cell_num`
+uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
+  uint32_t* keys_end = internal_node_keys(node) + internal_node_max_cells();
+  return keys_end + cell_num;
+}
+
+uint32_t* internal_node_key(void* node, uint32_t key_num) {
+  return internal_node_keys(node) + key_num;
+}
+
+uint32_t* internal_node_right_count(void* node) {
+  return node + INTERNAL_NODE_RIGHT_COUNT_OFFSET;
+}
+
+// rows under the child left of key `cell_num`
+uint32_t* internal_node_cell_count(void* node, uint32_t cell_num) {
+  return internal_node_cell(node, internal_node_max_cells()) + cell_num;
+}
+
+// moves `count` keys along with their left children, the nodes may be
+// the same and the ranges may overlap
+void internal_node_copy_cells(void* dest, uint32_t to, void* source, uint32_t from, uint32_t count) {
+  memmove(internal_node_key(dest, to), internal_node_key(source, from),
+	  count * INTERNAL_NODE_KEY_SIZE);
+  memmove(internal_node_cell(dest, to), internal_node_cell(source, from),
+	  count * INTERNAL_NODE_CHILD_SIZE);
+  memmove(internal_node_cell_count(dest, to), internal_node_cell_count(source, from),
+	  count * INTERNAL_NODE_COUNT_SIZE);
+}
+
+uint32_t* internal_node_child(void* node, uint32_t child_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if (child_num > num_keys) {
+    db_fail("Tried to access child_num %d > num_keys %d", child_num, num_keys);
+  } else if (child_num == num_keys) {
+    return internal_node_right_child(node);
+  } else {
+    return internal_node_cell(node, child_num);
+  }
+}
+
+// rows under child `child_num`, the right child's too
+uint32_t* internal_node_child_count(void* node, uint32_t child_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if (child_num > num_keys) {
+    db_fail("Tried to access child_num %d > num_keys %d", child_num, num_keys);
+  } else if (child_num == num_keys) {
+    return internal_node_right_count(node);
+  } else {
+    return internal_node_cell_count(node, child_num);
+  }
+}
+
+// rows in the subtree of `node`, from its own cells or counts
+uint32_t node_row_count(void* node) {
+  if (get_node_type(node) == NODE_LEAF) {
+    return *leaf_node_num_cells(node);
+  }
+  uint32_t num_keys = *internal_node_num_keys(node);
+  uint32_t count = *internal_node_right_count(node);
+  for (uint32_t i = 0; i < num_keys; i++) {
+    count += *internal_node_cell_count(node, i);
+  }
+  return count;
+}
+
+uint32_t get_node_max_key(Pager* pager, void* node) {
+  if (get_node_type(node) == NODE_LEAF) {
+    return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+  }
+  // keys only bound the left children, the max is in the right subtree
+  uint32_t right_child_page_num = *internal_node_right_child(node);
+  void* right_child = get_page(pager, right_child_page_num);
+  uint32_t max_key = get_node_max_key(pager, right_child);
+  pager_unpin(pager, right_child_page_num);
+  return max_key;
+}
+
+uint32_t* node_parent(void* node) {
+  return node + PARENT_POINTER_OFFSET;
+}
+
+void initialize_leaf_node(void* node) {
+  set_node_type(node, NODE_LEAF);
+  set_node_root(node, false);
+  *leaf_node_num_cells(node) = 0;
+  *leaf_node_next_leaf(node) = 0;
+  *leaf_node_content_start(node) = node_page_size;
+  *leaf_node_fragmented_bytes(node) = 0;
+}
+
+void initialize_internal_node(void* node) {
+  set_node_type(node, NODE_INTERNAL);
+  set_node_root(node, false);
+  *internal_node_num_keys(node) = 0;
+  *internal_node_right_count(node) = 0;
+}
+
+#define MAX_TREE_DEPTH 64
+
+typedef struct ScanPool_t ScanPool;
+
+struct Table_t {
+  char* filename;
+  uint32_t root_page_num;
+  Pager* pager;
+  bool in_transaction;  // between `begin` and `commit`
+  uint32_t fill_factor;  // percent of each node `.import` fills
+  // pages the running insert holds latched, see `table_find_latched`
+  uint32_t latched[MAX_TREE_DEPTH];
+  uint32_t num_latched;
+  ScanPool* scan_pool;  // threads aggregates scan with, NULL for none
+  uint32_t index_root_page_nums[NUM_TEXT_COLUMNS];  // as in the header
+  // no id in the table is above `max_key`, or there are no rows, while
+  // `max_key_valid`, see `table_insert`
+  bool max_key_valid;
+  bool has_rows;
+  uint32_t max_key;
+};
+typedef struct Table_t Table;
+
+void scan_pool_stop(Table* t);  // see CORE: PARALLEL SCANS
+
+uint32_t align_row_size(uint32_t size) {
+  return (size + ROW_ALIGNMENT - 1) & ~(ROW_ALIGNMENT - 1);
+}
+
+uint32_t serialized_row_size(Row* row) {
+  return align_row_size(ID_SIZE + 2 * ROW_LENGTH_SIZE
+			+ strlen(row->username) + strlen(row->email));
+}
+
+// size of a row as stored at `source`
+uint32_t stored_row_size(void* source) {
+  uint8_t username_length = *(uint8_t*)(source + ID_SIZE);
+  uint8_t email_length = *(uint8_t*)(source + ID_SIZE + ROW_LENGTH_SIZE + username_length);
+  return align_row_size(ID_SIZE + 2 * ROW_LENGTH_SIZE + username_length + email_length);
+}
+
+// writes `serialized_row_size(source)` bytes
+void serialize_row(Row* source, void* dest) {
+  uint8_t username_length = strlen(source->username);
+  uint8_t email_length = strlen(source->email);
+  memcpy(dest, &(source->id), ID_SIZE);
+  dest += ID_SIZE;
+  *(uint8_t*)dest = username_length;
+  memcpy(dest + ROW_LENGTH_SIZE, source->username, username_length);
+  dest += ROW_LENGTH_SIZE + username_length;
+  *(uint8_t*)dest = email_length;
+  memcpy(dest + ROW_LENGTH_SIZE, source->email, email_length);
+}
+
+void deserialize_row(void* source, Row* dest) {
+  memcpy(&(dest->id), source, ID_SIZE);
+  source += ID_SIZE;
+  uint8_t username_length = *(uint8_t*)source;
+  memcpy(dest->username, source + ROW_LENGTH_SIZE, username_length);
+  dest->username[username_length] = 0;
+  source += ROW_LENGTH_SIZE + username_length;
+  uint8_t email_length = *(uint8_t*)source;
+  memcpy(dest->email, source + ROW_LENGTH_SIZE, email_length);
+  dest->email[email_length] = 0;
+}
+
+uint32_t leaf_node_cell_size(void* node, uint32_t cell_num) {
+  return stored_row_size(leaf_node_cell(node, cell_num));
+}
+
+uint32_t leaf_node_free_space(void* node) {
+  uint32_t slots_end = LEAF_NODE_KEYS_OFFSET + *leaf_node_num_cells(node) * LEAF_NODE_SLOT_SIZE;
+  return *leaf_node_content_start(node) - slots_end + *leaf_node_fragmented_bytes(node);
+}
+
+// bytes taken by cells and their slots
+uint32_t leaf_node_used_space(void* node) {
+  return leaf_node_space_for_cells() - leaf_node_free_space(node);
+}
+
+bool leaf_node_fits(void* node, uint32_t cell_size) {
+  return leaf_node_free_space(node) >= cell_size + LEAF_NODE_SLOT_SIZE;
+}
+
+// moves every cell to the end of the page, closing the holes between them
+void leaf_node_compact(void* node) {
+  void* copy = malloc(node_page_size);
+  memcpy(copy, node, node_page_size);
+  uint32_t content_start = node_page_size;
+  for (uint32_t i = 0; i < *leaf_node_num_cells(node); i++) {
+    uint32_t size = leaf_node_cell_size(copy, i);
+    content_start -= size;
+    memcpy(node + content_start, leaf_node_cell(copy, i), size);
+    *leaf_node_slot(node, i) = content_start;
+  }
+  *leaf_node_content_start(node) = content_start;
+  *leaf_node_fragmented_bytes(node) = 0;
+  free(copy);
+}
+
+// Makes room for a cell of `size` bytes with `key` at `cell_num`, shifting
+// the cells after it, and returns where to write it. The caller checks it
+// fits.
+void* leaf_node_insert_cell(void* node, uint32_t cell_num, uint32_t key, uint32_t size) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t slots_end = LEAF_NODE_KEYS_OFFSET + (num_cells + 1) * LEAF_NODE_SLOT_SIZE;
+  if (*leaf_node_content_start(node) < slots_end + size) {
+    leaf_node_compact(node);
+  }
+  *leaf_node_content_start(node) -= size;
+
+  // the offsets move up by a key, those after the new cell by one more
+  // offset, before the keys after it overwrite the first of them
+  uint16_t* offsets = leaf_node_cell_offsets(node);
+  uint16_t* new_offsets = (void*) (leaf_node_keys(node) + num_cells + 1);
+  memmove(new_offsets + cell_num + 1, offsets + cell_num,
+	  (num_cells - cell_num) * LEAF_NODE_CELL_OFFSET_SIZE);
+  memmove(new_offsets, offsets, cell_num * LEAF_NODE_CELL_OFFSET_SIZE);
+  memmove(leaf_node_key(node, cell_num + 1), leaf_node_key(node, cell_num),
+	  (num_cells - cell_num) * LEAF_NODE_KEY_SIZE);
+  *leaf_node_key(node, cell_num) = key;
+  new_offsets[cell_num] = *leaf_node_content_start(node);
+  *leaf_node_num_cells(node) = num_cells + 1;
+  return node + *leaf_node_content_start(node);
+}
+
+void leaf_node_append_cell(void* node, void* cell) {
+  uint32_t size = stored_row_size(cell);
+  uint32_t key = *(uint32_t*) cell;
+  memcpy(leaf_node_insert_cell(node, *leaf_node_num_cells(node), key, size), cell, size);
+}
+
+// removes the cells from `from` up to, not including, `to`
+void leaf_node_remove_cells(void* node, uint32_t from, uint32_t to) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  for (uint32_t i = from; i < to; i++) {
+    *leaf_node_fragmented_bytes(node) += leaf_node_cell_size(node, i);
+  }
+  // keys first, the offsets only move down after them
+  uint16_t* offsets = leaf_node_cell_offsets(node);
+  memmove(leaf_node_key(node, from), leaf_node_key(node, to),
+	  (num_cells - to) * LEAF_NODE_KEY_SIZE);
+  uint16_t* new_offsets = (void*) (leaf_node_keys(node) + num_cells - (to - from));
+  memmove(new_offsets, offsets, from * LEAF_NODE_CELL_OFFSET_SIZE);
+  memmove(new_offsets + from, offsets + to, (num_cells - to) * LEAF_NODE_CELL_OFFSET_SIZE);
+  *leaf_node_num_cells(node) = num_cells - (to - from);
+  if (*leaf_node_num_cells(node) == 0) {
+    *leaf_node_content_start(node) = node_page_size;
+    *leaf_node_fragmented_bytes(node) = 0;
+  }
+}
+
+// Refills two adjacent leaves with `count` cells in key order, which must
+// not point into either leaf. The split point evens out the bytes: a cell
+// goes left if its middle falls in the first half.
+void leaf_nodes_distribute(void* left, void* right, void** cells, uint32_t count) {
+  uint32_t* sizes = malloc(count * sizeof(uint32_t));
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    sizes[i] = stored_row_size(cells[i]) + LEAF_NODE_SLOT_SIZE;
+    total += sizes[i];
+  }
+  uint32_t num_left = 0;
+  uint32_t left_size = 0;
+  while (num_left < count && 2 * left_size + sizes[num_left] < total) {
+    left_size += sizes[num_left++];
+  }
+  if (num_left == 0) {
+    num_left = 1;
+  } else if (num_left == count) {
+    num_left = count - 1;
+  }
+
+  void* halves[2] = { left, right };
+  for (uint32_t h = 0; h < 2; h++) {
+    *leaf_node_num_cells(halves[h]) = 0;
+    *leaf_node_content_start(halves[h]) = node_page_size;
+    *leaf_node_fragmented_bytes(halves[h]) = 0;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    leaf_node_append_cell(i < num_left ? left : right, cells[i]);
+  }
+  free(sizes);
+}
+
+Table* table_open(const char* filename, uint32_t cache_size, PagerMode mode, bool use_wal,
+		  bool direct, bool huge_pages, uint32_t page_size) {
+  Pager* pager = pager_open(filename, cache_size, mode, use_wal, direct, huge_pages,
+			    page_size);
+  node_page_size = pager->page_size;
+  Table* t = malloc(sizeof(Table));
+  t->filename = strdup(filename);
+  t->pager = pager;
+  t->in_transaction = false;
+  t->fill_factor = DEFAULT_FILL_FACTOR;
+  t->num_latched = 0;
+  t->scan_pool = NULL;
+  t->max_key_valid = false;
+  if (pager->num_pages == 0) {
+    // new db file: the header and an empty root leaf after it
+    void* header = get_page(pager, HEADER_PAGE_NUM);
+    pager_mark_dirty(pager, HEADER_PAGE_NUM);
+    *header_magic(header) = DB_MAGIC;
+    *header_version(header) = DB_FORMAT_VERSION;
+    *header_fanout(header) = internal_node_max_cells();
+    *header_page_size(header) = pager->page_size;
+    *header_root_page_num(header) = HEADER_PAGE_NUM + 1;
+    *header_page_count(header) = HEADER_PAGE_NUM + 2;
+    *header_freelist_trunk(header) = 0;
+    *header_freelist_count(header) = 0;
+    t->root_page_num = *header_root_page_num(header);
+    for (Column column = 0; column < NUM_TEXT_COLUMNS; column++) {
+      *header_index_root_page_num(header, column) = 0;
+      t->index_root_page_nums[column] = 0;
+    }
+    pager_unpin(pager, HEADER_PAGE_NUM);
+
+    void* root_node = get_page(pager, t->root_page_num);
+    pager_mark_dirty(pager, t->root_page_num);
+    initialize_leaf_node(root_node);
+    set_node_root(root_node, true);
+    pager_unpin(pager, t->root_page_num);
+    pager_commit(pager);
+  } else {
+    void* header = get_page(pager, HEADER_PAGE_NUM);
+    if (*header_magic(header) != DB_MAGIC) {
+      db_fail("Not a db file or written by an older version.");
+    }
+    if (*header_version(header) != DB_FORMAT_VERSION) {
+      db_fail("Db file format version %d is not supported.", *header_version(header));
+    }
+    if (*header_fanout(header) != internal_node_max_cells()) {
+      db_fail("Db file was written with %d keys per internal node, this build has %d.",
+	      *header_fanout(header), internal_node_max_cells());
+    }
+    if (*header_page_count(header) > pager->num_pages) {
+      db_fail("Db file has %d of its %d pages. Truncated file.", pager->num_pages,
+	      *header_page_count(header));
+    }
+    t->root_page_num = *header_root_page_num(header);
+    for (Column column = 0; column < NUM_TEXT_COLUMNS; column++) {
+      t->index_root_page_nums[column] = *header_index_root_page_num(header, column);
+    }
+    pager_unpin(pager, HEADER_PAGE_NUM);
+  }
+  return t;
+}
+
+// changes of a transaction that is still open are discarded
+void table_close(Table* t) {
+  Pager* pager = t->pager;
+  scan_pool_stop(t);
+  pager_stop_writeback(pager);
+  pager_stop_read_ahead(pager);
+  bool clean = !pager_in_transaction(pager);
+  pager_checkpoint(pager);
+  pager_flush_dirty(pager);
+  if (pager->mode == PAGER_MMAP) {
+    munmap(pager->map, MMAP_RESERVE_SIZE);
+    // drop the unused tail the mapping was grown by
+    if (ftruncate(pager->file_desc, (off_t) pager->num_pages * pager->page_size) == -1) {
+      db_fail("Error truncating db file: %d", errno);
+    }
+  }
+  if (fsync(pager->file_desc) == -1) {
+    db_fail("Error syncing db file: %d", errno);
+  }
+
+  int result = close(pager->file_desc);
+  if (result == -1) {
+    db_fail("Error closing db file.");
+  }
+
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    pthread_rwlock_destroy(&pager->frames[i].latch);
+  }
+  if (pager->frame_data != NULL) {
+    munmap(pager->frame_data, pager->frame_data_size);
+  }
+  free(pager->frames);
+  free(pager->buckets);
+  free(pager->txn_frames);
+  free(pager->spilled_pages);
+  free(pager->spilled_offsets);
+  if (pager->wal != NULL) {
+    // the log is only needed again if it still holds committed frames
+    wal_close(pager->wal, t->filename, clean);
+  }
+  pthread_mutex_destroy(&pager->frames_lock);
+  pthread_mutex_destroy(&pager->lock);
+  pthread_cond_destroy(&pager->writeback_cond);
+  if (pager->snapshot != NULL) {
+    snapshot_free(pager->snapshot);  // left by a backup that failed
+  }
+  free(pager);
+  free(t->filename);
+  free(t);
+}
+
+typedef struct IndexCursor_t IndexCursor;
+
+void index_cursor_close(IndexCursor* c);  // see SECONDARY INDEXES
+
+// a cursor keeps the leaf it points into pinned until `cursor_close`
+struct Cursor_t {
+  Table* table;
+  uint32_t page_num;
+  uint32_t cell_num;
+  bool end_of_table;
+  bool latched;  // and latched shared, moving the latch along with the pin
+  // a select reading an index instead, which only has the leaf of the
+  // row it returned latched, none once at the end, see `select_next`
+  IndexCursor* index;
+  // a reader's read-ahead, see `cursor_read_ahead`
+  uint32_t depth;  // internal nodes above the leaf, 0 for none to read from
+  uint32_t high;  // last id the reader wants
+  uint32_t ahead;  // leaves after this one read ahead
+  uint32_t window;  // leaves to read ahead next, 0 before the first
+  uint64_t wasted;  // the pager's `read_ahead_wasted` back then
+  Arena* arena;  // it was allocated from, NULL for malloc
+};
+typedef struct Cursor_t Cursor;
+
+// from the arena of the statement being stepped, if any, see ARENAS
+Cursor* cursor_alloc() {
+  Cursor* c = statement_arena != NULL
+    ? arena_alloc(statement_arena, sizeof(Cursor))
+    : malloc(sizeof(Cursor));
+  c->arena = statement_arena;
+  stat_add(STAT_CURSORS, 1);
+  return c;
+}
+
+void cursor_free(Cursor* c) {
+  if (c->arena != NULL) {
+    arena_free(c->arena, c, sizeof(Cursor));
+  } else {
+    free(c);
+  }
+}
+
+void cursor_init_read_ahead(Cursor* c, uint32_t depth) {
+  c->depth = depth;
+  c->high = UINT32_MAX;
+  c->ahead = 0;
+  c->window = 0;
+  c->wasted = 0;
+}
+
+// KEY SEARCH
+
+// Both kernels return the index of the first of `count` sorted keys that
+// is >= `key`, or `count`. The halving steps compile to conditional moves,
+// there is no branch on the comparison for the predictor to miss.
+#define KEY_SEARCH_BLOCK 16  // keys the AVX2 kernel scans linearly
+
+uint32_t key_search_scalar(const uint32_t* keys, uint32_t count, uint32_t key) {
+  if (count == 0) {
+    return 0;
+  }
+  const uint32_t* base = keys;
+  while (count > 1) {
+    uint32_t half = count / 2;
+    base = base[half - 1] < key ? base + half : base;
+    count -= half;
+  }
+  return (base - keys) + (*base < key);
+}
+
+#ifdef HAVE_X86_SIMD
+// halves down to a block, then counts the keys below `key` in it 8 at a
+// time, the comparisons are signed so both sides get their top bit flipped
+__attribute__((target("avx2")))
+uint32_t key_search_avx2(const uint32_t* keys, uint32_t count, uint32_t key) {
+  const uint32_t* base = keys;
+  while (count > KEY_SEARCH_BLOCK) {
+    uint32_t half = count / 2;
+    base = base[half - 1] < key ? base + half : base;
+    count -= half;
+  }
+  const __m256i flip = _mm256_set1_epi32(INT32_MIN);
+  const __m256i target = _mm256_xor_si256(_mm256_set1_epi32(key), flip);
+  uint32_t below = 0;
+  uint32_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i block = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (base + i)), flip);
+    __m256i less = _mm256_cmpgt_epi32(target, block);
+    below += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+  }
+  for (; i < count; i++) {
+    below += base[i] < key;
+  }
+  return (base - keys) + below;
+}
+#endif
+
+uint32_t (*key_search)(const uint32_t* keys, uint32_t count, uint32_t key) = key_search_scalar;
+
+// picks the fastest kernel the CPU supports, called once at startup
+void key_search_init() {
+#ifdef HAVE_X86_SIMD
+  if (__builtin_cpu_supports("avx2")) {
+    key_search = key_search_avx2;
+  }
+#endif
+}
+
+Cursor* leaf_node_find(Table* t, uint32_t page_num, uint32_t key) {
+  void* node = get_page(t->pager, page_num);  // pin is handed to the cursor
+  Cursor* c = cursor_alloc();
+  c->table = t;
+  c->page_num = page_num;
+  c->end_of_table = false;
+  c->latched = false;
+  c->index = NULL;
+  cursor_init_read_ahead(c, 0);
+  c->cell_num = key_search(leaf_node_keys(node), *leaf_node_num_cells(node), key);
+  return c;
+}
+
+// index of the child which contains the given key, keys are the upper
+// bounds of the children left of them
+uint32_t internal_node_find_child(void* node, uint32_t key) {
+  return key_search(internal_node_keys(node), *internal_node_num_keys(node), key);
+}
+
+Cursor* internal_node_find(Table* t, uint32_t page_num, uint32_t key) {
+  void* node = get_page(t->pager, page_num);
+  uint32_t child_index = internal_node_find_child(node, key);
+  uint32_t child_page_num = *internal_node_child(node, child_index);
+  pager_unpin(t->pager, page_num);
+  void* child = get_page(t->pager, child_page_num);
+  NodeType child_type = get_node_type(child);
+  pager_unpin(t->pager, child_page_num);
+  switch (child_type) {
+  case NODE_LEAF:
+    return leaf_node_find(t, child_page_num, key);
+  default:
+    return internal_node_find(t, child_page_num, key);
+  }
+}
+
+
+// returns position where key can be inserted, if already present,
+// returns its position
+Cursor* table_find(Table* t, uint32_t key) {
+  void* root_node = get_page(t->pager, t->root_page_num);
+  NodeType root_type = get_node_type(root_node);
+  pager_unpin(t->pager, t->root_page_num);
+  if (root_type == NODE_LEAF) {
+    return leaf_node_find(t, t->root_page_num, key);
+  } else {
+    return internal_node_find(t, t->root_page_num, key);
+  }
+}
+
+Cursor* table_start(Table* t) {
+  Cursor* cursor = table_find(t, 0);
+  void* node = get_page(t->pager, cursor->page_num);
+  cursor->end_of_table = (*leaf_node_num_cells(node) == 0);
+  pager_unpin(t->pager, cursor->page_num);
+  return cursor;
+}
+
+void cursor_close(Cursor* c) {
+  if (c->index != NULL) {
+    index_cursor_close(c->index);
+  }
+  if (c->index == NULL || !c->end_of_table) {
+    if (c->latched) {
+      pager_unlatch(c->table->pager, c->page_num);
+    } else {
+      pager_unpin(c->table->pager, c->page_num);
+    }
+  }
+  cursor_free(c);
+}
+
+// the returned pointer stays valid while the cursor is on this leaf
+void* cursor_value(Cursor* c) {
+  void* page = get_page(c->table->pager, c->page_num);
+  pager_unpin(c->table->pager, c->page_num);
+  return leaf_node_value(page, c->cell_num);
+}
+
+// Reads ahead up to `count` leaves, from the one `key` is in through the
+// one `high` is in, on a tree with `depth` internal levels. They are
+// taken from the parent of the first, those of the next parent are left
+// for when the reader is in it. The reader holds the latch of its leaf,
+// so this gives up on a node a writer has. Returns how many leaves were
+// read ahead.
+uint32_t table_read_ahead(Table* t, uint32_t key, uint32_t high, uint32_t count, uint32_t depth) {
+  Pager* pager = t->pager;
+  if (depth == 0 || count == 0) {
+    return 0;
+  }
+  uint32_t page_num = t->root_page_num;
+  void* node = pager_try_latch(pager, page_num);
+  // a root split since the reader came down only adds a level on top
+  for (uint32_t level = 1; node != NULL && level < depth
+	 && get_node_type(node) == NODE_INTERNAL; level++) {
+    uint32_t child_page_num = *internal_node_child(node, internal_node_find_child(node, key));
+    void* child = pager_try_latch(pager, child_page_num);
+    pager_unlatch(pager, page_num);
+    page_num = child_page_num;
+    node = child;
+  }
+  if (node == NULL) {
+    return 0;
+  }
+  uint32_t* leaves = malloc(count * sizeof(uint32_t));
+  uint32_t num_leaves = 0;
+  if (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t last = internal_node_find_child(node, high);
+    for (uint32_t i = internal_node_find_child(node, key); i <= last && num_leaves < count; i++) {
+      leaves[num_leaves++] = *internal_node_child(node, i);
+    }
+  }
+  pager_unlatch(pager, page_num);
+  pager_read_ahead(pager, leaves, num_leaves);
+  free(leaves);
+  return num_leaves;
+}
+
+// A reader that moves on to the next leaf reads ahead the leaves after
+// it once half of the last window is behind it. The window starts at
+// READ_AHEAD_MIN_WINDOW and doubles each time up to the pager's
+// `read_ahead_pages`, but halves when pages read ahead were evicted
+// before anyone asked for them: the cache is too small to read that far
+// ahead of the readers it has.
+void cursor_read_ahead(Cursor* c, void* node) {
+  Pager* pager = c->table->pager;
+  if (c->ahead > 0) {
+    c->ahead -= 1;
+  }
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (pager->read_ahead_pages == 0 || c->depth == 0 || num_cells == 0
+      || c->ahead > c->window / 2) {
+    return;
+  }
+  uint32_t max_key = *leaf_node_key(node, num_cells - 1);
+  if (max_key >= c->high) {
+    return;
+  }
+  uint64_t wasted = __atomic_load_n(&pager->read_ahead_wasted, __ATOMIC_RELAXED);
+  if (c->window == 0) {
+    c->window = READ_AHEAD_MIN_WINDOW;
+  } else if (wasted > c->wasted) {
+    c->window = c->window / 2 > READ_AHEAD_MIN_WINDOW ? c->window / 2 : READ_AHEAD_MIN_WINDOW;
+  } else if (c->window < pager->read_ahead_pages) {
+    c->window *= 2;
+  }
+  if (c->window > pager->read_ahead_pages) {
+    c->window = pager->read_ahead_pages;
+  }
+  c->wasted = wasted;
+  c->ahead = table_read_ahead(c->table, max_key + 1, c->high, c->window, c->depth);
+}
+
+void cursor_advance(Cursor* c) {
+  Pager* pager = c->table->pager;
+  uint32_t page_num = c->page_num;
+  void* node = get_page(pager, page_num);
+  c->cell_num += 1;
+  if (c->cell_num >= (*leaf_node_num_cells(node))) {
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num == 0) {
+      c->end_of_table = true;
+    } else {
+      // move the cursor's pin over to the next leaf, latching it before
+      // letting go of this one so that no split can slip in between
+      if (c->latched) {
+	void* next = pager_latch(pager, next_page_num, false);
+	pager_unlatch(pager, page_num);
+	cursor_read_ahead(c, next);
+      } else {
+	get_page(pager, next_page_num);
+	pager_unpin(pager, page_num);
+      }
+      c->page_num = next_page_num;
+      c->cell_num = 0;
+    }
+  }
+  pager_unpin(pager, page_num);
+}
+
+// Readers and inserts find their leaf by latch crabbing: the child is
+// latched before the parent is let go. A reader holds at most the page
+// it is on and the one it moves to, always down or to the right. An
+// insert, `insert_size` > 0, latches exclusively and keeps every
+// ancestor a split could reach: all of them are released as soon as a
+// child has room for the row, or for one more key, as nothing above it
+// can change then. Those it keeps are in `t->latched`, for
+// `table_unlatch` to release when the insert is done. The insert counts
+// its row in every node on the way down, so it must not be a duplicate.
+//
+// Deletes and `.import` rearrange nodes across the tree and have it to
+// themselves instead, see `db_lock`.
+//
+// An `append`, of a key above every other, follows the right edge down
+// to the end of the rightmost leaf without searching the nodes.
+bool node_insert_safe(void* node, uint32_t insert_size) {
+  if (get_node_type(node) == NODE_LEAF) {
+    return leaf_node_fits(node, insert_size);
+  }
+  return *internal_node_num_keys(node) < internal_node_max_cells();
+}
+
+void table_unlatch(Table* t) {
+  for (uint32_t i = 0; i < t->num_latched; i++) {
+    pager_unlatch(t->pager, t->latched[i]);
+  }
+  t->num_latched = 0;
+}
+
+Cursor* table_find_latched(Table* t, uint32_t key, uint32_t insert_size, bool append) {
+  Pager* pager = t->pager;
+  bool exclusive = insert_size > 0;
+  uint32_t page_num = t->root_page_num;
+  void* node = pager_latch(pager, page_num, exclusive);
+  if (exclusive) {
+    t->latched[t->num_latched++] = page_num;
+  }
+  uint32_t depth = 0;
+  while (get_node_type(node) == NODE_INTERNAL) {
+    depth += 1;
+    uint32_t index = append
+      ? *internal_node_num_keys(node)
+      : internal_node_find_child(node, key);
+    uint32_t child_page_num = *internal_node_child(node, index);
+    if (exclusive) {
+      pager_mark_dirty(pager, page_num);
+      *internal_node_child_count(node, index) += 1;
+    }
+    void* child = pager_latch(pager, child_page_num, exclusive);
+    if (!exclusive) {
+      pager_unlatch(pager, page_num);
+    } else {
+      if (node_insert_safe(child, insert_size)) {
+	table_unlatch(t);
+      }
+      if (t->num_latched == MAX_TREE_DEPTH) {
+	db_fail("Tree is deeper than %d levels.", MAX_TREE_DEPTH);
+      }
+      t->latched[t->num_latched++] = child_page_num;
+    }
+    page_num = child_page_num;
+    node = child;
+  }
+
+  Cursor* c = cursor_alloc();
+  c->table = t;
+  c->page_num = page_num;
+  c->end_of_table = false;
+  c->cell_num = append
+    ? *leaf_node_num_cells(node)
+    : key_search(leaf_node_keys(node), *leaf_node_num_cells(node), key);
+  // a reader's cursor takes over the latch, an insert's gets its own pin
+  c->latched = !exclusive;
+  c->index = NULL;
+  cursor_init_read_ahead(c, depth);
+  if (exclusive) {
+    get_page(pager, page_num);
+  }
+  return c;
+}
+
+// Positions the cursor on the first row with an id of at least `key`,
+// latched for reading. The reader wants no id past `high`, the leaves of
+// a range that ends are read ahead right away.
+Cursor* table_seek(Table* t, uint32_t key, uint32_t high) {
+  Cursor* cursor = table_find_latched(t, key, 0, false);
+  cursor->high = high;
+  if (high > key && high < UINT32_MAX) {
+    uint32_t count = t->pager->read_ahead_pages;
+    uint32_t num_leaves = table_read_ahead(t, key, high, count, cursor->depth);
+    cursor->ahead = num_leaves > 0 ? num_leaves - 1 : 0;
+    cursor->window = count;
+  }
+  void* node = get_page(t->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  pager_unpin(t->pager, cursor->page_num);
+  if (num_cells == 0) {
+    cursor->end_of_table = true;  // only an empty root leaf has no cells
+  } else if (cursor->cell_num == num_cells) {
+    // every id in this leaf is smaller, the row starts the next leaf
+    cursor->cell_num = num_cells - 1;
+    cursor_advance(cursor);
+  }
+  return cursor;
+}
+
+// Rows with an id below `key`: the rows under the children left of the
+// path down to its leaf, and the cells before it there.
+uint32_t table_rank(Table* t, uint32_t key) {
+  Pager* pager = t->pager;
+  uint32_t page_num = t->root_page_num;
+  void* node = pager_latch(pager, page_num, false);
+  uint32_t rank = 0;
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t index = internal_node_find_child(node, key);
+    for (uint32_t i = 0; i < index; i++) {
+      rank += *internal_node_cell_count(node, i);
+    }
+    uint32_t child_page_num = *internal_node_child(node, index);
+    void* child = pager_latch(pager, child_page_num, false);
+    pager_unlatch(pager, page_num);
+    page_num = child_page_num;
+    node = child;
+  }
+  rank += key_search(leaf_node_keys(node), *leaf_node_num_cells(node), key);
+  pager_unlatch(pager, page_num);
+  return rank;
+}
+
+// rows with an id of at most `key`
+uint32_t table_rank_through(Table* t, uint32_t key) {
+  if (key < UINT32_MAX) {
+    return table_rank(t, key + 1);
+  }
+  void* root = pager_latch(t->pager, t->root_page_num, false);
+  uint32_t count = node_row_count(root);
+  pager_unlatch(t->pager, t->root_page_num);
+  return count;
+}
+
+// positions the cursor on the row that has `position` rows before it,
+// latched for reading, or at the end if there are not that many
+Cursor* table_seek_position(Table* t, uint32_t position) {
+  Pager* pager = t->pager;
+  uint32_t page_num = t->root_page_num;
+  void* node = pager_latch(pager, page_num, false);
+  uint32_t depth = 0;
+  while (get_node_type(node) == NODE_INTERNAL) {
+    depth += 1;
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t index = 0;
+    while (index < num_keys && position >= *internal_node_cell_count(node, index)) {
+      position -= *internal_node_cell_count(node, index);
+      index += 1;
+    }
+    uint32_t child_page_num = *internal_node_child(node, index);
+    void* child = pager_latch(pager, child_page_num, false);
+    pager_unlatch(pager, page_num);
+    page_num = child_page_num;
+    node = child;
+  }
+
+  Cursor* c = cursor_alloc();
+  c->table = t;
+  c->page_num = page_num;
+  c->latched = true;
+  c->index = NULL;
+  cursor_init_read_ahead(c, depth);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  c->end_of_table = position >= num_cells;
+  c->cell_num = c->end_of_table ? num_cells : position;
+  return c;
+}
+
+// levels of the tree, a root leaf alone is one, read down its left edge
+uint32_t table_depth(Table* t) {
+  Pager* pager = t->pager;
+  uint32_t page_num = t->root_page_num;
+  void* node = pager_latch(pager, page_num, false);
+  uint32_t depth = 1;
+  while (get_node_type(node) == NODE_INTERNAL) {
+    depth += 1;
+    uint32_t child_page_num = *internal_node_child(node, 0);
+    void* child = pager_latch(pager, child_page_num, false);
+    pager_unlatch(pager, page_num);
+    page_num = child_page_num;
+    node = child;
+  }
+  pager_unlatch(pager, page_num);
+  return depth;
+}
+
+void create_new_root(Table* t, uint32_t right_child_page_num) {
+  // old root copied to new page, becomes left child
+  void* root = get_page(t->pager, t->root_page_num);
+  void* right_child = get_page(t->pager, right_child_page_num);
+  uint32_t left_child_page_num = get_unused_page_num(t->pager);
+  void* left_child = get_page(t->pager, left_child_page_num);
+  pager_mark_dirty(t->pager, t->root_page_num);
+  pager_mark_dirty(t->pager, right_child_page_num);
+  pager_mark_dirty(t->pager, left_child_page_num);
+  memcpy(left_child, root, node_page_size);
+  set_node_root(left_child, false);  // as whole root node is copied
+
+  // root is not internal node
+  initialize_internal_node(root);
+  set_node_root(root, true);
+  *internal_node_num_keys(root) = 1;
+  *internal_node_child(root, 0) = left_child_page_num;
+  *internal_node_key(root, 0) = get_node_max_key(t->pager, left_child);
+  *internal_node_cell_count(root, 0) = node_row_count(left_child);
+  *internal_node_right_child(root) = right_child_page_num;
+  *internal_node_right_count(root) = node_row_count(right_child);
+  *node_parent(left_child) = t->root_page_num;
+  *node_parent(right_child) = t->root_page_num;
+
+  if (get_node_type(left_child) == NODE_INTERNAL) {
+    // children of the copied root now hang off the left child
+    for (uint32_t i = 0; i <= *internal_node_num_keys(left_child); i++) {
+      uint32_t child_page_num = *internal_node_child(left_child, i);
+      void* child = get_page(t->pager, child_page_num);
+      pager_mark_dirty(t->pager, child_page_num);
+      *node_parent(child) = left_child_page_num;
+      pager_unpin(t->pager, child_page_num);
+    }
+  }
+
+  pager_unpin(t->pager, t->root_page_num);
+  pager_unpin(t->pager, right_child_page_num);
+  pager_unpin(t->pager, left_child_page_num);
+}
+
+// updates the child that split, which now ends with `new_key` and holds
+// `row_count` rows
+void update_internal_node_child(void* node, uint32_t old_key, uint32_t new_key, uint32_t row_count) {
+  uint32_t old_child_index = internal_node_find_child(node, old_key);
+  if (old_child_index < *internal_node_num_keys(node)) {
+    // the right child has no key of its own
+    *internal_node_key(node, old_child_index) = new_key;
+  }
+  *internal_node_child_count(node, old_child_index) = row_count;
+}
+
+void internal_node_split_and_insert(Table* t, uint32_t page_num, uint32_t child_page_num,
+				    bool append);
+
+// `append` when the new child is the rightmost of its level
+void internal_node_insert(Table* t, uint32_t parent_page_num, uint32_t child_page_num,
+			  bool append) {
+  // add a new child-key pair to parent
+  void* parent = get_page(t->pager, parent_page_num);
+  uint32_t original_num_keys = *internal_node_num_keys(parent);
+  if (original_num_keys >= internal_node_max_cells()) {
+    pager_unpin(t->pager, parent_page_num);
+    internal_node_split_and_insert(t, parent_page_num, child_page_num, append);
+    return;
+  }
+  pager_mark_dirty(t->pager, parent_page_num);
+
+  void* child = get_page(t->pager, child_page_num);
+  pager_mark_dirty(t->pager, child_page_num);
+  *node_parent(child) = parent_page_num;
+  uint32_t child_max_key = get_node_max_key(t->pager, child);
+  uint32_t child_count = node_row_count(child);
+  uint32_t index = internal_node_find_child(parent, child_max_key);
+  pager_unpin(t->pager, child_page_num);
+
+  *internal_node_num_keys(parent) = original_num_keys + 1;
+
+  uint32_t right_child_page_num = *internal_node_right_child(parent);
+  void* right_child = get_page(t->pager, right_child_page_num);
+  uint32_t right_child_max_key = get_node_max_key(t->pager, right_child);
+  pager_unpin(t->pager, right_child_page_num);
+  if (child_max_key > right_child_max_key) {
+    // if new child is going to be right child
+    *internal_node_child(parent, original_num_keys) = right_child_page_num;
+    *internal_node_key(parent, original_num_keys) = right_child_max_key;
+    *internal_node_cell_count(parent, original_num_keys) = *internal_node_right_count(parent);
+    *internal_node_right_child(parent) = child_page_num;
+    *internal_node_right_count(parent) = child_count;
+  } else {
+    // make room for new child
+    internal_node_copy_cells(parent, index + 1, parent, index, original_num_keys - index);
+    *internal_node_child(parent, index) = child_page_num;
+    *internal_node_key(parent, index) = child_max_key;
+    *internal_node_cell_count(parent, index) = child_count;
+  }
+  pager_unpin(t->pager, parent_page_num);
+}
+
+// Splits a full internal node and adds `child_page_num` to it. The lower
+// half of the children stays, the upper half moves to a new node which is
+// then added to the parent, splitting it in turn if it is full too. Keys
+// that only ever grow would leave every node half full that way, so an
+// `append` leaves the node full and moves just the last two children.
+void internal_node_split_and_insert(Table* t, uint32_t page_num, uint32_t child_page_num,
+				    bool append) {
+  Pager* pager = t->pager;
+  stat_add(STAT_INTERNAL_SPLITS, 1);
+  void* node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  uint32_t num_keys = *internal_node_num_keys(node);
+  uint32_t right_max = get_node_max_key(pager, node);
+
+  void* child = get_page(pager, child_page_num);
+  uint32_t child_max = get_node_max_key(pager, child);
+  uint32_t child_count = node_row_count(child);
+  pager_unpin(pager, child_page_num);
+  uint32_t old_max = child_max > right_max ? child_max : right_max;
+
+  // every child in key order along with the max key of its subtree and
+  // the number of rows in it
+  uint32_t num_children = num_keys + 2;
+  uint32_t* children = malloc(num_children * sizeof(uint32_t));
+  uint32_t* max_keys = malloc(num_children * sizeof(uint32_t));
+  uint32_t* counts = malloc(num_children * sizeof(uint32_t));
+  uint32_t index = child_max > right_max
+    ? num_keys + 1
+    : internal_node_find_child(node, child_max);
+  uint32_t j = 0;
+  for (uint32_t i = 0; i <= num_keys + 1; i++) {
+    if (i == index) {
+      children[j] = child_page_num;
+      counts[j] = child_count;
+      max_keys[j++] = child_max;
+    }
+    if (i <= num_keys) {
+      children[j] = *internal_node_child(node, i);
+      counts[j] = *internal_node_child_count(node, i);
+      max_keys[j++] = i < num_keys ? *internal_node_key(node, i) : right_max;
+    }
+  }
+
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void* new_node = get_page(pager, new_page_num);
+  pager_mark_dirty(pager, new_page_num);
+  initialize_internal_node(new_node);
+  *node_parent(new_node) = *node_parent(node);
+
+  uint32_t num_left = append && index == num_keys + 1 ? num_children - 2 : num_children / 2;
+  *internal_node_num_keys(node) = num_left - 1;
+  for (uint32_t i = 0; i < num_left - 1; i++) {
+    *internal_node_child(node, i) = children[i];
+    *internal_node_key(node, i) = max_keys[i];
+    *internal_node_cell_count(node, i) = counts[i];
+  }
+  *internal_node_right_child(node) = children[num_left - 1];
+  *internal_node_right_count(node) = counts[num_left - 1];
+
+  uint32_t num_right = num_children - num_left;
+  *internal_node_num_keys(new_node) = num_right - 1;
+  for (uint32_t i = 0; i < num_right - 1; i++) {
+    *internal_node_child(new_node, i) = children[num_left + i];
+    *internal_node_key(new_node, i) = max_keys[num_left + i];
+    *internal_node_cell_count(new_node, i) = counts[num_left + i];
+  }
+  *internal_node_right_child(new_node) = children[num_children - 1];
+  *internal_node_right_count(new_node) = counts[num_children - 1];
+
+  for (uint32_t i = 0; i < num_children; i++) {
+    uint32_t parent_page_num = i < num_left ? page_num : new_page_num;
+    if (parent_page_num == page_num && children[i] != child_page_num) {
+      continue;  // still in place
+    }
+    void* moved = get_page(pager, children[i]);
+    pager_mark_dirty(pager, children[i]);
+    *node_parent(moved) = parent_page_num;
+    pager_unpin(pager, children[i]);
+  }
+
+  uint32_t new_max = max_keys[num_left - 1];
+  uint32_t new_count = node_row_count(node);
+  bool is_root = is_node_root(node);
+  uint32_t parent_page_num = *node_parent(node);
+  free(children);
+  free(max_keys);
+  free(counts);
+  pager_unpin(pager, page_num);
+  pager_unpin(pager, new_page_num);
+
+  if (is_root) {
+    create_new_root(t, new_page_num);
+  } else {
+    void* parent = get_page(pager, parent_page_num);
+    pager_mark_dirty(pager, parent_page_num);
+    update_internal_node_child(parent, old_max, new_max, new_count);
+    pager_unpin(pager, parent_page_num);
+    internal_node_insert(t, parent_page_num, new_page_num, append);
+  }
+}
+
+// Moves the upper half of the leaf's cells to a new leaf, by bytes. A row
+// that goes after the last of the rightmost leaf is taken for an append,
+// it starts a new leaf of its own and the old one stays full.
+void leaf_node_split_and_insert(Cursor* c, uint32_t key, Row* row) {
+  stat_add(STAT_LEAF_SPLITS, 1);
+  void* old_node = get_page(c->table->pager, c->page_num);
+  uint32_t old_max = get_node_max_key(c->table->pager, old_node);
+  bool append = c->cell_num == *leaf_node_num_cells(old_node)
+    && *leaf_node_next_leaf(old_node) == 0;
+  uint32_t new_page_num = get_unused_page_num(c->table->pager);
+  void* new_node = get_page(c->table->pager, new_page_num);
+  pager_mark_dirty(c->table->pager, c->page_num);
+  pager_mark_dirty(c->table->pager, new_page_num);
+  initialize_leaf_node(new_node);
+  *node_parent(new_node) = *node_parent(old_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+  *leaf_node_next_leaf(old_node) = new_page_num;
+
+  if (append) {
+    serialize_row(row, leaf_node_insert_cell(new_node, 0, key, serialized_row_size(row)));
+  } else {
+    // every cell and the new row in key order, read from a copy of the
+    // old page as it is refilled
+    void* old_copy = malloc(node_page_size);
+    memcpy(old_copy, old_node, node_page_size);
+    void* new_cell = malloc(ROW_MAX_SIZE);
+    serialize_row(row, new_cell);
+    uint32_t num_cells = *leaf_node_num_cells(old_copy) + 1;
+    void** cells = malloc(num_cells * sizeof(void*));
+    for (uint32_t i = 0; i < num_cells; i++) {
+      if (i == c->cell_num) {
+	cells[i] = new_cell;
+      } else {
+	cells[i] = leaf_node_cell(old_copy, i < c->cell_num ? i : i - 1);
+      }
+    }
+    leaf_nodes_distribute(old_node, new_node, cells, num_cells);
+    free(cells);
+    free(new_cell);
+    free(old_copy);
+  }
+
+  bool old_is_root = is_node_root(old_node);
+  uint32_t parent_page_num = *node_parent(old_node);
+  uint32_t new_max = get_node_max_key(c->table->pager, old_node);
+  uint32_t new_count = *leaf_node_num_cells(old_node);
+  pager_unpin(c->table->pager, c->page_num);
+  pager_unpin(c->table->pager, new_page_num);
+
+  if (old_is_root) {
+    return create_new_root(c->table, new_page_num);
+  } else {
+    void* parent = get_page(c->table->pager, parent_page_num);
+    pager_mark_dirty(c->table->pager, parent_page_num);
+    update_internal_node_child(parent, old_max, new_max, new_count);
+    pager_unpin(c->table->pager, parent_page_num);
+    internal_node_insert(c->table, parent_page_num, new_page_num, append);
+    return;
+  }
+}
+
+// SECONDARY INDEXES
+
+// `create index on <column>` keeps a second B+Tree for a text column,
+// rooted at a page the header records. Its keys have a fixed size: the
+// value padded with zeros to the column size, then the id of the row
+// big-endian, so that memcmp orders them by value, then by id, and no
+// two are equal. Rows are read by probing the table with the id.
+//
+// An index node has the common header, its number of keys and a page
+// number, the next leaf of a leaf or the right child of an internal
+// node. A leaf is a sorted array of keys. An internal node has the array
+// of keys, each the max under the child left of it, then the children.
+// Deletes only take keys out, index nodes are not merged. Index pages
+// have no latches, an insert into a table with an index has the tree to
+// itself, see `db_lock`.
+
+const uint32_t INDEX_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t INDEX_NODE_NEXT_OFFSET = INDEX_NODE_NUM_KEYS_OFFSET + sizeof(uint32_t);
+const uint32_t INDEX_NODE_HEADER_SIZE = INDEX_NODE_NEXT_OFFSET + sizeof(uint32_t);
+const uint32_t INDEX_NODE_CHILD_SIZE = sizeof(uint32_t);
+#define INDEX_MAX_KEY_SIZE (COLUMN_EMAIL_SIZE + sizeof(uint32_t))
+
+uint32_t index_key_size(Column column) {
+  return column_size(column) + ID_SIZE;
+}
+
+uint32_t index_leaf_max_keys(Column column) {
+  return (node_page_size - INDEX_NODE_HEADER_SIZE) / index_key_size(column);
+}
+
+uint32_t index_internal_max_keys(Column column) {
+  uint32_t max_keys =
+    (node_page_size - INDEX_NODE_HEADER_SIZE) / (index_key_size(column) + INDEX_NODE_CHILD_SIZE);
+  // test builds with few keys per internal node split indexes early too
+  return max_keys < internal_node_max_cells() ? max_keys : internal_node_max_cells();
+}
+
+uint32_t* index_node_num_keys(void* node) {
+  return node + INDEX_NODE_NUM_KEYS_OFFSET;
+}
+
+// the next leaf, or the right child of an internal node
+uint32_t* index_node_next(void* node) {
+  return node + INDEX_NODE_NEXT_OFFSET;
+}
+
+uint8_t* index_node_key(void* node, Column column, uint32_t key_num) {
+  return node + INDEX_NODE_HEADER_SIZE + key_num * index_key_size(column);
+}
+
+// Where the child left of key `child_num` is, or the right child. The
+// children follow keys of any size, so they may not be aligned and are
+// only read and written through `memcpy`.
+void* index_node_child(void* node, Column column, uint32_t child_num) {
+  if (child_num == *index_node_num_keys(node)) {
+    return index_node_next(node);
+  }
+  void* children = index_node_key(node, column, index_internal_max_keys(column));
+  return children + child_num * INDEX_NODE_CHILD_SIZE;
+}
+
+uint32_t index_node_get_child(void* node, Column column, uint32_t child_num) {
+  uint32_t page_num;
+  memcpy(&page_num, index_node_child(node, column, child_num), INDEX_NODE_CHILD_SIZE);
+  return page_num;
+}
+
+void index_node_set_child(void* node, Column column, uint32_t child_num, uint32_t page_num) {
+  memcpy(index_node_child(node, column, child_num), &page_num, INDEX_NODE_CHILD_SIZE);
+}
+
+void initialize_index_node(void* node, NodeType type) {
+  set_node_type(node, type);
+  set_node_root(node, false);
+  *index_node_num_keys(node) = 0;
+  *index_node_next(node) = 0;
+}
+
+// the key of the row `id` with a value of `length` bytes at `text`
+void index_key(Column column, const char* text, uint32_t length, uint32_t id, uint8_t* key) {
+  uint32_t size = column_size(column);
+  memcpy(key, text, length);
+  memset(key + length, 0, size - length);
+  for (uint32_t i = 0; i < ID_SIZE; i++) {
+    key[size + i] = id >> (8 * (ID_SIZE - 1 - i));
+  }
+}
+
+uint32_t index_key_id(Column column, const uint8_t* key) {
+  uint32_t id = 0;
+  for (uint32_t i = 0; i < ID_SIZE; i++) {
+    id = (id << 8) | key[column_size(column) + i];
+  }
+  return id;
+}
+
+// the value of a column in a row as it is stored
+const char* stored_row_text(void* stored_row, Column column, uint8_t* length) {
+  void* field = stored_row + ID_SIZE;
+  if (column == COLUMN_EMAIL) {
+    field += ROW_LENGTH_SIZE + *(uint8_t*) field;
+  }
+  *length = *(uint8_t*) field;
+  return field + ROW_LENGTH_SIZE;
+}
+
+void index_stored_row_key(Column column, void* stored_row, uint8_t* key) {
+  uint8_t length;
+  const char* text = stored_row_text(stored_row, column, &length);
+  index_key(column, text, length, *(uint32_t*) stored_row, key);
+}
+
+// index of the first key in the node that is >= `key`, or the number of
+// keys
+uint32_t index_node_search(void* node, Column column, const uint8_t* key) {
+  uint32_t size = index_key_size(column);
+  uint32_t low = 0;
+  uint32_t high = *index_node_num_keys(node);
+  while (low < high) {
+    uint32_t middle = (low + high) / 2;
+    if (memcmp(index_node_key(node, column, middle), key, size) < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+// Returns the leaf `key` belongs in, the internal nodes above it go into
+// `path`, root first.
+uint32_t index_find_leaf(Table* t, Column column, const uint8_t* key,
+			 uint32_t* path, uint32_t* depth) {
+  Pager* pager = t->pager;
+  uint32_t page_num = t->index_root_page_nums[column];
+  void* node = get_page(pager, page_num);
+  *depth = 0;
+  while (get_node_type(node) == NODE_INDEX_INTERNAL) {
+    if (*depth == MAX_TREE_DEPTH) {
+      db_fail("Index is deeper than %d levels.", MAX_TREE_DEPTH);
+    }
+    path[(*depth)++] = page_num;
+    uint32_t child_page_num = index_node_get_child(node, column, index_node_search(node, column, key));
+    pager_unpin(pager, page_num);
+    page_num = child_page_num;
+    node = get_page(pager, page_num);
+  }
+  pager_unpin(pager, page_num);
+  return page_num;
+}
+
+void index_set_root(Table* t, Column column, uint32_t page_num) {
+  void* header = get_page(t->pager, HEADER_PAGE_NUM);
+  pager_mark_dirty(t->pager, HEADER_PAGE_NUM);
+  *header_index_root_page_num(header, column) = page_num;
+  pager_unpin(t->pager, HEADER_PAGE_NUM);
+  t->index_root_page_nums[column] = page_num;
+}
+
+// writes `num_keys` keys and the children around them into an internal
+// node
+void index_internal_fill(void* node, Column column, uint8_t* keys, uint32_t* children,
+			 uint32_t num_keys) {
+  *index_node_num_keys(node) = num_keys;
+  memcpy(index_node_key(node, column, 0), keys, num_keys * index_key_size(column));
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    index_node_set_child(node, column, i, children[i]);
+  }
+}
+
+// Adds `right_page_num`, split off the node `left_page_num` which now
+// ends with `separator`, to the parent at the end of `path`. A full
+// parent splits in turn, its middle key moving up, and a split root gets
+// a new root above it.
+void index_insert_child(Table* t, Column column, uint32_t* path, uint32_t depth,
+			uint8_t* separator, uint32_t left_page_num, uint32_t right_page_num) {
+  Pager* pager = t->pager;
+  uint32_t key_size = index_key_size(column);
+  uint32_t max_keys = index_internal_max_keys(column);
+  uint8_t* keys = malloc((max_keys + 1) * key_size);
+  uint32_t* children = malloc((max_keys + 2) * sizeof(uint32_t));
+  while (depth > 0) {
+    uint32_t page_num = path[--depth];
+    void* node = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+
+    // the keys and children with the new pair in place, the left node
+    // stays where the node that split was
+    uint32_t num_keys = *index_node_num_keys(node);
+    uint32_t index = index_node_search(node, column, separator);
+    memcpy(keys, index_node_key(node, column, 0), index * key_size);
+    memcpy(keys + index * key_size, separator, key_size);
+    memcpy(keys + (index + 1) * key_size, index_node_key(node, column, index),
+	   (num_keys - index) * key_size);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      children[i <= index ? i : i + 1] = index_node_get_child(node, column, i);
+    }
+    children[index + 1] = right_page_num;
+    num_keys += 1;
+
+    if (num_keys <= max_keys) {
+      index_internal_fill(node, column, keys, children, num_keys);
+      pager_unpin(pager, page_num);
+      free(keys);
+      free(children);
+      return;
+    }
+    uint32_t num_left = num_keys / 2;
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void* new_node = get_page(pager, new_page_num);
+    pager_mark_dirty(pager, new_page_num);
+    initialize_index_node(new_node, NODE_INDEX_INTERNAL);
+    index_internal_fill(new_node, column, keys + (num_left + 1) * key_size,
+			children + num_left + 1, num_keys - num_left - 1);
+    index_internal_fill(node, column, keys, children, num_left);
+    memcpy(separator, keys + num_left * key_size, key_size);
+    pager_unpin(pager, page_num);
+    pager_unpin(pager, new_page_num);
+    left_page_num = page_num;
+    right_page_num = new_page_num;
+  }
+
+  uint32_t root_page_num = get_unused_page_num(pager);
+  void* root = get_page(pager, root_page_num);
+  pager_mark_dirty(pager, root_page_num);
+  initialize_index_node(root, NODE_INDEX_INTERNAL);
+  children[0] = left_page_num;
+  children[1] = right_page_num;
+  index_internal_fill(root, column, separator, children, 1);
+  pager_unpin(pager, root_page_num);
+  index_set_root(t, column, root_page_num);
+  free(keys);
+  free(children);
+}
+
+void index_insert(Table* t, Column column, const uint8_t* key) {
+  Pager* pager = t->pager;
+  uint32_t key_size = index_key_size(column);
+  uint32_t path[MAX_TREE_DEPTH];
+  uint32_t depth;
+  uint32_t page_num = index_find_leaf(t, column, key, path, &depth);
+  void* node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  uint32_t num_keys = *index_node_num_keys(node);
+  uint32_t index = index_node_search(node, column, key);
+  if (num_keys < index_leaf_max_keys(column)) {
+    memmove(index_node_key(node, column, index + 1), index_node_key(node, column, index),
+	    (num_keys - index) * key_size);
+    memcpy(index_node_key(node, column, index), key, key_size);
+    *index_node_num_keys(node) = num_keys + 1;
+    pager_unpin(pager, page_num);
+    return;
+  }
+
+  // the upper half of the keys moves to a new leaf after this one
+  uint8_t* keys = malloc((num_keys + 1) * key_size);
+  memcpy(keys, index_node_key(node, column, 0), index * key_size);
+  memcpy(keys + index * key_size, key, key_size);
+  memcpy(keys + (index + 1) * key_size, index_node_key(node, column, index),
+	 (num_keys - index) * key_size);
+  num_keys += 1;
+  uint32_t num_left = num_keys / 2;
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void* new_node = get_page(pager, new_page_num);
+  pager_mark_dirty(pager, new_page_num);
+  initialize_index_node(new_node, NODE_INDEX_LEAF);
+  *index_node_num_keys(new_node) = num_keys - num_left;
+  memcpy(index_node_key(new_node, column, 0), keys + num_left * key_size,
+	 (num_keys - num_left) * key_size);
+  *index_node_next(new_node) = *index_node_next(node);
+  *index_node_next(node) = new_page_num;
+  *index_node_num_keys(node) = num_left;
+  memcpy(index_node_key(node, column, 0), keys, num_left * key_size);
+  uint8_t separator[INDEX_MAX_KEY_SIZE];
+  memcpy(separator, keys + (num_left - 1) * key_size, key_size);
+  free(keys);
+  pager_unpin(pager, page_num);
+  pager_unpin(pager, new_page_num);
+  index_insert_child(t, column, path, depth, separator, page_num, new_page_num);
+}
+
+void index_delete(Table* t, Column column, const uint8_t* key) {
+  Pager* pager = t->pager;
+  uint32_t key_size = index_key_size(column);
+  uint32_t path[MAX_TREE_DEPTH];
+  uint32_t depth;
+  uint32_t page_num = index_find_leaf(t, column, key, path, &depth);
+  void* node = get_page(pager, page_num);
+  uint32_t num_keys = *index_node_num_keys(node);
+  uint32_t index = index_node_search(node, column, key);
+  if (index < num_keys && memcmp(index_node_key(node, column, index), key, key_size) == 0) {
+    pager_mark_dirty(pager, page_num);
+    memmove(index_node_key(node, column, index), index_node_key(node, column, index + 1),
+	    (num_keys - index - 1) * key_size);
+    *index_node_num_keys(node) = num_keys - 1;
+  }
+  pager_unpin(pager, page_num);
+}
+
+bool table_has_index(Table* t) {
+  for (Column column = 0; column < NUM_TEXT_COLUMNS; column++) {
+    if (t->index_root_page_nums[column] != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// adds a row that was just inserted to every index
+void index_add_row(Table* t, Row* row) {
+  uint8_t key[INDEX_MAX_KEY_SIZE];
+  for (Column column = 0; column < NUM_TEXT_COLUMNS; column++) {
+    if (t->index_root_page_nums[column] != 0) {
+      char* value = column_value(row, column);
+      index_key(column, value, strlen(value), row->id, key);
+      index_insert(t, column, key);
+    }
+  }
+}
+
+// takes a row about to be deleted out of every index
+void index_remove_row(Table* t, void* stored_row) {
+  uint8_t key[INDEX_MAX_KEY_SIZE];
+  for (Column column = 0; column < NUM_TEXT_COLUMNS; column++) {
+    if (t->index_root_page_nums[column] != 0) {
+      index_stored_row_key(column, stored_row, key);
+      index_delete(t, column, key);
+    }
+  }
+}
+
+// builds the index of `column` from every row, if there is none yet
+void index_create(Table* t, Column column) {
+  if (t->index_root_page_nums[column] != 0) {
+    return;
+  }
+  Pager* pager = t->pager;
+  uint32_t root_page_num = get_unused_page_num(pager);
+  void* root = get_page(pager, root_page_num);
+  pager_mark_dirty(pager, root_page_num);
+  initialize_index_node(root, NODE_INDEX_LEAF);
+  pager_unpin(pager, root_page_num);
+  index_set_root(t, column, root_page_num);
+
+  uint8_t key[INDEX_MAX_KEY_SIZE];
+  Cursor* cursor = table_start(t);
+  while (!cursor->end_of_table) {
+    index_stored_row_key(column, cursor_value(cursor), key);
+    index_insert(t, column, key);
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
+}
+
+// whether a select finds its rows through an index
+bool select_uses_index(Statement* s, Table* t) {
+  return s->match && t->index_root_page_nums[s->match_column] != 0;
+}
+
+// The keys of an index that match a select's value, or start with its
+// prefix, in key order. The cursor keeps the leaf it is on pinned.
+struct IndexCursor_t {
+  Table* table;
+  Column column;
+  uint32_t page_num;
+  uint32_t key_num;
+  bool end;
+  uint8_t start[INDEX_MAX_KEY_SIZE];  // where the range starts
+  uint32_t match_size;  // leading bytes of `start` every key in it has
+};
+
+// moves on from the end of a leaf, past empty ones
+void index_cursor_skip_empty(IndexCursor* c) {
+  Pager* pager = c->table->pager;
+  void* node = get_page(pager, c->page_num);
+  pager_unpin(pager, c->page_num);
+  while (c->key_num >= *index_node_num_keys(node)) {
+    uint32_t next_page_num = *index_node_next(node);
+    if (next_page_num == 0) {
+      c->end = true;
+      return;
+    }
+    node = get_page(pager, next_page_num);  // the pin moves along
+    pager_unpin(pager, c->page_num);
+    c->page_num = next_page_num;
+    c->key_num = 0;
+  }
+}
+
+// The value of an equality starts the range at the low end of the id
+// range, as keys with the same value are in id order.
+IndexCursor* index_seek(Table* t, Statement* s) {
+  Column column = s->match_column;
+  char* value = column_value(&s->row, column);
+  IndexCursor* c = malloc(sizeof(IndexCursor));
+  c->table = t;
+  c->column = column;
+  c->end = false;
+  c->match_size = s->match_prefix ? strlen(value) : column_size(column);
+  index_key(column, value, strlen(value), s->match_prefix ? 0 : s->id_low, c->start);
+
+  uint32_t path[MAX_TREE_DEPTH];
+  uint32_t depth;
+  c->page_num = index_find_leaf(t, column, c->start, path, &depth);
+  void* node = get_page(t->pager, c->page_num);  // pin is handed to the cursor
+  c->key_num = index_node_search(node, column, c->start);
+  index_cursor_skip_empty(c);
+  return c;
+}
+
+void index_cursor_advance(IndexCursor* c) {
+  if (!c->end) {
+    c->key_num += 1;
+    index_cursor_skip_empty(c);
+  }
+}
+
+// Stops on the first key from here on whose row is in the select's id
+// range, `id`, or returns false at the end of the range.
+bool index_cursor_next_match(IndexCursor* c, Statement* s, uint32_t* id) {
+  while (!c->end) {
+    void* node = get_page(c->table->pager, c->page_num);
+    pager_unpin(c->table->pager, c->page_num);
+    uint8_t* key = index_node_key(node, c->column, c->key_num);
+    if (memcmp(key, c->start, c->match_size) != 0) {
+      c->end = true;
+      break;
+    }
+    *id = index_key_id(c->column, key);
+    if (*id >= s->id_low && *id <= s->id_high) {
+      return true;
+    }
+    if (!s->match_prefix && *id > s->id_high) {
+      c->end = true;
+      break;
+    }
+    index_cursor_advance(c);
+  }
+  return false;
+}
+
+void index_cursor_close(IndexCursor* c) {
+  pager_unpin(c->table->pager, c->page_num);
+  free(c);
+}
+
+// Deleting cells can leave a node less than half full. It then takes
+// cells over from a sibling under the same parent, or is merged with it
+// if both fit in one node, which removes a child from the parent in turn.
+// Separator keys of internal nodes are only upper bounds: deleting the
+// largest key of a child leaves its separator in place.
+
+uint32_t leaf_node_min_fill() {
+  return leaf_node_space_for_cells() / 3;  // bytes
+}
+
+uint32_t internal_node_min_cells() {
+  return internal_node_max_cells() / 2;
+}
+
+uint32_t internal_node_child_index(void* node, uint32_t child_page_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i < num_keys; i++) {
+    if (*internal_node_child(node, i) == child_page_num) {
+      return i;
+    }
+  }
+  return num_keys;
+}
+
+// Drops the child at `index + 1` after it was merged into the one at
+// `index`, which takes over its place and key.
+void internal_node_remove_child(void* node, uint32_t index) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  *internal_node_child(node, index + 1) = *internal_node_child(node, index);
+  *internal_node_child_count(node, index + 1) = *internal_node_child_count(node, index);
+  internal_node_copy_cells(node, index, node, index + 1, num_keys - index - 1);
+  *internal_node_num_keys(node) = num_keys - 1;
+}
+
+void set_parent(Pager* pager, uint32_t page_num, uint32_t parent_page_num) {
+  void* node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  *node_parent(node) = parent_page_num;
+  pager_unpin(pager, page_num);
+}
+
+// Evens out the bytes of two adjacent leaves, or merges `right` into
+// `left` and returns true if their cells fit in one leaf.
+bool leaf_nodes_rebalance(void* parent, uint32_t left_index, void* left, void* right) {
+  uint32_t num_left = *leaf_node_num_cells(left);
+  uint32_t num_right = *leaf_node_num_cells(right);
+  if (leaf_node_used_space(left) + leaf_node_used_space(right) <= leaf_node_space_for_cells()) {
+    for (uint32_t i = 0; i < num_right; i++) {
+      leaf_node_append_cell(left, leaf_node_cell(right, i));
+    }
+    *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+    return true;
+  }
+
+  void* copies = malloc(2 * node_page_size);
+  memcpy(copies, left, node_page_size);
+  memcpy(copies + node_page_size, right, node_page_size);
+  void** cells = malloc((num_left + num_right) * sizeof(void*));
+  for (uint32_t i = 0; i < num_left + num_right; i++) {
+    cells[i] = i < num_left
+      ? leaf_node_cell(copies, i)
+      : leaf_node_cell(copies + node_page_size, i - num_left);
+  }
+  leaf_nodes_distribute(left, right, cells, num_left + num_right);
+  free(cells);
+  free(copies);
+  *internal_node_key(parent, left_index) = *leaf_node_key(left, *leaf_node_num_cells(left) - 1);
+  return false;
+}
+
+// Evens out two adjacent internal nodes by rotating children through the
+// parent's separator, or merges `right` into `left` and returns true if
+// their keys and the separator fit in one node.
+bool internal_nodes_rebalance(Pager* pager, void* parent, uint32_t left_index,
+			      uint32_t left_page_num, void* left,
+			      uint32_t right_page_num, void* right) {
+  uint32_t num_left = *internal_node_num_keys(left);
+  uint32_t num_right = *internal_node_num_keys(right);
+  uint32_t* separator = internal_node_key(parent, left_index);
+  if (num_left + num_right + 1 <= internal_node_max_cells()) {
+    // the separator comes down as the key of the left node's right child
+    *internal_node_cell(left, num_left) = *internal_node_right_child(left);
+    *internal_node_key(left, num_left) = *separator;
+    *internal_node_cell_count(left, num_left) = *internal_node_right_count(left);
+    internal_node_copy_cells(left, num_left + 1, right, 0, num_right);
+    *internal_node_right_child(left) = *internal_node_right_child(right);
+    *internal_node_right_count(left) = *internal_node_right_count(right);
+    *internal_node_num_keys(left) = num_left + num_right + 1;
+    for (uint32_t i = 0; i <= num_right; i++) {
+      set_parent(pager, *internal_node_child(right, i), left_page_num);
+    }
+    return true;
+  }
+
+  while (num_left > num_right + 1) {
+    // left's right child moves to the front of right
+    internal_node_copy_cells(right, 1, right, 0, num_right);
+    uint32_t moved = *internal_node_right_child(left);
+    *internal_node_cell(right, 0) = moved;
+    *internal_node_key(right, 0) = *separator;
+    *internal_node_cell_count(right, 0) = *internal_node_right_count(left);
+    *internal_node_num_keys(right) = ++num_right;
+    *separator = *internal_node_key(left, num_left - 1);
+    *internal_node_right_child(left) = *internal_node_cell(left, num_left - 1);
+    *internal_node_right_count(left) = *internal_node_cell_count(left, num_left - 1);
+    *internal_node_num_keys(left) = --num_left;
+    set_parent(pager, moved, right_page_num);
+  }
+  while (num_right > num_left + 1) {
+    // right's first child moves to the end of left
+    uint32_t moved = *internal_node_cell(right, 0);
+    *internal_node_cell(left, num_left) = *internal_node_right_child(left);
+    *internal_node_key(left, num_left) = *separator;
+    *internal_node_cell_count(left, num_left) = *internal_node_right_count(left);
+    *internal_node_right_child(left) = moved;
+    *internal_node_right_count(left) = *internal_node_cell_count(right, 0);
+    *internal_node_num_keys(left) = ++num_left;
+    *separator = *internal_node_key(right, 0);
+    internal_node_copy_cells(right, 0, right, 1, num_right - 1);
+    *internal_node_num_keys(right) = --num_right;
+    set_parent(pager, moved, left_page_num);
+  }
+  return false;
+}
+
+// A root left with a single child takes over the child's contents, the
+// tree gets one level shallower.
+void collapse_root(Table* t) {
+  Pager* pager = t->pager;
+  void* root = get_page(pager, t->root_page_num);
+  if (get_node_type(root) != NODE_INTERNAL || *internal_node_num_keys(root) > 0) {
+    pager_unpin(pager, t->root_page_num);
+    return;
+  }
+  uint32_t child_page_num = *internal_node_right_child(root);
+  void* child = get_page(pager, child_page_num);
+  pager_mark_dirty(pager, t->root_page_num);
+  memcpy(root, child, node_page_size);
+  set_node_root(root, true);
+  pager_unpin(pager, child_page_num);
+  if (get_node_type(root) == NODE_INTERNAL) {
+    for (uint32_t i = 0; i <= *internal_node_num_keys(root); i++) {
+      set_parent(pager, *internal_node_child(root, i), t->root_page_num);
+    }
+  }
+  pager_unpin(pager, t->root_page_num);
+  pager_free_page(pager, child_page_num);
+}
+
+// restores the fill of a node that lost cells, walking up the tree as
+// long as merges leave the parent underfull
+void node_rebalance(Table* t, uint32_t page_num) {
+  Pager* pager = t->pager;
+  void* node = get_page(pager, page_num);
+  bool is_root = is_node_root(node);
+  bool is_leaf = get_node_type(node) == NODE_LEAF;
+  bool underfull = is_leaf
+    ? leaf_node_used_space(node) < leaf_node_min_fill()
+    : *internal_node_num_keys(node) < internal_node_min_cells();
+  uint32_t parent_page_num = *node_parent(node);
+  pager_unpin(pager, page_num);
+  if (is_root) {
+    collapse_root(t);
+    return;
+  }
+  if (!underfull) {
+    return;
+  }
+
+  // pair the node with its left sibling, the first child with its right one
+  void* parent = get_page(pager, parent_page_num);
+  pager_mark_dirty(pager, parent_page_num);
+  uint32_t index = internal_node_child_index(parent, page_num);
+  uint32_t left_index = index > 0 ? index - 1 : 0;
+  uint32_t left_page_num = *internal_node_child(parent, left_index);
+  uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+  void* left = get_page(pager, left_page_num);
+  void* right = get_page(pager, right_page_num);
+  pager_mark_dirty(pager, left_page_num);
+  pager_mark_dirty(pager, right_page_num);
+
+  bool merged = is_leaf
+    ? leaf_nodes_rebalance(parent, left_index, left, right)
+    : internal_nodes_rebalance(pager, parent, left_index, left_page_num, left,
+			       right_page_num, right);
+  *internal_node_child_count(parent, left_index) = node_row_count(left);
+  *internal_node_child_count(parent, left_index + 1) = node_row_count(right);
+  if (merged) {
+    internal_node_remove_child(parent, left_index);
+  }
+  pager_unpin(pager, left_page_num);
+  pager_unpin(pager, right_page_num);
+  pager_unpin(pager, parent_page_num);
+  if (merged) {
+    pager_free_page(pager, right_page_num);
+    node_rebalance(t, parent_page_num);
+  }
+}
+
+// takes `count` rows removed from a leaf off the counts of its ancestors
+void node_remove_from_counts(Pager* pager, uint32_t page_num, uint32_t count) {
+  void* node = get_page(pager, page_num);
+  while (!is_node_root(node)) {
+    uint32_t parent_page_num = *node_parent(node);
+    void* parent = get_page(pager, parent_page_num);
+    pager_mark_dirty(pager, parent_page_num);
+    *internal_node_child_count(parent, internal_node_child_index(parent, page_num)) -= count;
+    pager_unpin(pager, page_num);
+    page_num = parent_page_num;
+    node = parent;
+  }
+  pager_unpin(pager, page_num);
+}
+
+// Deletes every row with an id between `low` and `high`, returns how many
+// there were.
+uint32_t table_delete(Table* t, uint32_t low, uint32_t high) {
+  Pager* pager = t->pager;
+  uint32_t num_deleted = 0;
+  while (low <= high) {
+    Cursor* c = table_find(t, low);
+    void* node = get_page(pager, c->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (c->cell_num == num_cells) {
+      // every key here is below `low`, continue with the next leaf
+      uint32_t next_page_num = *leaf_node_next_leaf(node);
+      pager_unpin(pager, c->page_num);
+      cursor_close(c);
+      if (next_page_num == 0) {
+	break;
+      }
+      void* next = get_page(pager, next_page_num);
+      low = *leaf_node_key(next, 0);
+      pager_unpin(pager, next_page_num);
+      continue;
+    }
+
+    uint32_t end = c->cell_num;
+    while (end < num_cells && *leaf_node_key(node, end) <= high) {
+      end += 1;
+    }
+    uint32_t count = end - c->cell_num;
+    if (count == 0) {
+      pager_unpin(pager, c->page_num);
+      cursor_close(c);
+      break;
+    }
+    uint32_t last_deleted = *leaf_node_key(node, end - 1);
+    for (uint32_t i = c->cell_num; i < end && table_has_index(t); i++) {
+      index_remove_row(t, leaf_node_value(node, i));
+    }
+    pager_mark_dirty(pager, c->page_num);
+    leaf_node_remove_cells(node, c->cell_num, end);
+    num_deleted += count;
+
+    uint32_t page_num = c->page_num;
+    pager_unpin(pager, page_num);
+    cursor_close(c);
+    node_remove_from_counts(pager, page_num, count);
+    node_rebalance(t, page_num);
+    if (end < num_cells || last_deleted == UINT32_MAX) {
+      break;  // the range ended inside this leaf
+    }
+    low = last_deleted + 1;
+  }
+  return num_deleted;
+}
+
+// CORE: VM
+
+enum ExecuteResult_t {
+		      EXECUTE_SUCCESS,
+		      EXECUTE_TABLE_FULL,
+		      EXECUTE_DUPLICATE_KEY,
+		      EXECUTE_TRANSACTION_OPEN,
+		      EXECUTE_NO_TRANSACTION
+};
+typedef enum ExecuteResult_t ExecuteResult;
+
+void leaf_node_insert(Cursor* c, uint32_t key, Row* row) {
+  void* node = get_page(c->table->pager, c->page_num);
+  uint32_t size = serialized_row_size(row);
+
+  if (!leaf_node_fits(node, size)) {
+    pager_unpin(c->table->pager, c->page_num);
+    leaf_node_split_and_insert(c, key, row);
+    return;
+  }
+  pager_mark_dirty(c->table->pager, c->page_num);
+
+  // the row's id is the cell's key
+  serialize_row(row, leaf_node_insert_cell(node, c->cell_num, key, size));
+  pager_unpin(c->table->pager, c->page_num);
+}
+
+bool table_contains(Table* t, uint32_t key) {
+  Cursor* cursor = table_find_latched(t, key, 0, false);
+  void* node = get_page(t->pager, cursor->page_num);
+  bool found = cursor->cell_num < *leaf_node_num_cells(node)
+    && *leaf_node_key(node, cursor->cell_num) == key;
+  pager_unpin(t->pager, cursor->page_num);
+  cursor_close(cursor);
+  return found;
+}
+
+// The caller is the only writer, nothing changes between looking for a
+// duplicate and the insert, which counts the row on its way down. Ids
+// tend to grow, an insert past the largest id there is skips the look
+// and goes down the right edge. Only the writer keeps that id, deletes
+// and rolled back inserts leave it above every id, which is all it needs.
+ExecuteResult table_insert(Table* t, Row* row) {
+  if (!t->max_key_valid) {
+    void* root = get_page(t->pager, t->root_page_num);
+    t->has_rows = node_row_count(root) > 0;
+    t->max_key = t->has_rows ? get_node_max_key(t->pager, root) : 0;
+    t->max_key_valid = true;
+    pager_unpin(t->pager, t->root_page_num);
+  }
+  bool append = !t->has_rows || row->id > t->max_key;
+  if (!append && table_contains(t, row->id)) {
+    return EXECUTE_DUPLICATE_KEY;
+  }
+  Cursor* cursor = table_find_latched(t, row->id, serialized_row_size(row), append);
+  leaf_node_insert(cursor, row->id, row);
+  cursor_close(cursor);
+  table_unlatch(t);
+  if (append) {
+    t->has_rows = true;
+    t->max_key = row->id;
+  }
+  index_add_row(t, row);
+
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_insert(Statement* s, Table* t) {
+  return table_insert(t, &(s->row));
+}
+
+ExecuteResult execute_delete(Statement* s, Table* t) {
+  table_delete(t, s->id_low, s->id_high);
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_create_index(Statement* s, Table* t) {
+  index_create(t, s->index_column);
+  return EXECUTE_SUCCESS;
+}
+
+// whether the stored row passes the select's text condition
+bool row_matches(Statement* s, void* stored_row) {
+  if (!s->match) {
+    return true;
+  }
+  uint8_t length;
+  const char* text = stored_row_text(stored_row, s->match_column, &length);
+  const char* value = column_value(&s->row, s->match_column);
+  size_t value_length = strlen(value);
+  if (s->match_prefix ? length < value_length : length != value_length) {
+    return false;
+  }
+  return memcmp(text, value, value_length) == 0;
+}
+
+// A select through an index lets go of the row it returned, moves on to
+// the next key in range and latches that key's row.
+void* select_next_indexed(Statement* s, Cursor* cursor, uint32_t num_rows) {
+  Table* t = cursor->table;
+  if (num_rows >= s->limit) {
+    return NULL;
+  }
+  if (!cursor->end_of_table) {
+    pager_unlatch(t->pager, cursor->page_num);
+    cursor->end_of_table = true;
+  }
+  if (num_rows > 0) {
+    index_cursor_advance(cursor->index);
+  }
+  uint32_t id;
+  if (!index_cursor_next_match(cursor->index, s, &id)) {
+    return NULL;
+  }
+  Cursor* row = table_find_latched(t, id, 0, false);
+  void* node = get_page(t->pager, row->page_num);
+  bool found = row->cell_num < *leaf_node_num_cells(node)
+    && *leaf_node_key(node, row->cell_num) == id;
+  pager_unpin(t->pager, row->page_num);
+  if (!found) {
+    cursor_close(row);
+    db_fail("Index has no row with id %d.", id);
+  }
+  stat_add(STAT_ROWS_SCANNED, 1);
+  cursor->page_num = row->page_num;  // the latch moves over
+  cursor->cell_num = row->cell_num;
+  cursor->end_of_table = false;
+  cursor_free(row);
+  return cursor_value(cursor);
+}
+
+// A select seeks to the lower bound of the id range, then reads a row at
+// a time until the upper bound or the limit, skipping rows other
+// conditions filter out. The cursor stays on the row it returns, so the
+// stored row it points into stays pinned until the next call moves on.
+// Returns NULL once there are no more rows, `num_rows` is how many were
+// returned so far.
+void* select_next(Statement* s, Cursor* cursor, uint32_t num_rows) {
+  if (cursor->index != NULL) {
+    return select_next_indexed(s, cursor, num_rows);
+  }
+  if (num_rows >= s->limit) {
+    return NULL;
+  }
+  if (num_rows > 0 && !cursor->end_of_table) {
+    cursor_advance(cursor);
+  }
+  while (!cursor->end_of_table) {
+    void* value = cursor_value(cursor);
+    stat_add(STAT_ROWS_SCANNED, 1);
+    uint32_t id;
+    memcpy(&id, value, ID_SIZE);
+    if (id > s->id_high) {
+      return NULL;
+    }
+    if (row_matches(s, value)) {
+      return value;
+    }
+    cursor_advance(cursor);
+  }
+  return NULL;
+}
+
+// Positions a select's cursor on the first row it returns. The row past
+// an offset is found with the subtree counts, unless rows are filtered by
+// a text condition, which takes reading them. With an index on its
+// column the select reads the index instead, and its rows come in the
+// index's order.
+Cursor* select_start(Statement* s, Table* t) {
+  if (select_uses_index(s, t)) {
+    Cursor* cursor = cursor_alloc();
+    cursor->table = t;
+    cursor->end_of_table = true;  // on no row yet
+    cursor->latched = true;
+    cursor->index = index_seek(t, s);
+    cursor_init_read_ahead(cursor, 0);
+    uint32_t id;
+    for (uint32_t i = 0; i < s->offset && index_cursor_next_match(cursor->index, s, &id); i++) {
+      index_cursor_advance(cursor->index);
+    }
+    return cursor;
+  }
+  if (s->offset == 0) {
+    return table_seek(t, s->id_low, s->id_high);
+  }
+  if (!s->match) {
+    uint64_t position = (uint64_t) table_rank(t, s->id_low) + s->offset;
+    return table_seek_position(t, position > UINT32_MAX ? UINT32_MAX : position);
+  }
+  Cursor* cursor = table_seek(t, s->id_low, s->id_high);
+  for (uint32_t i = 0; i < s->offset && select_next(s, cursor, 0) != NULL; i++) {
+    cursor_advance(cursor);
+  }
+  return cursor;
+}
+
+ExecuteResult execute_begin(Statement* s, Table* t) {
+  if (t->in_transaction) {
+    return EXECUTE_TRANSACTION_OPEN;
+  }
+  t->in_transaction = true;
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_commit(Statement* s, Table* t) {
+  if (!t->in_transaction) {
+    return EXECUTE_NO_TRANSACTION;
+  }
+  t->in_transaction = false;
+  pager_commit(t->pager);
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_statement(Statement* s, Table* t) {
+  ExecuteResult result = EXECUTE_SUCCESS;
+  switch (s->type) {
+  case (STATEMENT_INSERT):
+    result = execute_insert(s, t);
+    break;
+  case (STATEMENT_DELETE):
+    result = execute_delete(s, t);
+    break;
+  case (STATEMENT_CREATE_INDEX):
+    result = execute_create_index(s, t);
+    break;
+  case (STATEMENT_SELECT):
+    return EXECUTE_SUCCESS;  // stepped through with `select_next`
+  case (STATEMENT_BEGIN):
+    return execute_begin(s, t);
+  case (STATEMENT_COMMIT):
+    return execute_commit(s, t);
+  }
+  // statements outside of `begin` ... `commit` commit on their own
+  if (!t->in_transaction) {
+    pager_commit(t->pager);
+  }
+  return result;
+}
+
+// CORE: PARALLEL SCANS
+
+// An aggregate reads every row of its id range. The range is split into
+// partitions along the separator keys at the top of the tree, which are
+// scanned by the thread running the select and a pool of threads started
+// with the table. Each claims the next partition left until none are,
+// adding the rows to a partial result that is merged in at the end. A
+// partition is read a leaf at a time from the dense key array, only a
+// `username` condition looks at the rows themselves. `min` and `max`
+// claim partitions from their end of the range and skip those past the
+// first that had a row.
+
+#define SCAN_PARTITIONS_PER_THREAD 4  // so that uneven partitions even out
+#define SCAN_MAX_THREADS 64
+#define SCAN_FRAMES_PER_THREAD 4  // a scan pins 2 pages, leave room for the rest
+
+struct Aggregation_t {
+  uint64_t count;
+  uint64_t sum;
+  uint32_t min, max;  // of the ids, if `count` > 0
+};
+typedef struct Aggregation_t Aggregation;
+
+struct Scan_t {
+  Table* table;
+  Statement* statement;
+  uint32_t* bounds;  // partition i ends with id bounds[i], inclusive
+  uint32_t num_partitions;
+  uint32_t next_claim;  // partitions claimed so far
+  uint32_t first_found;  // earliest claim that had a row, for min and max
+  PageTrace* trace;  // of the statement, if explained, for the pool threads
+  pthread_mutex_t lock;  // guards the fields below
+  Aggregation result;
+  bool failed;
+  char message[256];
+  uint32_t num_active;  // pool threads working on it, guarded by the pool
+};
+typedef struct Scan_t Scan;
+
+struct ScanPool_t {
+  pthread_t* threads;
+  uint32_t num_threads;
+  pthread_mutex_t lock;  // guards the fields below
+  pthread_cond_t work;  // a scan was published, or stopping
+  pthread_cond_t idle;  // a thread is done with the scan
+  Scan* scan;  // being published, each thread joins it at most once
+  uint64_t generation;  // scans published so far
+  bool stopping;
+};
+
+void aggregation_merge(Aggregation* into, Aggregation* from) {
+  if (from->count == 0) {
+    return;
+  }
+  if (into->count == 0 || from->min < into->min) {
+    into->min = from->min;
+  }
+  if (into->count == 0 || from->max > into->max) {
+    into->max = from->max;
+  }
+  into->count += from->count;
+  into->sum += from->sum;
+}
+
+// adds `count` > 0 sorted ids
+void aggregation_add_keys(Aggregation* a, const uint32_t* keys, uint32_t count, bool sum) {
+  Aggregation keys_result = { .count = count, .sum = 0, .min = keys[0], .max = keys[count - 1] };
+  if (sum) {
+    for (uint32_t i = 0; i < count; i++) {
+      keys_result.sum += keys[i];
+    }
+  }
+  aggregation_merge(a, &keys_result);
+}
+
+void scan_partition(Scan* scan, uint32_t low, uint32_t high, Aggregation* a) {
+  Table* t = scan->table;
+  Statement* s = scan->statement;
+  bool sum = s->aggregate == AGGREGATE_SUM;
+  bool first_only = s->aggregate == AGGREGATE_MIN;
+  Cursor* cursor = table_seek(t, low, high);
+  while (!cursor->end_of_table) {
+    void* node = get_page(t->pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t* keys = leaf_node_keys(node);
+    uint32_t end = high == UINT32_MAX ? num_cells : key_search(keys, num_cells, high + 1);
+    if (cursor->cell_num < end) {
+      stat_add(STAT_ROWS_SCANNED, end - cursor->cell_num);
+    }
+    if (!s->match) {
+      if (cursor->cell_num < end) {
+	aggregation_add_keys(a, keys + cursor->cell_num, end - cursor->cell_num, sum);
+      }
+    } else {
+      for (uint32_t i = cursor->cell_num; i < end; i++) {
+	if (row_matches(s, leaf_node_value(node, i))) {
+	  aggregation_add_keys(a, keys + i, 1, sum);
+	}
+      }
+    }
+    pager_unpin(t->pager, cursor->page_num);
+    if (end < num_cells || (first_only && a->count > 0)) {
+      break;
+    }
+    cursor->cell_num = num_cells - 1;
+    cursor_advance(cursor);  // on to the next leaf
+  }
+  cursor_close(cursor);
+}
+
+// Claims partitions until there are none left. A failure is recorded
+// for the thread that started the scan to raise.
+void scan_run(Scan* scan) {
+  Statement* s = scan->statement;
+  bool ends_early = s->aggregate == AGGREGATE_MIN || s->aggregate == AGGREGATE_MAX;
+  PageTrace* outer_trace = page_trace;
+  page_trace = scan->trace;
+  node_page_size = scan->table->pager->page_size;  // pool threads serve any db
+  jmp_buf jump;
+  jmp_buf* outer = fail_jump;
+  if (setjmp(jump) != 0) {
+    fail_jump = outer;
+    page_trace = outer_trace;
+    pager_frames_unwind();
+    pthread_mutex_lock(&scan->lock);
+    scan->failed = true;
+    strcpy(scan->message, fail_message);
+    pthread_mutex_unlock(&scan->lock);
+    return;
+  }
+  fail_jump = &jump;
+
+  Aggregation partial = { .count = 0, .sum = 0, .min = 0, .max = 0 };
+  uint32_t claim;
+  while ((claim = __atomic_fetch_add(&scan->next_claim, 1, __ATOMIC_RELAXED))
+	 < scan->num_partitions) {
+    if (ends_early && claim > __atomic_load_n(&scan->first_found, __ATOMIC_RELAXED)) {
+      break;
+    }
+    uint32_t i = s->aggregate == AGGREGATE_MAX ? scan->num_partitions - 1 - claim : claim;
+    uint64_t count = partial.count;
+    scan_partition(scan, i == 0 ? s->id_low : scan->bounds[i - 1] + 1, scan->bounds[i], &partial);
+    if (ends_early && partial.count > count) {
+      uint32_t found = __atomic_load_n(&scan->first_found, __ATOMIC_RELAXED);
+      while (claim < found
+	     && !__atomic_compare_exchange_n(&scan->first_found, &found, claim, false,
+					     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      }
+    }
+  }
+  fail_jump = outer;
+  page_trace = outer_trace;
+  pthread_mutex_lock(&scan->lock);
+  aggregation_merge(&scan->result, &partial);
+  pthread_mutex_unlock(&scan->lock);
+}
+
+void* scan_pool_loop(void* arg) {
+  ScanPool* pool = arg;
+  uint64_t seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    while (!pool->stopping && pool->generation == seen) {
+      pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    if (pool->stopping) {
+      break;
+    }
+    seen = pool->generation;
+    Scan* scan = pool->scan;
+    if (scan == NULL) {
+      continue;  // over before this thread woke up
+    }
+    scan->num_active += 1;
+    pthread_mutex_unlock(&pool->lock);
+    scan_run(scan);
+    pthread_mutex_lock(&pool->lock);
+    scan->num_active -= 1;
+    if (scan->num_active == 0) {
+      pthread_cond_broadcast(&pool->idle);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+void scan_pool_stop(Table* t) {
+  ScanPool* pool = t->scan_pool;
+  if (pool == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (uint32_t i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->idle);
+  free(pool->threads);
+  free(pool);
+  t->scan_pool = NULL;
+}
+
+// `num_threads` is how many scan an aggregate, counting the one running
+// it, 0 for one per core
+void scan_pool_start(Table* t, uint32_t num_threads) {
+  if (num_threads == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = cores > 0 ? cores : 1;
+  }
+  if (num_threads > SCAN_MAX_THREADS) {
+    num_threads = SCAN_MAX_THREADS;
+  }
+  Pager* pager = t->pager;
+  if (pager->mode == PAGER_BUFFERED && num_threads > pager->num_frames / SCAN_FRAMES_PER_THREAD) {
+    num_threads = pager->num_frames / SCAN_FRAMES_PER_THREAD;
+  }
+  if (num_threads <= 1) {
+    return;
+  }
+  ScanPool* pool = malloc(sizeof(ScanPool));
+  pool->num_threads = num_threads - 1;
+  pool->threads = malloc(pool->num_threads * sizeof(pthread_t));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  pool->scan = NULL;
+  pool->generation = 0;
+  pool->stopping = false;
+  t->scan_pool = pool;
+  for (uint32_t i = 0; i < pool->num_threads; i++) {
+    if (!start_thread(&pool->threads[i], scan_pool_loop, pool)) {
+      pool->num_threads = i;
+      scan_pool_stop(t);
+      db_fail("Unable to start scan threads.");
+    }
+  }
+}
+
+// Copies the separator keys of an internal node, after the ids of its
+// children when `children` is given
+uint32_t scan_node_keys(Pager* pager, uint32_t page_num, uint32_t* keys, uint32_t* children) {
+  void* node = pager_latch(pager, page_num, false);
+  uint32_t num_keys = 0;
+  if (get_node_type(node) == NODE_INTERNAL) {
+    num_keys = *internal_node_num_keys(node);
+    memcpy(keys, internal_node_keys(node), num_keys * sizeof(uint32_t));
+    for (uint32_t i = 0; children != NULL && i <= num_keys; i++) {
+      children[i] = *internal_node_child(node, i);
+    }
+  }
+  pager_unlatch(pager, page_num);
+  return num_keys;
+}
+
+// Splits the id range along the separators of the root, or of its
+// children as well when the root has fewer than `target` partitions,
+// into at most `target` partitions of about as many subtrees each.
+// Inserts may move the separators meanwhile, which only makes the
+// partitions less even.
+void scan_split(Scan* scan, uint32_t target) {
+  Pager* pager = scan->table->pager;
+  Statement* s = scan->statement;
+  uint32_t fanout = internal_node_max_cells() + 1;
+  uint32_t* root_keys = malloc(fanout * sizeof(uint32_t));
+  uint32_t* children = malloc(fanout * sizeof(uint32_t));
+  uint32_t num_root_keys = scan_node_keys(pager, scan->table->root_page_num, root_keys, children);
+  uint32_t* keys = root_keys;
+  uint32_t num_keys = num_root_keys;
+  if (num_root_keys > 0 && num_root_keys + 1 < target) {
+    keys = malloc((num_root_keys + 1) * fanout * sizeof(uint32_t));
+    num_keys = 0;
+    for (uint32_t i = 0; i <= num_root_keys; i++) {
+      num_keys += scan_node_keys(pager, children[i], keys + num_keys, NULL);
+      if (i < num_root_keys) {
+	keys[num_keys++] = root_keys[i];
+      }
+    }
+  }
+
+  uint32_t first = 0;
+  while (first < num_keys && keys[first] < s->id_low) {
+    first += 1;
+  }
+  uint32_t last = first;  // past the separators inside the range
+  while (last < num_keys && keys[last] < s->id_high) {
+    last += 1;
+  }
+  uint32_t step = (last - first) / target + 1;
+  scan->bounds = malloc(((last - first) / step + 1) * sizeof(uint32_t));
+  scan->num_partitions = 0;
+  for (uint32_t i = first + step - 1; i < last; i += step) {
+    scan->bounds[scan->num_partitions++] = keys[i];
+  }
+  scan->bounds[scan->num_partitions++] = s->id_high;
+  if (keys != root_keys) {
+    free(keys);
+  }
+  free(root_keys);
+  free(children);
+}
+
+// The count, min or max of an id range from the subtree counts, without
+// reading the rows in between. Inserts that run meanwhile only shift
+// positions to the right, so the row at the position of the max is never
+// past it, the cursor moves on to rows that came in after counting.
+Aggregation table_aggregate_by_rank(Table* t, Statement* s) {
+  Aggregation a = { .count = 0, .sum = 0, .min = 0, .max = 0 };
+  if (s->id_low > s->id_high) {
+    return a;
+  }
+  if (s->aggregate == AGGREGATE_COUNT) {
+    uint32_t first = table_rank(t, s->id_low);
+    uint32_t end = table_rank_through(t, s->id_high);
+    a.count = end > first ? end - first : 0;
+    return a;
+  }
+
+  // for min and max `count` only tells whether there is a row
+  Cursor* cursor = NULL;
+  uint32_t id;
+  if (s->aggregate == AGGREGATE_MIN) {
+    cursor = table_seek(t, s->id_low, s->id_low);
+    if (!cursor->end_of_table && (id = *(uint32_t*) cursor_value(cursor)) <= s->id_high) {
+      a.count = 1;
+      a.min = id;
+    }
+  } else {
+    uint32_t end = table_rank_through(t, s->id_high);
+    cursor = table_seek_position(t, end > 0 ? end - 1 : 0);
+    while (end > 0 && !cursor->end_of_table
+	   && (id = *(uint32_t*) cursor_value(cursor)) <= s->id_high) {
+      if (id >= s->id_low) {
+	a.count = 1;
+	a.max = id;
+      }
+      cursor_advance(cursor);
+    }
+  }
+  cursor_close(cursor);
+  return a;
+}
+
+// the ids an index has for a select's value, read from its keys alone
+Aggregation index_aggregate(Table* t, Statement* s) {
+  Aggregation a = { .count = 0, .sum = 0, .min = 0, .max = 0 };
+  IndexCursor* c = index_seek(t, s);
+  uint32_t id;
+  while (index_cursor_next_match(c, s, &id)) {
+    aggregation_add_keys(&a, &id, 1, s->aggregate == AGGREGATE_SUM);
+    if (s->aggregate == AGGREGATE_MIN && !s->match_prefix) {
+      break;  // the ids of one value are in order
+    }
+    index_cursor_advance(c);
+  }
+  index_cursor_close(c);
+  return a;
+}
+
+// the caller holds the tree shared, see `db_lock`
+Aggregation table_aggregate(Table* t, Statement* s) {
+  if (select_uses_index(s, t)) {
+    return index_aggregate(t, s);
+  }
+  if (!s->match && s->aggregate != AGGREGATE_SUM) {
+    return table_aggregate_by_rank(t, s);
+  }
+  ScanPool* pool = t->scan_pool;
+  Scan scan = {
+	       .table = t,
+	       .statement = s,
+	       .next_claim = 0,
+	       .first_found = UINT32_MAX,
+	       .trace = page_trace,
+	       .result = { .count = 0, .sum = 0, .min = 0, .max = 0 },
+	       .failed = false,
+	       .num_active = 0,
+  };
+  pthread_mutex_init(&scan.lock, NULL);
+  if (pool != NULL) {
+    scan_split(&scan, (pool->num_threads + 1) * SCAN_PARTITIONS_PER_THREAD);
+  } else {
+    scan.bounds = malloc(sizeof(uint32_t));
+    scan.bounds[0] = s->id_high;
+    scan.num_partitions = 1;
+  }
+
+  // one scan at a time has the pool, others run on their own thread
+  bool published = false;
+  if (pool != NULL && scan.num_partitions > 1) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->scan == NULL) {
+      pool->scan = &scan;
+      pool->generation += 1;
+      pthread_cond_broadcast(&pool->work);
+      published = true;
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+  scan_run(&scan);
+  if (published) {
+    pthread_mutex_lock(&pool->lock);
+    pool->scan = NULL;
+    while (scan.num_active > 0) {
+      pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+  pthread_mutex_destroy(&scan.lock);
+  free(scan.bounds);
+  if (scan.failed) {
+    db_fail("%s", scan.message);
+  }
+  return scan.result;
+}
+
+// CORE: BULK LOADER
+
+// `.import` reads `id,username,email` lines (tab separated works too,
+// csv fields may be quoted and tsv ones escaped as `.mode` writes them),
+// sorts them by id and, into an empty table, builds the tree bottom-up:
+// leaves packed to the fill factor and written in key order, then each
+// internal level on top of the one below, the root last. Input that does
+// not fit in one in-memory run is sorted with an external merge sort.
+
+#define IMPORT_RUN_ROWS (1 << 17)  // rows sorted in memory at once
+#define IMPORT_WRITE_BATCH 256  // pages per pwritev
+#define IMPORT_COMMIT_ROWS 100  // rows per transaction into a non-empty table
+
+struct ImportResult_t {
+  uint32_t num_rows;
+  uint32_t num_skipped;  // malformed lines and duplicate ids
+};
+typedef struct ImportResult_t ImportResult;
+
+// a row and the line it was read from: of the rows with one id the
+// first line's is kept, as `insert` keeps the row already there
+struct ImportRow_t {
+  Row row;
+  uint64_t line_num;
+};
+typedef struct ImportRow_t ImportRow;
+
+int compare_import_rows(const void* a, const void* b) {
+  const ImportRow* row_a = a;
+  const ImportRow* row_b = b;
+  if (row_a->row.id != row_b->row.id) {
+    return row_a->row.id > row_b->row.id ? 1 : -1;
+  }
+  return (row_a->line_num > row_b->line_num) - (row_a->line_num < row_b->line_num);
+}
+
+// sorted rows come either from the single in-memory run or from merging
+// the runs spilled to temporary files
+struct SortedRows_t {
+  ImportRow* rows;  // in-memory run
+  uint32_t num_rows;
+  uint32_t next;
+
+  FILE** runs;  // spilled runs, merged through a binary heap
+  ImportRow* heads;  // current row of each run
+  uint32_t* heap;  // run numbers ordered by their head, see `compare_import_rows`
+  uint32_t heap_size;
+  uint32_t num_runs;
+};
+typedef struct SortedRows_t SortedRows;
+
+void sorted_rows_sift_down(SortedRows* sr, uint32_t i) {
+  while (true) {
+    uint32_t smallest = i;
+    uint32_t left = 2 * i + 1;
+    uint32_t right = 2 * i + 2;
+    if (left < sr->heap_size
+	&& compare_import_rows(&sr->heads[sr->heap[left]], &sr->heads[sr->heap[smallest]]) < 0) {
+      smallest = left;
+    }
+    if (right < sr->heap_size
+	&& compare_import_rows(&sr->heads[sr->heap[right]], &sr->heads[sr->heap[smallest]]) < 0) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    uint32_t tmp = sr->heap[i];
+    sr->heap[i] = sr->heap[smallest];
+    sr->heap[smallest] = tmp;
+    i = smallest;
+  }
+}
+
+void sorted_rows_rewind(SortedRows* sr) {
+  sr->next = 0;
+  if (sr->num_runs == 0) {
+    return;
+  }
+  sr->heap_size = 0;
+  for (uint32_t r = 0; r < sr->num_runs; r++) {
+    rewind(sr->runs[r]);
+    if (fread(&sr->heads[r], sizeof(ImportRow), 1, sr->runs[r]) == 1) {
+      sr->heap[sr->heap_size++] = r;
+    }
+  }
+  for (int32_t i = (int32_t) sr->heap_size / 2 - 1; i >= 0; i--) {
+    sorted_rows_sift_down(sr, i);
+  }
+}
+
+bool sorted_rows_next(SortedRows* sr, Row* row) {
+  if (sr->num_runs == 0) {
+    if (sr->next == sr->num_rows) {
+      return false;
+    }
+    *row = sr->rows[sr->next++].row;
+    return true;
+  }
+  if (sr->heap_size == 0) {
+    return false;
+  }
+  uint32_t r = sr->heap[0];
+  *row = sr->heads[r].row;
+  if (fread(&sr->heads[r], sizeof(ImportRow), 1, sr->runs[r]) != 1) {
+    sr->heap[0] = sr->heap[--sr->heap_size];
+  }
+  sorted_rows_sift_down(sr, 0);
+  return true;
+}
+
+void sorted_rows_spill(SortedRows* sr) {
+  qsort(sr->rows, sr->num_rows, sizeof(ImportRow), compare_import_rows);
+  FILE* run = tmpfile();
+  if (run == NULL || fwrite(sr->rows, sizeof(ImportRow), sr->num_rows, run) != sr->num_rows) {
+    db_fail("Error writing sort run: %d", errno);
+  }
+  sr->runs = realloc(sr->runs, (sr->num_runs + 1) * sizeof(FILE*));
+  sr->runs[sr->num_runs++] = run;
+  sr->num_rows = 0;
+}
+
+// Splits a csv line into at most `max_fields` fields in place, quoted
+// ones as RFC 4180 has it: in double quotes, a quote in them doubled.
+// Returns the number of fields, or `max_fields` + 1 if there are more or
+// a quote is not closed.
+uint32_t import_split_csv(char* line, char** fields, uint32_t max_fields) {
+  uint32_t count = 0;
+  char* src = line;
+  while (true) {
+    if (count == max_fields) {
+      return max_fields + 1;
+    }
+    char* dest = src;
+    fields[count++] = dest;
+    if (*src == '"') {
+      src++;
+      while (!(src[0] == '"' && src[1] != '"')) {
+	if (*src == 0) {
+	  return max_fields + 1;
+	}
+	if (*src == '"') {
+	  src++;  // the first of a doubled quote
+	}
+	*dest++ = *src++;
+      }
+      src++;
+      if (*src != ',' && *src != 0) {
+	return max_fields + 1;
+      }
+    } else {
+      while (*src != ',' && *src != 0) {
+	*dest++ = *src++;
+      }
+    }
+    char end = *src;
+    *dest = 0;
+    if (end == 0) {
+      return count;
+    }
+    src++;
+  }
+}
+
+// Splits a tsv line like `import_split_csv`, undoing the escapes a tab,
+// a line break or a backslash in a field is written with: `\t`, `\n`,
+// `\r` and `\\`.
+uint32_t import_split_tsv(char* line, char** fields, uint32_t max_fields) {
+  uint32_t count = 0;
+  char* src = line;
+  while (true) {
+    if (count == max_fields) {
+      return max_fields + 1;
+    }
+    char* dest = src;
+    fields[count++] = dest;
+    while (*src != '\t' && *src != 0) {
+      if (src[0] == '\\' && src[1] != 0 && strchr("tnr\\", src[1]) != NULL) {
+	*dest++ = src[1] == 't' ? '\t' : src[1] == 'n' ? '\n' : src[1] == 'r' ? '\r' : '\\';
+	src += 2;
+      } else {
+	*dest++ = *src++;
+      }
+    }
+    char end = *src;
+    *dest = 0;
+    if (end == 0) {
+      return count;
+    }
+    src++;
+  }
+}
+
+// whether a csv line ends inside a quoted field, which goes on on the
+// next line: quotes in a field are doubled, so an odd count is open
+bool import_quote_open(const char* line) {
+  uint32_t quotes = 0;
+  for (; *line != 0; line++) {
+    quotes += *line == '"';
+  }
+  return quotes % 2 == 1;
+}
+
+// Reads and validates every line, returns false if the file can't be read.
+bool sorted_rows_load(SortedRows* sr, const char* filename, uint32_t* num_skipped) {
+  FILE* input = fopen(filename, "r");
+  if (input == NULL) {
+    return false;
+  }
+  sr->rows = malloc(IMPORT_RUN_ROWS * sizeof(ImportRow));
+  sr->num_rows = 0;
+  sr->runs = NULL;
+  sr->num_runs = 0;
+
+  char* line = NULL;
+  size_t line_capacity = 0;
+  char* more = NULL;  // the next line of a quoted field that spans lines
+  size_t more_capacity = 0;
+  ssize_t line_length;
+  uint64_t line_num = 0;
+  while ((line_length = getline(&line, &line_capacity, input)) != -1) {
+    line_num += 1;
+    // the id is digits, the separator follows it: tabs or commas
+    char separator = line[strspn(line, "0123456789")];
+    while (separator == ',' && import_quote_open(line)) {
+      ssize_t more_length = getline(&more, &more_capacity, input);
+      if (more_length == -1) {
+	break;
+      }
+      if ((size_t) (line_length + more_length + 1) > line_capacity) {
+	line_capacity = line_length + more_length + 1;
+	line = realloc(line, line_capacity);
+      }
+      memcpy(line + line_length, more, more_length + 1);
+      line_length += more_length;
+    }
+    while (line_length > 0 && (line[line_length - 1] == '\n' || line[line_length - 1] == '\r')) {
+      line[--line_length] = 0;
+    }
+    char* fields[3];
+    uint32_t num_fields = 0;  // e.g. a header line
+    if (separator == ',') {
+      num_fields = import_split_csv(line, fields, 3);
+    } else if (separator == '\t') {
+      num_fields = import_split_tsv(line, fields, 3);
+    }
+    if (sr->num_rows == IMPORT_RUN_ROWS) {
+      sorted_rows_spill(sr);
+    }
+    ImportRow* import_row = &sr->rows[sr->num_rows];
+    if (num_fields != 3 || fields[0][0] == 0
+	|| prepare_row(fields[0], fields[1], fields[2], &import_row->row) != PREPARE_SUCCESS) {
+      *num_skipped += 1;
+      continue;
+    }
+    import_row->line_num = line_num;
+    sr->num_rows += 1;
+  }
+  free(line);
+  free(more);
+  fclose(input);
+
+  if (sr->num_runs > 0) {
+    if (sr->num_rows > 0) {
+      sorted_rows_spill(sr);
+    }
+    free(sr->rows);
+    sr->rows = NULL;
+    sr->heads = malloc(sr->num_runs * sizeof(ImportRow));
+    sr->heap = malloc(sr->num_runs * sizeof(uint32_t));
+  } else {
+    qsort(sr->rows, sr->num_rows, sizeof(ImportRow), compare_import_rows);
+  }
+  sorted_rows_rewind(sr);
+  return true;
+}
+
+void sorted_rows_close(SortedRows* sr) {
+  for (uint32_t r = 0; r < sr->num_runs; r++) {
+    fclose(sr->runs[r]);
+  }
+  if (sr->num_runs > 0) {
+    free(sr->runs);
+    free(sr->heads);
+    free(sr->heap);
+  }
+  free(sr->rows);
+}
+
+// next row with an id different from the previous one
+bool sorted_rows_next_distinct(SortedRows* sr, Row* row, bool* have_previous,
+			       uint32_t* previous_id, uint32_t* num_skipped) {
+  while (sorted_rows_next(sr, row)) {
+    if (*have_previous && row->id == *previous_id) {
+      *num_skipped += 1;
+      continue;
+    }
+    *have_previous = true;
+    *previous_id = row->id;
+    return true;
+  }
+  return false;
+}
+
+// collects built pages and writes them in runs of consecutive page numbers
+struct PageWriter_t {
+  Pager* pager;
+  void* buffer;
+  uint32_t first_page_num;
+  uint32_t num_pages;
+};
+typedef struct PageWriter_t PageWriter;
+
+void page_writer_flush(PageWriter* w) {
+  if (w->num_pages == 0) {
+    return;
+  }
+  uint32_t page_size = w->pager->page_size;
+  ssize_t size = (ssize_t) w->num_pages * page_size;
+  if (pwrite(w->pager->file_desc, w->buffer, size, (off_t) w->first_page_num * page_size) != size) {
+    db_fail("Error writing: %d", errno);
+  }
+  stat_add(STAT_PAGES_WRITTEN, w->num_pages);
+  w->num_pages = 0;
+}
+
+void page_writer_sync(PageWriter* w) {
+  if (fsync(w->pager->file_desc) == -1) {
+    db_fail("Error syncing db file: %d", errno);
+  }
+}
+
+// returns a zeroed buffer for `page_num`, pages must come in order
+void* page_writer_page(PageWriter* w, uint32_t page_num) {
+  if (w->num_pages == IMPORT_WRITE_BATCH
+      || (w->num_pages > 0 && page_num != w->first_page_num + w->num_pages)) {
+    page_writer_flush(w);
+  }
+  if (w->num_pages == 0) {
+    w->first_page_num = page_num;
+  }
+  void* page = w->buffer + (size_t) w->num_pages * w->pager->page_size;
+  w->num_pages += 1;
+  memset(page, 0, w->pager->page_size);
+  return page;
+}
+
+// `count` items split into `groups` as evenly as possible, returns the
+// size of group `i`
+uint32_t even_share(uint32_t count, uint32_t groups, uint32_t i) {
+  return count / groups + (i < count % groups ? 1 : 0);
+}
+
+// Builds the tree for `num_rows` distinct sorted rows taking `num_bytes`
+// in leaves, slots included. Leaves take the pages after the root, each
+// internal level follows the one below, the root is written last.
+// Returns the first page past the tree.
+uint32_t bulk_build(Table* t, SortedRows* sr, uint32_t num_rows, uint64_t num_bytes,
+		    uint32_t fill_factor) {
+  // leaves get an even share of the bytes, which leaves room for one more
+  // row of any size on top of their fill
+  const uint32_t max_cell_size = ROW_MAX_SIZE + LEAF_NODE_SLOT_SIZE;
+  uint32_t bytes_per_leaf = leaf_node_space_for_cells() * fill_factor / 100;
+  if (bytes_per_leaf > leaf_node_space_for_cells() - max_cell_size) {
+    bytes_per_leaf = leaf_node_space_for_cells() - max_cell_size;
+  }
+  if (bytes_per_leaf < 2 * max_cell_size) {
+    bytes_per_leaf = 2 * max_cell_size;
+  }
+  uint32_t children_per_node = (internal_node_max_cells() + 1) * fill_factor / 100;
+  if (children_per_node < 3) {
+    children_per_node = 3;  // keeps every node at two children or more
+  }
+
+  // plan the number of nodes on each level, leaves first
+  uint32_t level_sizes[32];
+  uint32_t num_levels = 1;
+  level_sizes[0] = (num_bytes + bytes_per_leaf - 1) / bytes_per_leaf;
+  while (level_sizes[num_levels - 1] > 1) {
+    uint32_t below = level_sizes[num_levels - 1];
+    level_sizes[num_levels++] = (below + children_per_node - 1) / children_per_node;
+  }
+  uint32_t level_starts[32];
+  uint32_t next_page_num = t->root_page_num + 1;
+  for (uint32_t level = 0; level < num_levels; level++) {
+    bool is_root_level = level == num_levels - 1;
+    level_starts[level] = is_root_level ? t->root_page_num : next_page_num;
+    if (!is_root_level) {
+      next_page_num += level_sizes[level];
+    }
+  }
+
+  PageWriter w = { t->pager, page_buffer_alloc(t->pager->page_size, IMPORT_WRITE_BATCH),
+		   0, 0 };
+  // max key and rows of each node of the level last built
+  uint32_t* max_keys = malloc(level_sizes[0] * sizeof(uint32_t));
+  uint32_t* row_counts = calloc(level_sizes[0], sizeof(uint32_t));
+  bool have_previous = false;
+  uint32_t previous_id = 0;
+
+  // leaves, a row goes to the leaf its first byte falls in when the bytes
+  // are split evenly, `parent_index` walks the groups of the level above
+  uint32_t parent_index = 0;
+  uint32_t left_in_parent = num_levels > 1 ? even_share(level_sizes[0], level_sizes[1], 0) : 0;
+  uint64_t bytes_before = 0;
+  void* leaf = NULL;
+  uint32_t leaf_index = 0;
+  Row row;
+  uint32_t num_duplicates = 0;  // counted before the build
+  for (uint32_t n = 0; n < num_rows; n++) {
+    sorted_rows_next_distinct(sr, &row, &have_previous, &previous_id, &num_duplicates);
+    uint32_t i = bytes_before * level_sizes[0] / num_bytes;
+    if (leaf == NULL || i != leaf_index) {
+      leaf_index = i;
+      uint32_t page_num = level_starts[0] + i;
+      leaf = page_writer_page(&w, page_num);
+      initialize_leaf_node(leaf);
+      *leaf_node_next_leaf(leaf) = i + 1 < level_sizes[0] ? page_num + 1 : 0;
+      if (num_levels == 1) {
+	set_node_root(leaf, true);
+      } else {
+	*node_parent(leaf) = level_starts[1] + parent_index;
+	if (--left_in_parent == 0 && ++parent_index < level_sizes[1]) {
+	  left_in_parent = even_share(level_sizes[0], level_sizes[1], parent_index);
+	}
+      }
+    }
+    uint32_t size = serialized_row_size(&row);
+    serialize_row(&row, leaf_node_insert_cell(leaf, *leaf_node_num_cells(leaf), row.id, size));
+    bytes_before += size + LEAF_NODE_SLOT_SIZE;
+    max_keys[i] = row.id;
+    row_counts[i] += 1;
+  }
+
+  // internal levels, each node takes the next group of nodes below it
+  for (uint32_t level = 1; level < num_levels; level++) {
+    uint32_t below = level_sizes[level - 1];
+    uint32_t child_index = 0;
+    bool is_root_level = level == num_levels - 1;
+    parent_index = 0;
+    left_in_parent = is_root_level ? 0 : even_share(level_sizes[level], level_sizes[level + 1], 0);
+    for (uint32_t i = 0; i < level_sizes[level]; i++) {
+      uint32_t page_num = level_starts[level] + i;
+      if (is_root_level) {
+	// the old root stays in place until the rest of the tree is durable
+	page_writer_flush(&w);
+	page_writer_sync(&w);
+      }
+      void* node = page_writer_page(&w, page_num);
+      initialize_internal_node(node);
+      uint32_t num_children = even_share(below, level_sizes[level], i);
+      *internal_node_num_keys(node) = num_children - 1;
+      uint32_t num_rows_under = 0;
+      for (uint32_t c = 0; c < num_children - 1; c++) {
+	*internal_node_cell(node, c) = level_starts[level - 1] + child_index;
+	*internal_node_cell_count(node, c) = row_counts[child_index];
+	num_rows_under += row_counts[child_index];
+	*internal_node_key(node, c) = max_keys[child_index++];
+      }
+      *internal_node_right_child(node) = level_starts[level - 1] + child_index;
+      *internal_node_right_count(node) = row_counts[child_index];
+      num_rows_under += row_counts[child_index];
+      // the level below is done with
+      max_keys[i] = max_keys[child_index++];
+      row_counts[i] = num_rows_under;
+      if (is_root_level) {
+	set_node_root(node, true);
+      } else {
+	*node_parent(node) = level_starts[level + 1] + parent_index;
+	if (--left_in_parent == 0 && ++parent_index < level_sizes[level + 1]) {
+	  left_in_parent = even_share(level_sizes[level], level_sizes[level + 1], parent_index);
+	}
+      }
+    }
+  }
+  page_writer_flush(&w);
+  page_writer_sync(&w);
+  free(w.buffer);
+  free(max_keys);
+  free(row_counts);
+  return next_page_num;
+}
+
+bool table_is_empty(Table* t) {
+  void* root = get_page(t->pager, t->root_page_num);
+  bool empty = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+  pager_unpin(t->pager, t->root_page_num);
+  return empty;
+}
+
+// Returns false if `filename` can't be read. Must not be called inside
+// an open transaction.
+bool table_import(Table* t, const char* filename, uint32_t fill_factor, ImportResult* result) {
+  t->max_key_valid = false;
+  result->num_rows = 0;
+  result->num_skipped = 0;
+  SortedRows sr;
+  if (!sorted_rows_load(&sr, filename, &result->num_skipped)) {
+    return false;
+  }
+
+  bool have_previous = false;
+  uint32_t previous_id = 0;
+  Row row;
+  if (table_is_empty(t)) {
+    // count the distinct rows first, the build plans its levels up front
+    uint32_t num_rows = 0;
+    uint64_t num_bytes = 0;
+    uint32_t num_duplicates = 0;
+    while (sorted_rows_next_distinct(&sr, &row, &have_previous, &previous_id, &num_duplicates)) {
+      num_rows += 1;
+      num_bytes += serialized_row_size(&row) + LEAF_NODE_SLOT_SIZE;
+    }
+    if (num_rows > 0) {
+      sorted_rows_rewind(&sr);
+      have_previous = false;
+      Pager* pager = t->pager;
+      // every page after the root is free in an empty table once its
+      // indexes are dropped, to be built again after the table. The build
+      // takes the pages in order, so the freelist is emptied first.
+      uint32_t old_num_pages = pager->num_pages;
+      bool indexed[NUM_TEXT_COLUMNS];
+      for (Column column = 0; column < NUM_TEXT_COLUMNS; column++) {
+	indexed[column] = t->index_root_page_nums[column] != 0;
+	index_set_root(t, column, 0);
+      }
+      void* header = get_page(pager, HEADER_PAGE_NUM);
+      pager_mark_dirty(pager, HEADER_PAGE_NUM);
+      *header_freelist_trunk(header) = 0;
+      *header_freelist_count(header) = 0;
+      pager_unpin(pager, HEADER_PAGE_NUM);
+      pager_commit(pager);
+      // the tree is written around the cache, which must not hold
+      // anything newer than the file
+      pager_checkpoint(pager);
+      pager_flush_dirty(pager);
+
+      uint32_t end_page_num = bulk_build(t, &sr, num_rows, num_bytes, fill_factor);
+      pager_reset(pager, end_page_num > old_num_pages ? end_page_num : old_num_pages);
+      for (uint32_t page_num = end_page_num; page_num < old_num_pages; page_num++) {
+	pager_free_page(pager, page_num);
+      }
+      for (Column column = 0; column < NUM_TEXT_COLUMNS; column++) {
+	if (indexed[column]) {
+	  index_create(t, column);
+	}
+      }
+      pager_commit(pager);
+    }
+    result->num_rows = num_rows;
+    result->num_skipped += num_duplicates;
+  } else {
+    // regular inserts, in key order they at least touch each leaf once
+    while (sorted_rows_next_distinct(&sr, &row, &have_previous, &previous_id, &result->num_skipped)) {
+      if (table_insert(t, &row) == EXECUTE_DUPLICATE_KEY) {
+	result->num_skipped += 1;
+      } else if (++result->num_rows % IMPORT_COMMIT_ROWS == 0) {
+	pager_commit(t->pager);
+      }
+    }
+    pager_commit(t->pager);
+  }
+  sorted_rows_close(&sr);
+  return true;
+}
+
+void indent(uint32_t level) {
+  for (uint32_t i = 0; i < level; i++) {
+    printf(" ");
+  }
+}
+
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indent_level) {
+  void* node = get_page(pager, page_num);
+  uint32_t num_keys, child;
+  switch (get_node_type(node)) {
+  case NODE_LEAF:
+    num_keys = *leaf_node_num_cells(node);
+    indent(indent_level);
+    printf("- leaf (size %d)\n", num_keys);
+    for (uint32_t i = 0; i < num_keys; i++) {
+      indent(indent_level + 1);
+      printf("- %d\n", *leaf_node_key(node, i));
+    }
+    break;
+  case NODE_INTERNAL:
+    num_keys = *internal_node_num_keys(node);
+    indent(indent_level);
+    printf("- internal (size %d)\n", num_keys);
+    for (uint32_t i = 0; i < num_keys; i++) {
+      child = *internal_node_child(node, i);
+      print_tree(pager, child, indent_level + 1);
+
+      indent(indent_level + 1);
+      printf("- key %d\n", *internal_node_key(node, i));
+    }
+    child = *internal_node_right_child(node);
+    print_tree(pager, child, indent_level + 1);
+    break;
+  default:  // index nodes, not part of the table's tree
+    break;
+  }
+  pager_unpin(pager, page_num);
+}
+
+// PUBLIC API, see db.h
+
+struct Db_t {
+  Table* table;
+  pthread_rwlock_t tree_lock;  // see `db_lock`
+  pthread_t writer;  // holder of the writer lock, 0 if none
+  bool failed;  // a call unwound, only `db_close` is allowed
+  uint64_t stats_base[NUM_STATS];  // counts at open or the last reset, see `db_stats`
+};
+
+// selects this thread is in the middle of, it can't write until they
+// stop as it would wait for their latches
+static __thread uint32_t num_selecting = 0;
+// tree locks this thread holds, released when a call unwinds
+static __thread uint32_t tree_lock_depth = 0;
+
+// A statement parsed once and executed many times, with `?` in place of
+// the values that change between executions.
+struct DbStatement_t {
+  Db* db;
+  Statement statement;  // literals parsed, bound values written in place
+  uint32_t id_low, id_high;  // range of the literal conditions alone
+  Params params;
+
+  // a select in progress
+  Cursor* cursor;
+  uint32_t num_rows;
+  void* stored_row;  // in the page the cursor pins
+  Row row;  // `stored_row` deserialized, on demand
+  bool row_loaded;
+  bool done;
+
+  // the one row of an aggregate
+  uint64_t value;
+  bool value_is_null;  // `min` or `max` of no rows
+  PageTrace trace;  // of an `explain`, since the last reset
+  Arena arena;  // for its cursors, see ARENAS
+};
+
+// the page size node functions work with while a call is on `db`
+uint32_t db_page_size(Db* db) {
+  return db != NULL ? db->table->pager->page_size : node_page_size;
+}
+
+// Every public call that can fail deep inside the engine starts with
+// DB_GUARD, which makes `db_fail` unwind to it, and leaves through
+// DB_UNGUARD. Calls nest, each restores the jump target and the node
+// page size of its caller.
+#define DB_GUARD(db)							\
+  jmp_buf guard_jump;							\
+  jmp_buf* guard_outer = fail_jump;					\
+  uint32_t guard_page_size = node_page_size;				\
+  if (setjmp(guard_jump) != 0) {					\
+    fail_jump = guard_outer;						\
+    node_page_size = guard_page_size;					\
+    return db_unwound(db);						\
+  }									\
+  fail_jump = &guard_jump;						\
+  node_page_size = db_page_size(db)
+
+#define DB_UNGUARD() (fail_jump = guard_outer, node_page_size = guard_page_size)
+
+// Threads may share a handle, how a statement locks depends on what it
+// does:
+//   LOCK_MODE_READ       select: the tree shared, from its first row
+//                        until it stops, and latches on the pages it reads
+//   LOCK_MODE_WRITE      insert: the writer lock and the tree shared,
+//                        latches on the pages it changes, see
+//                        `table_find_latched`
+//   LOCK_MODE_EXCLUSIVE  delete, `.import`, `create index`, an insert into
+//                        a mapped file or a table with an index: the
+//                        writer lock and the tree to itself
+//   LOCK_MODE_WRITER     begin, commit: the writer lock alone
+// The writer lock serializes writers and is kept from `begin` until
+// `commit`, readers never wait for it.
+enum LockMode_t {
+		 LOCK_MODE_READ,
+		 LOCK_MODE_WRITE,
+		 LOCK_MODE_EXCLUSIVE,
+		 LOCK_MODE_WRITER
+};
+typedef enum LockMode_t LockMode;
+
+bool db_holds_writer(Db* db) {
+  return pthread_equal(__atomic_load_n(&db->writer, __ATOMIC_RELAXED), pthread_self());
+}
+
+// Returns the mode it locked in, which `db_unlock` takes: only a writer
+// creates indexes, so whether an insert has to have the tree to itself
+// is known once it holds the writer lock.
+LockMode db_lock(Db* db, LockMode mode) {
+  if (mode != LOCK_MODE_READ && !db_holds_writer(db)) {
+    pager_lock(db->table->pager);
+    __atomic_store_n(&db->writer, pthread_self(), __ATOMIC_RELAXED);
+  }
+  if (mode == LOCK_MODE_WRITE && table_has_index(db->table)) {
+    mode = LOCK_MODE_EXCLUSIVE;
+  }
+  if (mode == LOCK_MODE_EXCLUSIVE) {
+    pthread_rwlock_wrlock(&db->tree_lock);
+    tree_lock_depth += 1;
+  } else if (mode != LOCK_MODE_WRITER) {
+    pthread_rwlock_rdlock(&db->tree_lock);
+    tree_lock_depth += 1;
+  }
+  return mode;
+}
+
+void db_unlock_writer(Db* db) {
+  __atomic_store_n(&db->writer, (pthread_t) 0, __ATOMIC_RELAXED);
+  pager_unlock(db->table->pager);
+}
+
+// the writer lock stays with a transaction that is still open
+void db_unlock(Db* db, LockMode mode) {
+  if (mode != LOCK_MODE_WRITER) {
+    tree_lock_depth -= 1;
+    pthread_rwlock_unlock(&db->tree_lock);
+  }
+  if (mode != LOCK_MODE_READ && !db->table->in_transaction) {
+    db_unlock_writer(db);
+  }
+}
+
+// Lets go of every lock the failed call held, so that other threads
+// don't wait forever. Latches are not tracked, a failed handle is only
+// good for closing.
+DbResult db_unwound(Db* db) {
+  pager_frames_unwind();
+  page_trace = NULL;
+  statement_arena = NULL;
+  if (db != NULL) {
+    while (tree_lock_depth > 0) {
+      tree_lock_depth -= 1;
+      pthread_rwlock_unlock(&db->tree_lock);
+    }
+    if (db_holds_writer(db)) {
+      db_unlock_writer(db);
+    }
+    db->failed = true;
+  }
+  return DB_ERROR;
+}
+
+const char* db_error_message() {
+  return fail_message;
+}
+
+DbResult db_prepare_result(PrepareResult result) {
+  switch (result) {
+  case (PREPARE_SUCCESS):
+    return DB_OK;
+  case (PREPARE_UNRECOGNIZED_STATEMENT):
+    return DB_UNRECOGNIZED_STATEMENT;
+  case (PREPARE_SYNTAX_ERROR):
+    return DB_SYNTAX_ERROR;
+  case (PREPARE_STRING_TOO_LONG):
+    return DB_STRING_TOO_LONG;
+  case (PREPARE_NEGATIVE_ID):
+    return DB_NEGATIVE_ID;
+  }
+  return DB_ERROR;
+}
+
+DbResult db_execute_result(ExecuteResult result) {
+  switch (result) {
+  case (EXECUTE_SUCCESS):
+    return DB_DONE;
+  case (EXECUTE_TABLE_FULL):
+    return DB_TABLE_FULL;
+  case (EXECUTE_DUPLICATE_KEY):
+    return DB_DUPLICATE_KEY;
+  case (EXECUTE_TRANSACTION_OPEN):
+    return DB_TRANSACTION_OPEN;
+  case (EXECUTE_NO_TRANSACTION):
+    return DB_NO_TRANSACTION;
+  }
+  return DB_ERROR;
+}
+
+void db_default_options(DbOptions* options) {
+  options->cache_size = DEFAULT_CACHE_SIZE;
+  options->mmap = false;
+  options->wal = true;
+  options->fill_factor = DEFAULT_FILL_FACTOR;
+  options->writeback_ms = 0;
+  options->writeback_pages = 0;
+  options->scan_threads = 0;
+  options->read_ahead_pages = DEFAULT_READ_AHEAD_PAGES;
+  options->direct_io = false;
+  options->huge_pages = false;
+  options->page_size = DEFAULT_PAGE_SIZE;
+}
+
+DbResult db_open(const char* filename, const DbOptions* options, Db** db) {
+  DbOptions defaults;
+  if (options == NULL) {
+    db_default_options(&defaults);
+    options = &defaults;
+  }
+  *db = NULL;
+  if (options->fill_factor < 1 || options->fill_factor > 100) {
+    return DB_MISUSE;  // `bulk_build` would overfill the nodes
+  }
+  DB_GUARD(NULL);
+  key_search_init();
+  Table* t = table_open(filename, options->cache_size,
+			options->mmap ? PAGER_MMAP : PAGER_BUFFERED, options->wal,
+			options->direct_io, options->huge_pages, options->page_size);
+  t->fill_factor = options->fill_factor;
+  if (options->writeback_ms > 0 || options->writeback_pages > 0) {
+    uint32_t threshold = options->writeback_pages > 0
+      ? options->writeback_pages
+      : DEFAULT_WRITEBACK_THRESHOLD;
+    pager_start_writeback(t->pager, options->writeback_ms, threshold);
+  }
+  scan_pool_start(t, options->scan_threads);
+  pager_start_read_ahead(t->pager, options->read_ahead_pages);
+  DB_UNGUARD();
+  *db = malloc(sizeof(Db));
+  (*db)->table = t;
+  pthread_rwlock_init(&(*db)->tree_lock, NULL);
+  (*db)->writer = (pthread_t) 0;
+  (*db)->failed = false;
+  db_reset_stats(*db);
+  return DB_OK;
+}
+
+// Statements should be finalized first. After a failure the file and
+// its log are left for the next open to recover.
+DbResult db_close(Db* db) {
+  if (db->failed) {
+    free(db);
+    return DB_ERROR;
+  }
+  if (db_holds_writer(db)) {
+    db_unlock_writer(db);  // the open transaction is discarded
+  }
+  DB_GUARD(db);
+  table_close(db->table);
+  DB_UNGUARD();
+  pthread_rwlock_destroy(&db->tree_lock);
+  free(db);
+  return DB_OK;
+}
+
+DbResult db_prepare(Db* db, const char* sql, DbStatement** statement) {
+  *statement = NULL;
+  DbStatement* st = malloc(sizeof(DbStatement));
+  st->db = db;
+  st->params.count = 0;
+  st->cursor = NULL;
+  st->num_rows = 0;
+  st->done = false;
+  page_trace_init(&st->trace);
+  arena_init(&st->arena);
+  char* tokens = strdup(sql);
+  PrepareResult result = prepare_sql(tokens, &st->statement, &st->params);
+  free(tokens);
+  if (result != PREPARE_SUCCESS) {
+    pthread_mutex_destroy(&st->trace.lock);
+    free(st);
+    return db_prepare_result(result);
+  }
+  st->id_low = st->statement.id_low;
+  st->id_high = st->statement.id_high;
+  *statement = st;
+  return DB_OK;
+}
+
+uint32_t db_param_count(DbStatement* st) {
+  return st->params.count;
+}
+
+bool db_param_is_text(DbStatement* st, uint32_t index) {
+  ParamTarget target = st->params.items[index].target;
+  return target == PARAM_USERNAME || target == PARAM_EMAIL;
+}
+
+DbResult db_bind_id(DbStatement* st, uint32_t index, uint32_t id) {
+  if (index >= st->params.count || db_param_is_text(st, index)) {
+    return DB_MISUSE;
+  }
+  Param* param = &st->params.items[index];
+  switch (param->target) {
+  case PARAM_ROW_ID:
+    st->statement.row.id = id;
+    break;
+  case PARAM_LIMIT:
+    st->statement.limit = id;
+    break;
+  case PARAM_OFFSET:
+    st->statement.offset = id;
+    break;
+  default:
+    param->id = id;  // conditions are intersected when stepping
+    break;
+  }
+  param->is_bound = true;
+  return DB_OK;
+}
+
+DbResult db_bind_text(DbStatement* st, uint32_t index, const char* text) {
+  if (index >= st->params.count || !db_param_is_text(st, index)) {
+    return DB_MISUSE;
+  }
+  Param* param = &st->params.items[index];
+  if (st->statement.type == STATEMENT_SELECT) {
+    if (set_match_value(&st->statement, param->op, text) != PREPARE_SUCCESS) {
+      return DB_STRING_TOO_LONG;
+    }
+    param->is_bound = true;
+    return DB_OK;
+  }
+  bool is_username = param->target == PARAM_USERNAME;
+  if (strlen(text) > (is_username ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE)) {
+    return DB_STRING_TOO_LONG;
+  }
+  strcpy(is_username ? st->statement.row.username : st->statement.row.email, text);
+  param->is_bound = true;
+  return DB_OK;
+}
+
+// ends a select that is in the middle of its rows, the caller holds the
+// pager lock
+void db_statement_stop(DbStatement* st) {
+  if (st->cursor != NULL) {
+    cursor_close(st->cursor);
+    st->cursor = NULL;
+    num_selecting -= 1;
+    db_unlock(st->db, LOCK_MODE_READ);
+  }
+}
+
+LockMode db_statement_lock_mode(DbStatement* st) {
+  switch (st->statement.type) {
+  case (STATEMENT_SELECT):
+    return LOCK_MODE_READ;
+  case (STATEMENT_INSERT):
+    return st->db->table->pager->mode == PAGER_MMAP ? LOCK_MODE_EXCLUSIVE : LOCK_MODE_WRITE;
+  case (STATEMENT_DELETE):
+  case (STATEMENT_CREATE_INDEX):
+    return LOCK_MODE_EXCLUSIVE;
+  case (STATEMENT_BEGIN):
+  case (STATEMENT_COMMIT):
+    break;
+  }
+  return LOCK_MODE_WRITER;
+}
+
+DbResult db_step(DbStatement* st) {
+  Db* db = st->db;
+  if (db->failed) {
+    return DB_ERROR;
+  }
+  if (st->done) {
+    return DB_DONE;
+  }
+  Statement* s = &st->statement;
+  for (uint32_t i = 0; i < st->params.count; i++) {
+    if (!st->params.items[i].is_bound) {
+      return DB_MISUSE;
+    }
+  }
+  bool is_select = s->type == STATEMENT_SELECT;
+  LockMode mode = db_statement_lock_mode(st);
+  if (num_selecting > 0 && (mode == LOCK_MODE_WRITE || mode == LOCK_MODE_EXCLUSIVE)) {
+    return DB_BUSY;
+  }
+
+  if (!is_select || st->cursor == NULL) {
+    // the literal conditions narrowed by the bound ones
+    s->id_low = st->id_low;
+    s->id_high = st->id_high;
+    for (uint32_t i = 0; i < st->params.count; i++) {
+      Param* param = &st->params.items[i];
+      if (param->target == PARAM_CONDITION) {
+	apply_condition(s, param->op, param->id);
+      }
+    }
+  }
+
+  DB_GUARD(db);
+  page_trace = s->explain ? &st->trace : NULL;
+  statement_arena = &st->arena;
+  DbResult result;
+  if (is_select && s->aggregate != AGGREGATE_NONE) {
+    // the whole scan runs on the first step, its one row is the result
+    if (st->num_rows == 0 && s->limit > 0 && s->offset == 0) {
+      db_lock(db, LOCK_MODE_READ);
+      Aggregation a = table_aggregate(db->table, s);
+      db_unlock(db, LOCK_MODE_READ);
+      st->value_is_null = a.count == 0
+	&& (s->aggregate == AGGREGATE_MIN || s->aggregate == AGGREGATE_MAX);
+      switch (s->aggregate) {
+      case (AGGREGATE_COUNT):
+	st->value = a.count;
+	break;
+      case (AGGREGATE_MIN):
+	st->value = a.min;
+	break;
+      case (AGGREGATE_MAX):
+	st->value = a.max;
+	break;
+      default:
+	st->value = a.sum;
+	break;
+      }
+      st->num_rows = 1;
+      result = DB_ROW;
+    } else {
+      st->done = true;
+      result = DB_DONE;
+    }
+  } else if (is_select) {
+    if (st->cursor == NULL) {
+      db_lock(db, LOCK_MODE_READ);  // until `db_statement_stop`
+      st->cursor = select_start(s, db->table);
+      st->num_rows = 0;
+      num_selecting += 1;
+    }
+    st->stored_row = select_next(s, st->cursor, st->num_rows);
+    st->row_loaded = false;
+    if (st->stored_row != NULL) {
+      st->num_rows += 1;
+      result = DB_ROW;
+    } else {
+      db_statement_stop(st);
+      st->done = true;
+      result = DB_DONE;
+    }
+  } else {
+    mode = db_lock(db, mode);
+    result = db_execute_result(execute_statement(s, db->table));
+    db_unlock(db, mode);
+    st->done = true;
+  }
+  page_trace = NULL;
+  statement_arena = NULL;
+  if (st->cursor == NULL) {
+    arena_rewind(&st->arena);  // every cursor of this step is closed
+  }
+  DB_UNGUARD();
+  return result;
+}
+
+const Row* db_row(DbStatement* st) {
+  if (!st->row_loaded) {
+    deserialize_row(st->stored_row, &st->row);
+    st->row_loaded = true;
+  }
+  return &st->row;
+}
+
+const void* db_row_data(DbStatement* st, uint32_t* size) {
+  uint8_t username_length = *(uint8_t*)(st->stored_row + ID_SIZE);
+  uint8_t email_length =
+    *(uint8_t*)(st->stored_row + ID_SIZE + ROW_LENGTH_SIZE + username_length);
+  *size = ID_SIZE + 2 * ROW_LENGTH_SIZE + username_length + email_length;
+  return st->stored_row;
+}
+
+bool db_is_aggregate(DbStatement* st) {
+  return st->statement.type == STATEMENT_SELECT && st->statement.aggregate != AGGREGATE_NONE;
+}
+
+bool db_value(DbStatement* st, uint64_t* value) {
+  *value = st->value;
+  return !st->value_is_null;
+}
+
+DbResult db_reset(DbStatement* st) {
+  Db* db = st->db;
+  if (st->cursor != NULL && !db->failed) {
+    DB_GUARD(db);
+    db_statement_stop(st);
+    DB_UNGUARD();
+  }
+  st->cursor = NULL;
+  st->num_rows = 0;
+  st->done = false;
+  for (uint32_t i = 0; i < st->params.count; i++) {
+    st->params.items[i].is_bound = false;
+  }
+  page_trace_clear(&st->trace);
+  arena_rewind(&st->arena);
+  return DB_OK;
+}
+
+void db_finalize(DbStatement* st) {
+  db_reset(st);
+  pthread_mutex_destroy(&st->trace.lock);
+  arena_release(&st->arena);
+  free(st);
+}
+
+bool db_trace(DbStatement* st, DbTrace* trace, uint32_t* page_nums, uint32_t capacity) {
+  if (!st->statement.explain) {
+    return false;
+  }
+  PageTrace* t = &st->trace;
+  trace->pages_touched = t->num_pages;
+  trace->pages_read = t->num_read;
+  trace->pages_read_ahead = t->num_read_ahead;
+  uint32_t* all = malloc((t->num_pages + 1) * sizeof(uint32_t));
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < t->capacity; i++) {
+    if (t->pages[i] != 0) {
+      all[count++] = t->pages[i] - 1;
+    }
+  }
+  qsort(all, count, sizeof(uint32_t), compare_page_nums);
+  memcpy(page_nums, all, (count < capacity ? count : capacity) * sizeof(uint32_t));
+  free(all);
+  return true;
+}
+
+bool db_in_transaction(Db* db) {
+  return db_holds_writer(db) && db->table->in_transaction;
+}
+
+DbResult db_import(Db* db, const char* filename, uint32_t* num_rows, uint32_t* num_skipped) {
+  Table* t = db->table;
+  if (db->failed) {
+    return DB_ERROR;
+  }
+  if (db_holds_writer(db) && t->in_transaction) {
+    return DB_TRANSACTION_OPEN;
+  }
+  if (num_selecting > 0) {
+    return DB_BUSY;
+  }
+  DB_GUARD(db);
+  ImportResult result;
+  db_lock(db, LOCK_MODE_EXCLUSIVE);
+  bool imported = table_import(t, filename, t->fill_factor, &result);
+  db_unlock(db, LOCK_MODE_EXCLUSIVE);
+  DB_UNGUARD();
+  if (!imported) {
+    return DB_CANT_OPEN;
+  }
+  *num_rows = result.num_rows;
+  *num_skipped = result.num_skipped;
+  return DB_OK;
+}
+
+// whether `filename` is the db file of `pager` or its log
+bool pager_owns_file(Pager* pager, const char* filename) {
+  struct stat target;
+  if (stat(filename, &target) == -1) {
+    return false;
+  }
+  struct stat own;
+  if (fstat(pager->file_desc, &own) == 0
+      && own.st_dev == target.st_dev && own.st_ino == target.st_ino) {
+    return true;
+  }
+  return pager->wal != NULL && fstat(pager->wal->file_desc, &own) == 0
+    && own.st_dev == target.st_dev && own.st_ino == target.st_ino;
+}
+
+// The snapshot is taken with the writer lock, between two writes, and
+// the tree is held shared while the pages are copied: inserts carry on,
+// what would write pages without `pager_mark_dirty` waits, see BACK END:
+// SNAPSHOTS. Writers take the writer lock before the tree, so it is let
+// go of before the copy and taken again after to drop the snapshot.
+//
+// The copy goes to `<filename>.tmp` and is renamed over `filename` once
+// it is synced, so a backup that fails leaves the target as it was.
+DbResult db_backup(Db* db, const char* filename, uint32_t* num_pages) {
+  Table* t = db->table;
+  if (db->failed) {
+    return DB_ERROR;
+  }
+  if (db_holds_writer(db) && t->in_transaction) {
+    return DB_TRANSACTION_OPEN;
+  }
+  if (num_selecting > 0) {
+    return DB_BUSY;
+  }
+  DB_GUARD(db);
+  db_lock(db, LOCK_MODE_WRITER);
+  if (t->pager->snapshot != NULL) {
+    db_unlock(db, LOCK_MODE_WRITER);
+    DB_UNGUARD();
+    return DB_BUSY;
+  }
+  char* log_filename = malloc(strlen(filename) + 5);
+  sprintf(log_filename, "%s-wal", filename);
+  if (pager_owns_file(t->pager, filename) || pager_owns_file(t->pager, log_filename)) {
+    db_unlock(db, LOCK_MODE_WRITER);
+    DB_UNGUARD();
+    free(log_filename);
+    return DB_MISUSE;
+  }
+  char* temp_filename = malloc(strlen(filename) + 5);
+  sprintf(temp_filename, "%s.tmp", filename);
+  int fd = open(temp_filename, O_WRONLY | O_CREAT | O_EXCL, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    db_unlock(db, LOCK_MODE_WRITER);
+    DB_UNGUARD();
+    free(temp_filename);
+    free(log_filename);
+    return DB_CANT_OPEN;
+  }
+  db_lock(db, LOCK_MODE_READ);
+  Snapshot* snapshot = snapshot_begin(t->pager);
+  db_unlock(db, LOCK_MODE_WRITER);
+  bool written = snapshot_write(t->pager, snapshot, fd);
+  db_unlock(db, LOCK_MODE_READ);
+  db_lock(db, LOCK_MODE_WRITER);
+  *num_pages = snapshot->num_pages;
+  snapshot_end(t->pager);
+  db_unlock(db, LOCK_MODE_WRITER);
+  DB_UNGUARD();
+  if (close(fd) == -1 || !written || rename(temp_filename, filename) == -1) {
+    unlink(temp_filename);
+    free(temp_filename);
+    free(log_filename);
+    return DB_CANT_OPEN;
+  }
+  free(temp_filename);
+  // a log left by an earlier db of that name would be replayed over it
+  unlink(log_filename);
+  free(log_filename);
+  return DB_OK;
+}
+
+DbResult db_stats(Db* db, DbStats* stats) {
+  if (db->failed) {
+    return DB_ERROR;
+  }
+  uint64_t counts[NUM_STATS];
+  pthread_mutex_lock(&stats_lock);
+  stats_sum(counts);
+  for (uint32_t i = 0; i < NUM_STATS; i++) {
+    counts[i] -= db->stats_base[i];
+  }
+  pthread_mutex_unlock(&stats_lock);
+  stats->cache_hits = counts[STAT_CACHE_HITS];
+  stats->cache_misses = counts[STAT_CACHE_MISSES];
+  stats->pages_read = counts[STAT_PAGES_READ];
+  stats->pages_written = counts[STAT_PAGES_WRITTEN];
+  stats->bytes_read = counts[STAT_PAGES_READ] * db->table->pager->page_size;
+  stats->bytes_written = counts[STAT_PAGES_WRITTEN] * db->table->pager->page_size;
+  stats->leaf_splits = counts[STAT_LEAF_SPLITS];
+  stats->internal_splits = counts[STAT_INTERNAL_SPLITS];
+  stats->rows_scanned = counts[STAT_ROWS_SCANNED];
+  stats->cursors = counts[STAT_CURSORS];
+  stats->read_ahead_used = counts[STAT_READ_AHEAD_USED];
+  stats->read_ahead_wasted = counts[STAT_READ_AHEAD_WASTED];
+
+  DB_GUARD(db);
+  db_lock(db, LOCK_MODE_READ);
+  stats->tree_depth = table_depth(db->table);
+  stats->page_size = db->table->pager->page_size;
+  db_unlock(db, LOCK_MODE_READ);
+  DB_UNGUARD();
+  return DB_OK;
+}
+
+void db_reset_stats(Db* db) {
+  pthread_mutex_lock(&stats_lock);
+  stats_sum(db->stats_base);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+DbResult db_print_tree(Db* db) {
+  if (db->failed) {
+    return DB_ERROR;
+  }
+  DB_GUARD(db);
+  // keeps inserts out, the tree is read as a whole
+  LockMode mode = db_lock(db, LOCK_MODE_WRITE);
+  print_tree(db->table->pager, db->table->root_page_num, 0);
+  db_unlock(db, mode);
+  DB_UNGUARD();
+  return DB_OK;
+}
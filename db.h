@@ -0,0 +1,165 @@
+#ifndef DB_H
+#define DB_H
+
+// Embeddable engine of the sqlite clone: one table of (id, username,
+// email) rows in a B-Tree file, queried with the same statements the
+// REPL accepts. Build with `make` and link `libdb.a` or `libdb.so`.
+//
+//   Db* db;
+//   DbStatement* st;
+//   if (db_open("test.db", NULL, &db) != DB_OK) { ... db_error_message() ... }
+//   db_prepare(db, "select where id >= ? limit 10", &st);
+//   db_bind_id(st, 0, 42);
+//   while (db_step(st) == DB_ROW) {
+//     const Row* row = db_row(st);
+//     ...
+//   }
+//   db_finalize(st);
+//   db_close(db);
+//
+// Threads may share a handle, a statement is stepped by one thread at a
+// time. Selects run in parallel, writes take turns and a transaction
+// keeps other threads from writing until its commit. A thread can't
+// write while it is in the middle of a select, that returns DB_BUSY.
+//
+// Failures the engine can't recover from, mostly I/O errors, return
+// DB_ERROR from the call that hit them. The handle then only accepts
+// `db_close`, committed transactions are recovered from the log on the
+// next open.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define COLUMN_USERNAME_SIZE 32
+#define COLUMN_EMAIL_SIZE 255
+
+struct Row_t {
+  uint32_t id;
+  char username[COLUMN_USERNAME_SIZE + 1];
+  char email[COLUMN_EMAIL_SIZE + 1];
+};
+typedef struct Row_t Row;
+
+enum DbResult_t {
+		 DB_OK,
+		 DB_ROW,  // `db_step` produced a row, see `db_row`
+		 DB_DONE,  // `db_step` finished the statement
+		 DB_UNRECOGNIZED_STATEMENT,
+		 DB_SYNTAX_ERROR,
+		 DB_STRING_TOO_LONG,
+		 DB_NEGATIVE_ID,
+		 DB_DUPLICATE_KEY,
+		 DB_TABLE_FULL,
+		 DB_TRANSACTION_OPEN,
+		 DB_NO_TRANSACTION,
+		 DB_BUSY,  // this thread is in the middle of a select, or a backup is running
+		 DB_CANT_OPEN,  // the file to import can't be read, or the backup written
+		 DB_MISUSE,  // unbound parameter, wrong index or type, backup onto the db,
+		             // option out of range
+		 DB_ERROR  // see `db_error_message`
+};
+typedef enum DbResult_t DbResult;
+
+struct DbOptions_t {
+  uint32_t cache_size;  // buffer pool frames
+  bool mmap;  // map the file instead of caching pages
+  bool wal;  // write-ahead log, off means changes are not crash safe
+  uint32_t fill_factor;  // percent of each node `db_import` fills, 1 to 100
+  uint32_t writeback_ms;  // background write-back interval, 0 for none
+  uint32_t writeback_pages;  // dirty pages that wake the writer, 0 for none
+  uint32_t scan_threads;  // threads an aggregate scans with, 0 for one per core
+  uint32_t read_ahead_pages;  // most leaves a scan reads ahead, 0 for none
+  bool direct_io;  // O_DIRECT, bypassing the kernel page cache, not with `mmap`
+  bool huge_pages;  // the page cache in reserved huge pages, if there are
+  uint32_t page_size;  // of a new db file, a power of two from 4096 to 65536
+};
+typedef struct DbOptions_t DbOptions;
+
+typedef struct Db_t Db;
+typedef struct DbStatement_t DbStatement;
+
+struct DbStats_t {
+  uint64_t cache_hits;  // pages found in the page cache
+  uint64_t cache_misses;  // and those that had to be brought in
+  uint64_t pages_read;  // into the page cache, from the db file or the log
+  uint64_t pages_written;  // to the db file or the log
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t leaf_splits;
+  uint64_t internal_splits;
+  uint64_t rows_scanned;  // read by selects and aggregates, matching or not
+  uint64_t cursors;  // opened on the table
+  uint64_t read_ahead_used;  // pages read ahead that were then asked for
+  uint64_t read_ahead_wasted;  // and those evicted before they were
+  uint32_t tree_depth;  // levels of the B-Tree now, not reset
+  uint32_t page_size;  // the db file's
+};
+typedef struct DbStats_t DbStats;
+
+// pages a statement touched, see `db_trace`
+struct DbTrace_t {
+  uint32_t pages_touched;  // distinct pages
+  uint32_t pages_read;  // times one missed the page cache
+  uint32_t pages_read_ahead;  // times one was found read ahead
+};
+typedef struct DbTrace_t DbTrace;
+
+void db_default_options(DbOptions* options);
+
+// `options` may be NULL for the defaults, DB_MISUSE if one is out of range
+DbResult db_open(const char* filename, const DbOptions* options, Db** db);
+// discards a transaction that is still open
+DbResult db_close(Db* db);
+
+// message of the last DB_ERROR on this thread
+const char* db_error_message(void);
+
+// Parses `sql`, with `?` in place of values to bind before stepping.
+DbResult db_prepare(Db* db, const char* sql, DbStatement** statement);
+uint32_t db_param_count(DbStatement* statement);
+bool db_param_is_text(DbStatement* statement, uint32_t index);
+DbResult db_bind_id(DbStatement* statement, uint32_t index, uint32_t id);
+DbResult db_bind_text(DbStatement* statement, uint32_t index, const char* text);
+// DB_ROW for every row a select returns, then DB_DONE or an error
+DbResult db_step(DbStatement* statement);
+// the current row, valid until the next step
+const Row* db_row(DbStatement* statement);
+// The current row as it is stored, without copying it out of the page:
+// the id (4 bytes, native order), the username length (1 byte), the
+// username, the email length (1 byte) and the email. Valid until the
+// next step.
+const void* db_row_data(DbStatement* statement, uint32_t* size);
+// Whether the statement is a `select count(*)`, `min(id)`, `max(id)` or
+// `sum(id)`. Its one row is a value instead of a `Row`, false if it is
+// NULL, the `min` or `max` of no rows.
+bool db_is_aggregate(DbStatement* statement);
+bool db_value(DbStatement* statement, uint64_t* value);
+// ends the current execution and unbinds every parameter
+DbResult db_reset(DbStatement* statement);
+void db_finalize(DbStatement* statement);
+// For a statement prepared as `explain <statement>`: the pages it
+// touched since it was prepared or reset, up to `capacity` of their
+// numbers go to `page_nums` in ascending order. False for any other.
+bool db_trace(DbStatement* statement, DbTrace* trace, uint32_t* page_nums, uint32_t capacity);
+
+// whether this thread has a transaction open on the handle
+bool db_in_transaction(Db* db);
+
+// bulk loads `id,username,email` lines, see `.import`
+DbResult db_import(Db* db, const char* filename, uint32_t* num_rows, uint32_t* num_skipped);
+// Copies the db as it is now to `filename`, while other threads keep
+// inserting, see `.backup`. `num_pages` is the size of the copy. Deletes,
+// `.import`, `create index` and inserts that take the whole tree, into a
+// mapped file or a table with an index, wait until the copy is done.
+// DB_MISUSE if `filename` is this db's file or its log.
+DbResult db_backup(Db* db, const char* filename, uint32_t* num_pages);
+// prints the B-Tree to stdout, see `.btree`
+DbResult db_print_tree(Db* db);
+// What the engine did since `db_open` or `db_reset_stats`. Threads
+// count without locks, for every handle in the process at once, so
+// other handles' work shows up too. A mapped file is paged by the kernel
+// uncounted, neither hits nor misses nor I/O.
+DbResult db_stats(Db* db, DbStats* stats);
+void db_reset_stats(Db* db);
+
+#endif
@@ -0,0 +1,55 @@
+// Client for `a.out --serve <socket>`: sends the statements it reads from
+// stdin one line at a time and prints what the server answers, the rows
+// of a select and then one result line.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    printf("Usage: dbclient <socket>\n");
+    exit(EXIT_FAILURE);
+  }
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+  int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socket_fd == -1
+      || connect(socket_fd, (struct sockaddr*) &address, sizeof(address)) == -1) {
+    printf("Unable to connect to '%s'.\n", argv[1]);
+    exit(EXIT_FAILURE);
+  }
+  FILE* server = fdopen(socket_fd, "r+");
+
+  char* line = NULL;
+  size_t capacity = 0;
+  while (getline(&line, &capacity, stdin) != -1) {
+    if (line[0] == '\n') {
+      continue;
+    }
+    fputs(line, server);
+    if (line[strlen(line) - 1] != '\n') {
+      fputc('\n', server);
+    }
+    fflush(server);
+    // rows are in parentheses, the first other line ends the statement
+    while (getline(&line, &capacity, server) != -1) {
+      fputs(line, stdout);
+      if (line[0] != '(') {
+	break;
+      }
+    }
+    if (feof(server)) {
+      printf("Connection closed.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  free(line);
+  fclose(server);
+  return 0;
+}
@@ -2,9 +2,18 @@
 #include <stdbool.h>  // for using true and false keyword
 #include <stdlib.h>
 #include <stdio.h>
-#include <errno.h>  // some functions set `errno` in case of errors
-#include <unistd.h>  // file I/O
-#include <fcntl.h>  // for using file control options
+#include <stdint.h>
+#include <sys/types.h>  // ssize_t
+#include <fcntl.h>  // open
+#include <unistd.h>  // write
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>  // server workers
+#include <time.h>
+#include <sys/resource.h>  // `.timer`
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "db.h"
 
 // CORE: INTERACE / REPL
 
@@ -47,736 +56,1006 @@ void read_input(InputBuffer* input_buffer) {
   input_buffer->input_length = bytes_read - 1;
 }
 
-// CORE: SQL COMMAND PROCESSOR
-
-#define COLUMN_USERNAME_SIZE 32
-#define COLUMN_EMAIL_SIZE 255
-#define TABLE_MAX_PAGES 100
-#define size_of_attr(type, attr) sizeof(((type*)0)->attr)
-
-struct Row_t {
-  uint32_t id;
-  char username[COLUMN_USERNAME_SIZE + 1];
-  char email[COLUMN_EMAIL_SIZE + 1];
-};
-typedef struct Row_t Row;
-
-const uint32_t ID_SIZE = size_of_attr(Row, id);
-const uint32_t USERNAME_SIZE = size_of_attr(Row, username);
-const uint32_t EMAIL_SIZE = size_of_attr(Row, email);
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
-const uint32_t PAGE_SIZE = 4096;
-const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-
-enum PrepareResult_t {
-		      PREPARE_SUCCESS,
-		      PREPARE_UNRECOGNIZED_STATEMENT,
-		      PREPARE_SYNTAX_ERROR,
-		      PREPARE_STRING_TOO_LONG,
-		      PREPARE_NEGATIVE_ID
-};
-typedef enum PrepareResult_t PrepareResult;
-
-enum StatementType_t {
-		      STATEMENT_INSERT,
-		      STATEMENT_SELECT
-};
-typedef enum StatementType_t StatementType;
 
-struct Statement_t {
-  StatementType type;
-  Row row; // required for insert statement
-};
-typedef struct Statement_t Statement;
-
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* s) {
-  s->type = STATEMENT_INSERT;
-  char* keyword = strtok(input_buffer->buffer, " ");
-  char* id_str = strtok(NULL, " ");
-  char* username = strtok(NULL, " ");
-  char* email = strtok(NULL, " ");
-
-  if (id_str == NULL || username == NULL || email == NULL) {
-    return PREPARE_SYNTAX_ERROR;
-  }
-
-  int id = atoi(id_str);
-  if (id < 0) {
-    return PREPARE_NEGATIVE_ID;
-  }
-  if (strlen(username) > COLUMN_USERNAME_SIZE
-      || strlen(email) > COLUMN_EMAIL_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+// exits on failures the engine can't recover from, like it always did
+DbResult check(DbResult result) {
+  if (result == DB_ERROR) {
+    printf("%s\n", db_error_message());
+    exit(EXIT_FAILURE);
   }
-  s->row.id = id;
-  strcpy(s->row.username, username);
-  strcpy(s->row.email, email);
-  return PREPARE_SUCCESS;
+  return result;
 }
 
-PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* s) {
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-    return prepare_insert(input_buffer, s);
-  }
+// STATEMENT CACHE
 
-  if (strncmp(input_buffer->buffer, "select", 6) == 0) {
-    s->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
-  }
-
-  return PREPARE_UNRECOGNIZED_STATEMENT;
-}
+// Statements with `?` placeholders the REPL has prepared, by their text,
+// the least recently used one makes room for a new one.
 
+#define STATEMENT_CACHE_SIZE 16
 
-// BACK END: PAGER
+struct CachedStatement_t {
+  char* sql;
+  uint32_t hash;  // of `sql`
+  DbStatement* statement;
+  uint64_t last_used;
+};
+typedef struct CachedStatement_t CachedStatement;
 
-struct Pager_t {
-  int file_desc;
-  uint32_t file_length;
-  uint32_t num_pages;
-  void* pages[TABLE_MAX_PAGES];
+struct StatementCache_t {
+  CachedStatement entries[STATEMENT_CACHE_SIZE];
+  uint64_t clock;  // ticks on every lookup
 };
-typedef struct Pager_t Pager;
+typedef struct StatementCache_t StatementCache;
 
-Pager* pager_open(const char* filename) {
-  int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
-  if (fd == -1) {
-    printf("Unable to open file.\n");
-    exit(EXIT_FAILURE);
+uint32_t statement_hash(const char* sql) {
+  uint32_t h = 2166136261u;  // FNV-1a
+  for (const char* c = sql; *c != 0; c++) {
+    h = (h ^ (uint8_t) *c) * 16777619u;
   }
-  off_t file_length = lseek(fd, 0, SEEK_END);
+  return h;
+}
 
-  Pager* pager = malloc(sizeof(Pager));
-  pager->file_desc = fd;
-  pager->file_length = file_length;
-  pager->num_pages = file_length / PAGE_SIZE;
+StatementCache* statement_cache_new() {
+  StatementCache* cache = malloc(sizeof(StatementCache));
+  memset(cache->entries, 0, sizeof(cache->entries));
+  cache->clock = 0;
+  return cache;
+}
 
-  if (file_length % PAGE_SIZE != 0) {
-    printf("Db file is not a whole number of pages. Corrupted file.\n");
-    exit(EXIT_FAILURE);
+// Finds the prepared statement for `sql`, preparing it on a miss.
+DbResult statement_cache_get(StatementCache* cache, Db* db, const char* sql,
+			     DbStatement** statement) {
+  uint32_t hash = statement_hash(sql);
+  uint32_t victim = 0;
+  for (uint32_t i = 0; i < STATEMENT_CACHE_SIZE; i++) {
+    CachedStatement* entry = &cache->entries[i];
+    if (entry->statement != NULL && entry->hash == hash && strcmp(entry->sql, sql) == 0) {
+      entry->last_used = ++cache->clock;
+      *statement = entry->statement;
+      return DB_OK;
+    }
+    CachedStatement* oldest = &cache->entries[victim];
+    if (oldest->statement != NULL
+	&& (entry->statement == NULL || entry->last_used < oldest->last_used)) {
+      victim = i;
+    }
   }
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
+  DbResult result = db_prepare(db, sql, statement);
+  if (result != DB_OK) {
+    return result;
   }
-
-  return pager;
+  CachedStatement* entry = &cache->entries[victim];
+  if (entry->statement != NULL) {
+    db_finalize(entry->statement);
+    free(entry->sql);
+  }
+  entry->sql = strdup(sql);
+  entry->hash = hash;
+  entry->statement = *statement;
+  entry->last_used = ++cache->clock;
+  return DB_OK;
 }
 
-void* get_page(Pager* pager, uint32_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("Tried to fetch page number out of bounds. %d > %d\n",
-	   page_num, TABLE_MAX_PAGES);
-  }
-  if (pager->pages[page_num] == NULL) {
-    // cache miss
-    void* page = malloc(PAGE_SIZE);
-    uint32_t num_pages_in_file = pager->file_length / PAGE_SIZE;
-    if (pager->file_length % PAGE_SIZE) {
-      num_pages_in_file += 1;
+void statement_cache_free(StatementCache* cache) {
+  for (uint32_t i = 0; i < STATEMENT_CACHE_SIZE; i++) {
+    if (cache->entries[i].statement != NULL) {
+      db_finalize(cache->entries[i].statement);
+      free(cache->entries[i].sql);
     }
+  }
+  free(cache);
+}
 
-    if (page_num <= num_pages_in_file) {
-      lseek(pager->file_desc, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_desc, page, PAGE_SIZE);
-      if (bytes_read == -1) {
-	printf("Error reading file: %d\n", errno);
-	exit(EXIT_FAILURE);
+// binds the space separated `values` to the parameters in order
+DbResult bind_values(DbStatement* statement, char* values) {
+  char* save;  // server workers bind at the same time
+  char* token = strtok_r(values, " ", &save);
+  for (uint32_t i = 0; i < db_param_count(statement); i++, token = strtok_r(NULL, " ", &save)) {
+    if (token == NULL) {
+      return DB_SYNTAX_ERROR;
+    }
+    DbResult result;
+    if (db_param_is_text(statement, i)) {
+      result = db_bind_text(statement, i, token);
+    } else {
+      char* end;
+      long id = strtol(token, &end, 10);
+      if (end == token || *end != 0 || id > INT32_MAX) {
+	return DB_SYNTAX_ERROR;
+      }
+      if (id < 0) {
+	return DB_NEGATIVE_ID;
       }
+      result = db_bind_id(statement, i, id);
     }
-    pager->pages[page_num] = page;
-    if (page_num >= pager->num_pages) {
-      pager->num_pages = page_num + 1;
+    if (result != DB_OK) {
+      return result;
     }
   }
-  return pager->pages[page_num];
-
-}
-
-void pager_flush(Pager* pager, uint32_t page_num) {
-  if (pager->pages[page_num] == NULL) {
-    printf("Tried to flush NULL page.\n");
-    exit(EXIT_FAILURE);
-  }
-
-  off_t offset = lseek(pager->file_desc, page_num * PAGE_SIZE, SEEK_SET);
-  if (offset == -1) {
-    printf("Error seeking: %d\n", errno);
-    exit(EXIT_FAILURE);
-  }
-
-  ssize_t bytes_written = write(pager->file_desc, pager->pages[page_num], PAGE_SIZE);
-  if (bytes_written == -1) {
-    printf("Error writing: %d\n", errno);
-    exit(EXIT_FAILURE);
-  }
+  return token == NULL ? DB_OK : DB_SYNTAX_ERROR;
 }
 
-// this will change one recycling free pages is supported
-uint32_t get_unused_page_num(Pager* pager) {
-  return pager->num_pages;
-}
-
-
-// BACK END
-
-// common node header layout
-const uint32_t NODE_TYPE_SIZE = sizeof(uint32_t);
-const uint32_t NODE_TYPE_OFFSET = 0;
-const uint32_t IS_ROOT_SIZE = sizeof(uint32_t);
-const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
-const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
-const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
-const uint32_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
-
-// leaf node header layout
-const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
-  LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE
-  + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE;
-
-
-// leaf node body layout
-const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-
-// split
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT =
-  LEAF_NODE_MAX_CELLS + 1 - LEAF_NODE_LEFT_SPLIT_COUNT;
-
-// internal node header layout
-const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
-  INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
-const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE
-  + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;
-
-// internal node body layout
-const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3; // small number for testing
-
-enum NodeType_t {
-		 NODE_LEAF,
-		 NODE_INTERNAL
+// OUTPUT
+
+// Selected rows are formatted straight from the stored row into a large
+// buffer that is written out in one go, instead of a printf per row.
+// `table` is the "(id, username, email)" the REPL always printed. `csv`
+// quotes a field that holds a separator, quote or line break as RFC 4180
+// has it, `tsv` writes tabs, line breaks and backslashes in a field as
+// `\t`, `\n`, `\r` and `\\`. `.import` undoes both, so exports load back.
+// `binary` writes each stored row as is, after its size as 4 bytes.
+
+enum OutputMode_t {
+		   OUTPUT_TABLE,
+		   OUTPUT_CSV,
+		   OUTPUT_TSV,
+		   OUTPUT_BINARY
 };
-typedef enum NodeType_t NodeType;
+typedef enum OutputMode_t OutputMode;
 
-bool is_node_root(void* node) {
-  uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
-  return (bool) value;
-}
+const char* OUTPUT_MODE_NAMES[] = {"table", "csv", "tsv", "binary"};
 
-void set_node_root(void* node, bool is_root) {
-  uint8_t value = is_root;
-  *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
-}
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+// longest formatted row: the id, two lengths or separators and the text,
+// every character of it escaped and quoted
+#define OUTPUT_ROW_MAX_SIZE (16 + 2 * (2 + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE))
 
-// accessing leaf nodes
-uint32_t* leaf_node_num_cells(void* node) {
-  return node + LEAF_NODE_NUM_CELLS_OFFSET;
+struct Output_t {
+  OutputMode mode;
+  int file_desc;  // stdout unless `--output` names a file, or a client
+  char* buffer;
+  uint32_t length;
+  bool exit_on_error;  // or drop the rest, see `failed`
+  bool failed;  // a write failed, e.g. the client went away
+};
+typedef struct Output_t Output;
+
+Output* output_new(int file_desc, bool exit_on_error) {
+  Output* out = malloc(sizeof(Output));
+  out->mode = OUTPUT_TABLE;
+  out->file_desc = file_desc;
+  out->buffer = malloc(OUTPUT_BUFFER_SIZE);
+  out->length = 0;
+  out->exit_on_error = exit_on_error;
+  out->failed = false;
+  return out;
 }
 
-void* leaf_node_cell(void* node, uint32_t cell_num) {
-  return node + LEAF_NODE_HEADER_SIZE + LEAF_NODE_CELL_SIZE * cell_num;
+Output* output_open(const char* filename) {
+  int file_desc = STDOUT_FILENO;
+  if (filename != NULL) {
+    file_desc = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (file_desc == -1) {
+      printf("Unable to open file '%s'.\n", filename);
+      exit(EXIT_FAILURE);
+    }
+  }
+  return output_new(file_desc, true);
 }
 
-uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num);
+void output_flush(Output* out) {
+  if (out->file_desc == STDOUT_FILENO) {
+    fflush(stdout);  // the prompt goes first
+  }
+  for (uint32_t written = 0; written < out->length && !out->failed;) {
+    ssize_t bytes_written = write(out->file_desc, out->buffer + written, out->length - written);
+    if (bytes_written == -1) {
+      if (out->exit_on_error) {
+	printf("Error writing output.\n");
+	exit(EXIT_FAILURE);
+      }
+      out->failed = true;
+    } else {
+      written += bytes_written;
+    }
+  }
+  out->length = 0;
 }
 
-void* leaf_node_value(void* node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num) + LEAF_NODE_VALUE_OFFSET;
+void output_close(Output* out) {
+  output_flush(out);
+  if (out->file_desc != STDOUT_FILENO && out->exit_on_error) {  // not a client's
+    close(out->file_desc);
+  }
+  free(out->buffer);
+  free(out);
 }
 
-uint32_t* leaf_node_next_leaf(void* node) {
-  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+char* output_uint(char* dest, uint64_t value) {
+  char digits[20];
+  uint32_t count = 0;
+  do {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  while (count > 0) {
+    *dest++ = digits[--count];
+  }
+  return dest;
 }
 
-NodeType get_node_type(void* node) {
-  uint8_t* type = (uint8_t *)(node + NODE_TYPE_OFFSET);
-  return (NodeType)(*type);
+char* output_text(char* dest, const char* text, uint8_t length) {
+  memcpy(dest, text, length);
+  return dest + length;
 }
 
-void set_node_type(void* node, NodeType type) {
-  uint8_t value = type;
-  *((uint8_t *)(node + NODE_TYPE_OFFSET)) = value;
+char* output_csv_field(char* dest, const char* text, uint8_t length) {
+  bool quoted = false;
+  for (uint8_t i = 0; i < length && !quoted; i++) {
+    quoted = text[i] != 0 && strchr(",\"\t\r\n", text[i]) != NULL;
+  }
+  if (!quoted) {
+    return output_text(dest, text, length);
+  }
+  *dest++ = '"';
+  for (uint8_t i = 0; i < length; i++) {
+    if (text[i] == '"') {
+      *dest++ = '"';
+    }
+    *dest++ = text[i];
+  }
+  *dest++ = '"';
+  return dest;
 }
 
-uint32_t* internal_node_num_keys(void* node) {
-  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+char* output_tsv_field(char* dest, const char* text, uint8_t length) {
+  for (uint8_t i = 0; i < length; i++) {
+    char escape = text[i] == '\t' ? 't' : text[i] == '\n' ? 'n' : text[i] == '\r' ? 'r'
+      : text[i] == '\\' ? '\\' : 0;
+    if (escape != 0) {
+      *dest++ = '\\';
+      *dest++ = escape;
+    } else {
+      *dest++ = text[i];
+    }
+  }
+  return dest;
 }
 
-uint32_t* internal_node_right_child(void* node) {
-  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+// the one row of an aggregate, "(NULL)" or an empty line when it is NULL,
+// in binary its 8 bytes or a size of 0
+void output_value(Output* out, DbStatement* statement) {
+  uint64_t value;
+  bool is_null = !db_value(statement, &value);
+  char* dest = out->buffer + out->length;
+  if (out->mode == OUTPUT_BINARY) {
+    uint32_t size = is_null ? 0 : sizeof(value);
+    memcpy(dest, &size, sizeof(size));
+    memcpy(dest + sizeof(size), &value, size);
+    out->length += sizeof(size) + size;
+    return;
+  }
+  if (out->mode == OUTPUT_TABLE) {
+    *dest++ = '(';
+  }
+  if (is_null) {
+    dest = out->mode == OUTPUT_TABLE ? output_text(dest, "NULL", 4) : dest;
+  } else {
+    dest = output_uint(dest, value);
+  }
+  if (out->mode == OUTPUT_TABLE) {
+    *dest++ = ')';
+  }
+  *dest++ = '\n';
+  out->length = dest - out->buffer;
 }
 
-uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
-  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+// a line of text among the rows, e.g. what `explain` and `.timer` report
+void output_line(Output* out, const char* line) {
+  size_t length = strlen(line);
+  if (out->length + length + 1 > OUTPUT_BUFFER_SIZE) {
+    output_flush(out);
+  }
+  memcpy(out->buffer + out->length, line, length);
+  out->buffer[out->length + length] = '\n';
+  out->length += length + 1;
 }
 
-uint32_t* internal_node_key(void* node, uint32_t key_num) {
-  return (void*) internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
-}
+void output_row(Output* out, DbStatement* statement) {
+  if (out->length + OUTPUT_ROW_MAX_SIZE > OUTPUT_BUFFER_SIZE) {
+    output_flush(out);
+  }
+  if (db_is_aggregate(statement)) {
+    output_value(out, statement);
+    return;
+  }
+  uint32_t size;
+  const uint8_t* data = db_row_data(statement, &size);
+  char* dest = out->buffer + out->length;
+  if (out->mode == OUTPUT_BINARY) {
+    memcpy(dest, &size, sizeof(size));
+    memcpy(dest + sizeof(size), data, size);
+    out->length += sizeof(size) + size;
+    return;
+  }
 
-uint32_t* internal_node_child(void* node, uint32_t child_num) {
-  uint32_t num_keys = *internal_node_num_keys(node);
-  if (child_num > num_keys) {
-    printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
-    exit(EXIT_FAILURE);
-  } else if (child_num == num_keys) {
-    return internal_node_right_child(node);
+  uint32_t id;
+  memcpy(&id, data, sizeof(id));
+  uint8_t username_length = data[sizeof(id)];
+  const char* username = (const char*) data + sizeof(id) + 1;
+  uint8_t email_length = data[sizeof(id) + 1 + username_length];
+  const char* email = username + username_length + 1;
+  if (out->mode == OUTPUT_TABLE) {
+    *dest++ = '(';
+    dest = output_uint(dest, id);
+    dest = output_text(dest, ", ", 2);
+    dest = output_text(dest, username, username_length);
+    dest = output_text(dest, ", ", 2);
+    dest = output_text(dest, email, email_length);
+    *dest++ = ')';
+  } else if (out->mode == OUTPUT_CSV) {
+    dest = output_uint(dest, id);
+    *dest++ = ',';
+    dest = output_csv_field(dest, username, username_length);
+    *dest++ = ',';
+    dest = output_csv_field(dest, email, email_length);
   } else {
-    return internal_node_cell(node, child_num);
+    dest = output_uint(dest, id);
+    *dest++ = '\t';
+    dest = output_tsv_field(dest, username, username_length);
+    *dest++ = '\t';
+    dest = output_tsv_field(dest, email, email_length);
   }
+  *dest++ = '\n';
+  out->length = dest - out->buffer;
 }
 
-uint32_t get_node_max_key(void* node) {
-  switch (get_node_type(node)) {
-  case (NODE_LEAF):
-    return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
-  case (NODE_INTERNAL):
-    return *internal_node_key(node, *internal_node_num_keys(node) - 1); // key numbers are 0 indexed
-  }
-}
+// EXPLAIN AND TIMER
 
-uint32_t* node_parent(void* node) {
-  return node + PARENT_POINTER_OFFSET;
-}
+// `explain <statement>` runs the statement and then reports the pages it
+// touched: how many, how often one had to be read and how often one was
+// found read ahead, followed by the first page numbers.
 
-void initialize_leaf_node(void* node) {
-  set_node_type(node, NODE_LEAF);
-  set_node_root(node, false);
-  *leaf_node_num_cells(node) = 0;
-  *leaf_node_next_leaf(node) = 0;
-}
+#define EXPLAIN_MAX_PAGES 32  // page numbers listed
 
-void initialize_internal_node(void* node) {
-  set_node_type(node, NODE_INTERNAL);
-  set_node_root(node, false);
-  *internal_node_num_keys(node) = 0;
+void output_trace(Output* out, DbStatement* statement) {
+  DbTrace trace;
+  uint32_t page_nums[EXPLAIN_MAX_PAGES];
+  if (out->mode == OUTPUT_BINARY || !db_trace(statement, &trace, page_nums, EXPLAIN_MAX_PAGES)) {
+    return;
+  }
+  char line[64 + 11 * EXPLAIN_MAX_PAGES];
+  int length = snprintf(line, sizeof(line), "Pages: %u touched, %u read, %u read ahead:",
+			trace.pages_touched, trace.pages_read, trace.pages_read_ahead);
+  uint32_t count = trace.pages_touched < EXPLAIN_MAX_PAGES ? trace.pages_touched : EXPLAIN_MAX_PAGES;
+  for (uint32_t i = 0; i < count; i++) {
+    length += snprintf(line + length, sizeof(line) - length, " %u", page_nums[i]);
+  }
+  if (count < trace.pages_touched) {
+    snprintf(line + length, sizeof(line) - length, " ...");
+  }
+  output_line(out, line);
 }
 
-struct Table_t {
-  uint32_t root_page_num;
-  Pager* pager;
+// `.timer on` reports how long each statement took like sqlite does, the
+// wall clock time and the CPU time of the process in user and kernel
+// mode, scan and read-ahead threads included.
+struct Timer_t {
+  struct timespec real;
+  struct rusage usage;
 };
-typedef struct Table_t Table;
+typedef struct Timer_t Timer;
 
-void serialize_row(Row* source, void* dest) {
-  memcpy(dest + ID_OFFSET, &(source->id), ID_SIZE);
-  strncpy(dest + USERNAME_OFFSET, source->username, USERNAME_SIZE);
-  strncpy(dest + EMAIL_OFFSET, source->email, EMAIL_SIZE);
+void timer_start(Timer* timer) {
+  clock_gettime(CLOCK_MONOTONIC, &timer->real);
+  getrusage(RUSAGE_SELF, &timer->usage);
 }
 
-void deserialize_row(void* source, Row* dest) {
-  memcpy(&(dest->id), source + ID_OFFSET, ID_SIZE);
-  memcpy(&(dest->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-  memcpy(&(dest->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+double timeval_seconds(struct timeval t) {
+  return t.tv_sec + t.tv_usec / 1e6;
 }
 
-Table* db_open(const char* filename) {
-  Pager* pager = pager_open(filename);
-  Table* t = malloc(sizeof(Table));
-  t->pager = pager;
-  if (pager->num_pages == 0) {
-    void* root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
-    set_node_root(root_node, true);
-  }
-  return t;
+void output_timer(Output* out, Timer* start) {
+  Timer end;
+  timer_start(&end);
+  double real = (end.real.tv_sec - start->real.tv_sec)
+    + (end.real.tv_nsec - start->real.tv_nsec) / 1e9;
+  double user = timeval_seconds(end.usage.ru_utime) - timeval_seconds(start->usage.ru_utime);
+  double sys = timeval_seconds(end.usage.ru_stime) - timeval_seconds(start->usage.ru_stime);
+  char line[128];
+  snprintf(line, sizeof(line), "Run Time: real %.3f user %.6f sys %.6f", real, user, sys);
+  output_line(out, line);
 }
 
-void db_close(Table* t) {
-  Pager* pager = t->pager;
-  for (uint32_t i = 0; i < pager->num_pages; i++) {
-    if (pager->pages[i] == NULL) {
-      continue;
-    }
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
-  }
-
-  int result = close(pager->file_desc);
-  if (result == -1) {
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
-  }
+// CORE: SQL COMMAND PROCESSOR
 
-  // this should not be required
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void* page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
-    }
+void print_result(FILE* stream, DbResult result, const char* sql) {
+  switch (check(result)) {
+  case (DB_DONE):
+    fprintf(stream, "Executed.\n");
+    break;
+  case (DB_UNRECOGNIZED_STATEMENT):
+    fprintf(stream, "Unrecognized keyword at start of '%s'\n", sql);
+    break;
+  case (DB_SYNTAX_ERROR):
+  case (DB_MISUSE):
+    fprintf(stream, "Syntax Error. Could not parse query.\n");
+    break;
+  case (DB_STRING_TOO_LONG):
+    fprintf(stream, "String is too long.\n");
+    break;
+  case (DB_NEGATIVE_ID):
+    fprintf(stream, "ID must be positive.\n");
+    break;
+  case (DB_TABLE_FULL):
+    fprintf(stream, "Error: Table full.\n");
+    break;
+  case (DB_DUPLICATE_KEY):
+    fprintf(stream, "Error: Duplicate key.\n");
+    break;
+  case (DB_TRANSACTION_OPEN):
+    fprintf(stream, "Error: Transaction already open.\n");
+    break;
+  case (DB_NO_TRANSACTION):
+    fprintf(stream, "Error: No transaction is open.\n");
+    break;
+  case (DB_BUSY):
+    fprintf(stream, "Error: Can't write while a select is running.\n");
+    break;
+  default:
+    fprintf(stream, "Error: Unexpected result %d.\n", result);
+    break;
   }
-  free(pager);
-  free(t);
 }
 
-struct Cursor_t {
-  Table* table;
-  uint32_t page_num;
-  uint32_t cell_num;
-  bool end_of_table;
+// What the lines of input run against.
+struct Session_t {
+  Db* db;
+  StatementCache* cache;
+  Output* out;
+  bool single_transaction;  // wrap each script in one transaction
+  bool timer;  // `.timer on`
 };
-typedef struct Cursor_t Cursor;
-
-// binary search
-Cursor* leaf_node_find(Table* t, uint32_t page_num, uint32_t key) {
-  void* node = get_page(t->pager, page_num);
-  Cursor* c = malloc(sizeof(Cursor));
-  c->table = t;
-  c->page_num = page_num;
-
-  uint32_t min_index = 0;
-  uint32_t one_past_max_index = *leaf_node_num_cells(node);
-
-  while (one_past_max_index != min_index) {
-    uint32_t index = (min_index + one_past_max_index) / 2;
-    uint32_t key_at_index = *leaf_node_key(node, index);
-    if (key_at_index == key) {
-      c->cell_num = index;
-      return c;
-    }
-    if (key_at_index > key) {
-      one_past_max_index = index;
-    } else {
-      min_index = index + 1;
-    }
+typedef struct Session_t Session;
+
+// `<statement with ?> using <values>` binds the values to a cached
+// statement, which is only parsed the first time it is seen. Selected
+// rows go to the output buffer, the caller flushes it.
+DbResult run_statement(Session* session, char* sql) {
+  Timer timer;
+  if (session->timer) {
+    timer_start(&timer);
   }
-
-  c->cell_num = min_index;
-  return c;
-}
-
-uint32_t internal_node_find_child(void* node, uint32_t key) {
-  // return index of the child which contains the given key
-  uint32_t num_keys = *internal_node_num_keys(node);
-  // binary search
-  uint32_t min_index = 0;
-  uint32_t max_index = num_keys; // child count is 1 more than keys
-  while (min_index != max_index) {
-    uint32_t index = (min_index + max_index) / 2;
-    uint32_t key_to_right = *internal_node_key(node, index);
-    if (key <= key_to_right) {
-      max_index = index;
-    } else {
-      min_index = index + 1;
+  DbStatement* statement = NULL;
+  DbResult result;
+  char* values = strstr(sql, " using ");
+  bool cached = values != NULL && memchr(sql, '?', values - sql) != NULL;
+  if (cached) {
+    *values = 0;
+    result = statement_cache_get(session->cache, session->db, sql, &statement);
+    if (result == DB_OK) {
+      result = bind_values(statement, values + strlen(" using "));
+    }
+  } else {
+    result = db_prepare(session->db, sql, &statement);
+    if (result == DB_OK && db_param_count(statement) > 0) {
+      result = DB_SYNTAX_ERROR;  // nothing to bind
     }
   }
-  return min_index;
-}
 
-Cursor* internal_node_find(Table* t, uint32_t page_num, uint32_t key) {
-  void* node = get_page(t->pager, page_num);
-  uint32_t child_index = internal_node_find_child(node, key);
-  uint32_t child_page_num = *internal_node_child(node, child_index);
-  void* child = get_page(t->pager, child_page_num);
-  switch (get_node_type(child)) {
-  case NODE_LEAF:
-    return leaf_node_find(t, child_page_num, key);
-  case NODE_INTERNAL:
-    return internal_node_find(t, child_page_num, key);
+  if (result == DB_OK) {
+    while ((result = db_step(statement)) == DB_ROW) {
+      output_row(session->out, statement);
+    }
+    output_trace(session->out, statement);
   }
-}
-
-
-// returns position where key can be inserted, if already present,
-// returns its position
-Cursor* table_find(Table* t, uint32_t key) {
-  void* root_node = get_page(t->pager, t->root_page_num);
-  if (get_node_type(root_node) == NODE_LEAF) {
-    return leaf_node_find(t, t->root_page_num, key);
-  } else {
-    return internal_node_find(t, t->root_page_num, key);
+  if (session->timer && session->out->mode != OUTPUT_BINARY) {
+    output_timer(session->out, &timer);
   }
-}
-
-Cursor* table_start(Table* t) {
-  Cursor* cursor = table_find(t, 0);
-  void* node = get_page(t->pager, cursor->page_num);
-  cursor->end_of_table = (*leaf_node_num_cells(node) == 0);
-  return cursor;
-}
-
-void* cursor_value(Cursor* c) {
-  void* page = get_page(c->table->pager, c->page_num);
-  return leaf_node_value(page, c->cell_num);
-}
-
-void cursor_advance(Cursor* c) {
-  void* node = get_page(c->table->pager, c->page_num);
-  c->cell_num += 1;
-  if (c->cell_num >= (*leaf_node_num_cells(node))) {
-    uint32_t next_page_num = *leaf_node_next_leaf(node);
-    if (next_page_num == 0) {
-      c->end_of_table = true;
+  if (statement != NULL) {
+    if (cached) {
+      db_reset(statement);
     } else {
-      c->page_num = next_page_num;
-      c->cell_num = 0;
+      db_finalize(statement);
     }
   }
+  return result;
 }
 
-void create_new_root(Table* t, uint32_t right_child_page_num) {
-  // old root copied to new page, becomes left child
-  void* root = get_page(t->pager, t->root_page_num);
-  void* right_child = get_page(t->pager, right_child_page_num);
-  uint32_t left_child_page_num = get_unused_page_num(t->pager);
-  void* left_child = get_page(t->pager, left_child_page_num);
-  memcpy(left_child, root, PAGE_SIZE);
-  set_node_root(left_child, false);  // as whole root node is copied
-
-  // root is not internal node
-  initialize_internal_node(root);
-  set_node_root(root, true);
-  *internal_node_num_keys(root) = 1;
-  *internal_node_child(root, 0) = left_child_page_num;
-  *internal_node_key(root, 0) = get_node_max_key(left_child);
-  *internal_node_right_child(root) = right_child_page_num;
-  *node_parent(left_child) = t->root_page_num;
-  *node_parent(right_child) = t->root_page_num;
-}
-
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
-  uint32_t old_child_index = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_index) = new_key;
-}
-
-void internal_node_insert(Table* t, uint32_t parent_page_num, uint32_t child_page_num) {
-  // add a new child-key pair to parent
-  void* parent = get_page(t->pager, parent_page_num);
-  void* child = get_page(t->pager, child_page_num);
-  uint32_t child_max_key = get_node_max_key(child);
-  uint32_t index = internal_node_find_child(parent, child_max_key);
-
-  uint32_t original_num_keys = *internal_node_num_keys(parent);
-  *internal_node_num_keys(parent) = original_num_keys + 1;
-  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-    printf("Need to implement splitting internal node\n");
-    exit(EXIT_FAILURE);
+void do_import(Db* db, const char* filename) {
+  uint32_t num_rows, num_skipped;
+  switch (check(db_import(db, filename, &num_rows, &num_skipped))) {
+  case (DB_TRANSACTION_OPEN):
+    printf("Error: Cannot import inside a transaction.\n");
+    return;
+  case (DB_CANT_OPEN):
+    printf("Unable to open file '%s'.\n", filename);
+    return;
+  default:
+    break;
   }
-
-  uint32_t right_child_page_num = *internal_node_right_child(parent);
-  void* right_child = get_page(t->pager, right_child_page_num);
-  if (child_max_key > get_node_max_key(right_child)) {
-    // if new child is going to be right child
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) = get_node_max_key(right_child);
-    *internal_node_right_child(parent) = child_page_num;
-  } else {
-    // make room for new child
-    for (uint32_t i = original_num_keys; i > index; i--) {
-      void* destination = internal_node_cell(parent, i);
-      void* source = internal_node_cell(parent, i - 1);
-      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
-    }
-    *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index) = child_max_key;
-  }
-}
-
-void leaf_node_split_and_insert(Cursor* c, uint32_t key, Row* row) {
-  // create new node, move upper half cell to it
-  void* old_node = get_page(c->table->pager, c->page_num);
-  uint32_t old_max = get_node_max_key(old_node);
-  uint32_t new_page_num = get_unused_page_num(c->table->pager);
-  void* new_node = get_page(c->table->pager, new_page_num);
-  initialize_leaf_node(new_node);
-  *node_parent(new_node) = *node_parent(old_node);
-  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-  *leaf_node_next_leaf(old_node) = new_page_num;
-
-  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {  // using uint32_t here would cuase an infinite loop
-    uint32_t j = (uint32_t) i;
-    void* dest_node = j >= LEAF_NODE_LEFT_SPLIT_COUNT ? new_node : old_node;
-    uint32_t index_in_node = j % LEAF_NODE_LEFT_SPLIT_COUNT;
-    void* destination = leaf_node_cell(dest_node, index_in_node);
-
-    if (j == c->cell_num) {
-      *leaf_node_key(dest_node, index_in_node) = key;
-      serialize_row(row, leaf_node_value(dest_node, index_in_node)); // 2nd arg can also be: destination + LEAF_NODE_KEY_SIZE
-    } else if (j >= c->cell_num) {
-      memcpy(destination, leaf_node_cell(old_node, j - 1), LEAF_NODE_CELL_SIZE);
-    } else {
-      memcpy(destination, leaf_node_cell(old_node, j), LEAF_NODE_CELL_SIZE);
-    }
+  printf("Imported %d rows.\n", num_rows);
+  if (num_skipped > 0) {
+    printf("Skipped %d lines.\n", num_skipped);
   }
+}
 
-  *leaf_node_num_cells(old_node) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *leaf_node_num_cells(new_node) = LEAF_NODE_RIGHT_SPLIT_COUNT;
-
-  if (is_node_root(old_node)) {
-    return create_new_root(c->table, new_page_num);
-  } else {
-    uint32_t parent_page_num = *node_parent(old_node);
-    uint32_t new_max = get_node_max_key(old_node);
-    void* parent = get_page(c->table->pager, parent_page_num);
-    update_internal_node_key(parent, old_max, new_max);
-    internal_node_insert(c->table, parent_page_num, new_page_num);
+// replies to `out`, a client's socket when serving
+void do_backup(FILE* out, Db* db, const char* filename) {
+  uint32_t num_pages;
+  switch (check(db_backup(db, filename, &num_pages))) {
+  case (DB_TRANSACTION_OPEN):
+    fprintf(out, "Error: Cannot back up inside a transaction.\n");
+    return;
+  case (DB_BUSY):
+    fprintf(out, "Error: A backup is already running.\n");
+    return;
+  case (DB_MISUSE):
+    fprintf(out, "Error: Cannot back up the db onto itself.\n");
+    return;
+  case (DB_CANT_OPEN):
+    fprintf(out, "Unable to write file '%s'.\n", filename);
     return;
+  default:
+    break;
   }
+  fprintf(out, "Backed up %d pages.\n", num_pages);
 }
 
-// CORE: VM
-
 enum MetaCommandResult_t {
 			  META_COMMAND_SUCCESS,
 			  META_COMMAND_UNRECOGNIZED
 };
 typedef enum MetaCommandResult_t MetaCommandResult;
 
-enum ExecuteResult_t {
-		      EXECUTE_SUCCESS,
-		      EXECUTE_TABLE_FULL,
-		      EXECUTE_DUPLICATE_KEY
-};
-typedef enum ExecuteResult_t ExecuteResult;
+// SCRIPTS
 
-void leaf_node_insert(Cursor* c, uint32_t key, Row* row) {
-  void* node = get_page(c->table->pager, c->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+// `.read` and `-f` run a file of statements without prompts and without
+// an "Executed." per statement, only rows and errors are printed. The
+// file is read a block at a time and each line is run where it lies in
+// the block, the partial line at the end of a block moves to the front
+// before the next read.
 
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
-    leaf_node_split_and_insert(c, key, row);
-    return;
-  }
+#define SCRIPT_BLOCK_SIZE (1 << 20)
 
-  if (c->cell_num < num_cells) {
-    // cell to insert row is already filled
-    for (uint32_t i = num_cells; i > c->cell_num; i--) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i-1),
-	     LEAF_NODE_CELL_SIZE);
-    }
-  }
+struct Script_t {
+  int file_desc;
+  char* buffer;
+  uint32_t capacity;
+  uint32_t start, end;  // unread bytes
+  bool end_of_file;
+  uint32_t line_num;
+  bool client;  // a read error ends the script instead of exiting
+};
+typedef struct Script_t Script;
 
-  *leaf_node_key(node, c->cell_num) = key;
-  *leaf_node_num_cells(node) += 1;
-  serialize_row(row, leaf_node_value(node, c->cell_num));
-}
+// the next line, terminated in place, or NULL at the end of the script
+char* script_next_line(Script* script) {
+  while (true) {
+    char* line = script->buffer + script->start;
+    uint32_t available = script->end - script->start;
+    char* newline = memchr(line, '\n', available);
+    if (newline != NULL || (script->end_of_file && available > 0)) {
+      uint32_t length = newline != NULL ? newline - line : available;
+      script->start += newline != NULL ? length + 1 : length;
+      line[length] = 0;  // there is always room past the unread bytes
+      if (length > 0 && line[length - 1] == '\r') {
+	line[length - 1] = 0;
+      }
+      script->line_num += 1;
+      return line;
+    }
+    if (script->end_of_file) {
+      return NULL;
+    }
 
-void print_row(Row *row) {
-  printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+    memmove(script->buffer, line, available);
+    script->start = 0;
+    script->end = available;
+    if (script->capacity - script->end <= SCRIPT_BLOCK_SIZE / 2) {
+      script->capacity *= 2;  // a line longer than a block
+      script->buffer = realloc(script->buffer, script->capacity);
+    }
+    ssize_t bytes_read = read(script->file_desc, script->buffer + script->end,
+			      script->capacity - script->end - 1);
+    if (bytes_read == -1 && script->client) {
+      bytes_read = 0;  // the connection was reset
+    } else if (bytes_read == -1) {
+      printf("Error reading script.\n");
+      exit(EXIT_FAILURE);
+    }
+    script->end += bytes_read;
+    script->end_of_file = bytes_read == 0;
+  }
 }
 
-ExecuteResult execute_insert(Statement* s, Table* t) {
-  void* node = get_page(t->pager, t->root_page_num);
-  uint32_t num_cells = (*leaf_node_num_cells(node));
-
-  Row* row = &(s->row);
-  Cursor* cursor = table_find(t, row->id);
+MetaCommandResult do_meta_command(char* command, Session* session);
+
+void run_script(Session* session, int file_desc) {
+  Script script = {
+		   .file_desc = file_desc,
+		   .buffer = malloc(SCRIPT_BLOCK_SIZE),
+		   .capacity = SCRIPT_BLOCK_SIZE,
+  };
+  bool own_transaction = false;
+  if (session->single_transaction) {
+    DbStatement* begin;
+    check(db_prepare(session->db, "begin", &begin));
+    // a transaction the script runs in already does the job
+    own_transaction = check(db_step(begin)) == DB_DONE;
+    db_finalize(begin);
+  }
 
-  if (cursor->cell_num < num_cells) {
-    if ((*leaf_node_key(node, cursor->cell_num)) == row->id) {
-      return EXECUTE_DUPLICATE_KEY;
+  char* line;
+  while ((line = script_next_line(&script)) != NULL) {
+    if (line[0] == 0) {
+      continue;
+    }
+    if (line[0] == '.') {
+      output_flush(session->out);
+      if (do_meta_command(line, session) == META_COMMAND_UNRECOGNIZED) {
+	printf("Line %d: Unrecognized command '%s'.\n", script.line_num, line);
+      }
+      continue;
+    }
+    DbResult result = run_statement(session, line);
+    if (result != DB_DONE) {
+      output_flush(session->out);
+      printf("Line %d: ", script.line_num);
+      print_result(stdout, result, line);
     }
   }
-
-  leaf_node_insert(cursor, s->row.id, &(s->row));
-  free(cursor);
-
-  return EXECUTE_SUCCESS;
-}
-
-ExecuteResult execute_select(Statement* s, Table* t) {
-  Row row;
-  Cursor* cursor = table_start(t);
-  while (!cursor->end_of_table) {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
-    cursor_advance(cursor);
+  output_flush(session->out);
+
+  if (own_transaction) {
+    DbStatement* commit;
+    check(db_prepare(session->db, "commit", &commit));
+    DbResult result = db_step(commit);
+    if (result != DB_DONE) {
+      print_result(stdout, result, "commit");  // the script committed itself
+    }
+    db_finalize(commit);
   }
-  return EXECUTE_SUCCESS;
+  free(script.buffer);
 }
 
-ExecuteResult execute_statement(Statement* s, Table* t) {
-  switch (s->type) {
-  case (STATEMENT_INSERT):
-    return execute_insert(s, t);
-  case (STATEMENT_SELECT):
-    return execute_select(s, t);
+void do_read(Session* session, const char* filename) {
+  int file_desc = open(filename, O_RDONLY);
+  if (file_desc == -1) {
+    printf("Unable to open file '%s'.\n", filename);
+    return;
   }
+  run_script(session, file_desc);
+  close(file_desc);
 }
 
-void indent(uint32_t level) {
-  for (uint32_t i = 0; i < level; i++) {
-    printf(" ");
-  }
+// what the engine did since the start or `.stats reset`, see `DbStats`
+void do_stats(Db* db) {
+  DbStats stats;
+  check(db_stats(db, &stats));
+  uint64_t lookups = stats.cache_hits + stats.cache_misses;
+  printf("Cache hits:          %llu\n", (unsigned long long) stats.cache_hits);
+  printf("Cache misses:        %llu\n", (unsigned long long) stats.cache_misses);
+  printf("Cache hit rate:      %.1f%%\n",
+	 lookups > 0 ? 100.0 * stats.cache_hits / lookups : 0.0);
+  printf("Pages read:          %llu\n", (unsigned long long) stats.pages_read);
+  printf("Pages written:       %llu\n", (unsigned long long) stats.pages_written);
+  printf("Bytes read:          %llu\n", (unsigned long long) stats.bytes_read);
+  printf("Bytes written:       %llu\n", (unsigned long long) stats.bytes_written);
+  printf("Read ahead used:     %llu\n", (unsigned long long) stats.read_ahead_used);
+  printf("Read ahead wasted:   %llu\n", (unsigned long long) stats.read_ahead_wasted);
+  printf("Leaf splits:         %llu\n", (unsigned long long) stats.leaf_splits);
+  printf("Internal splits:     %llu\n", (unsigned long long) stats.internal_splits);
+  printf("Rows scanned:        %llu\n", (unsigned long long) stats.rows_scanned);
+  printf("Cursors opened:      %llu\n", (unsigned long long) stats.cursors);
+  printf("Tree depth:          %u\n", stats.tree_depth);
+  printf("Page size:           %u\n", stats.page_size);
 }
 
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indent_level) {
-  void* node = get_page(pager, page_num);
-  uint32_t num_keys, child;
-  switch (get_node_type(node)) {
-  case NODE_LEAF:
-    num_keys = *leaf_node_num_cells(node);
-    indent(indent_level);
-    printf("- leaf (size %d)\n", num_keys);
-    for (uint32_t i = 0; i < num_keys; i++) {
-      indent(indent_level + 1);
-      printf("- %d\n", *leaf_node_key(node, i));
+bool set_output_mode(Output* out, const char* name) {
+  for (uint32_t i = 0; i < sizeof(OUTPUT_MODE_NAMES) / sizeof(OUTPUT_MODE_NAMES[0]); i++) {
+    if (strcmp(name, OUTPUT_MODE_NAMES[i]) == 0) {
+      out->mode = (OutputMode) i;
+      return true;
     }
-    break;
-  case NODE_INTERNAL:
-    num_keys = *internal_node_num_keys(node);
-    indent(indent_level);
-    printf("- internal (size %d)\n", num_keys);
-    for (uint32_t i = 0; i < num_keys; i++) {
-      child = *internal_node_child(node, i);
-      print_tree(pager, child, indent_level + 1);
-
-      indent(indent_level + 1);
-      printf("- key %d\n", *internal_node_key(node, i));
-    }
-    child = *internal_node_right_child(node);
-    print_tree(pager, child, indent_level + 1);
-    break;
   }
+  return false;
 }
 
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* t) {
-  if (strcmp(input_buffer->buffer, ".exit") == 0) {
-    db_close(t);
+MetaCommandResult do_meta_command(char* command, Session* session) {
+  if (strcmp(command, ".exit") == 0) {
+    output_close(session->out);
+    statement_cache_free(session->cache);
+    check(db_close(session->db));
     exit(EXIT_SUCCESS);
-  } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
+  } else if (strcmp(command, ".btree") == 0) {
     printf("Tree:\n");
-    print_tree(t->pager, 0, 0);
+    check(db_print_tree(session->db));
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(command, ".import ", 8) == 0) {
+    do_import(session->db, command + 8);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(command, ".backup ", 8) == 0) {
+    do_backup(stdout, session->db, command + 8);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(command, ".read ", 6) == 0) {
+    do_read(session, command + 6);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(command, ".stats") == 0) {
+    do_stats(session->db);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(command, ".stats reset") == 0) {
+    db_reset_stats(session->db);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(command, ".timer on") == 0 || strcmp(command, ".timer off") == 0) {
+    session->timer = strcmp(command, ".timer on") == 0;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(command, ".mode") == 0) {
+    printf("%s\n", OUTPUT_MODE_NAMES[session->out->mode]);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(command, ".mode ", 6) == 0) {
+    if (!set_output_mode(session->out, command + 6)) {
+      printf("Unknown mode '%s', use table, csv, tsv or binary.\n", command + 6);
+    }
     return META_COMMAND_SUCCESS;
   } else {
     return META_COMMAND_UNRECOGNIZED;
   }
 }
 
+// SERVER
+
+// `--serve <socket>` runs the statements of clients connecting to a Unix
+// domain socket instead of starting the REPL, `dbclient` is one. Each of
+// a pool of worker threads serves one connection at a time: a statement
+// per line in, its rows and then one result line out, "Executed." or the
+// error. Sessions share the handle, see db.h for what runs in parallel.
+// A client that goes away in the middle of a transaction commits it,
+// there is no rollback.
+
+#define DEFAULT_SERVER_THREADS 8
+
+struct Server_t {
+  Db* db;
+  int listen_fd;
+  uint32_t num_threads;
+  pthread_t* threads;
+  pthread_mutex_t lock;  // guards the fields below
+  int* client_fds;  // per worker, -1 when idle
+  bool stopping;
+};
+typedef struct Server_t Server;
+
+struct ServerWorker_t {
+  Server* server;
+  uint32_t index;
+};
+typedef struct ServerWorker_t ServerWorker;
+
+void serve_client(Server* server, int client_fd) {
+  Session session = {
+		     .db = server->db,
+		     .cache = statement_cache_new(),
+		     .out = output_new(client_fd, false),
+  };
+  FILE* replies = fdopen(dup(client_fd), "w");
+  Script script = {
+		   .file_desc = client_fd,
+		   .buffer = malloc(SCRIPT_BLOCK_SIZE),
+		   .capacity = SCRIPT_BLOCK_SIZE,
+		   .client = true,
+  };
+  char* line;
+  while (!session.out->failed && (line = script_next_line(&script)) != NULL) {
+    if (strncmp(line, ".backup ", 8) == 0) {
+      do_backup(replies, server->db, line + 8);
+    } else if (line[0] == '.') {
+      fprintf(replies, "Unrecognized command '%s'.\n", line);
+    } else {
+      DbResult result = run_statement(&session, line);
+      output_flush(session.out);
+      print_result(replies, result, line);
+    }
+    fflush(replies);
+  }
+  if (db_in_transaction(server->db)) {
+    DbStatement* commit;
+    check(db_prepare(server->db, "commit", &commit));
+    check(db_step(commit));
+    db_finalize(commit);
+  }
+  free(script.buffer);
+  fclose(replies);
+  statement_cache_free(session.cache);
+  output_close(session.out);
+}
+
+void* server_worker(void* arg) {
+  ServerWorker* worker = arg;
+  Server* server = worker->server;
+  while (true) {
+    int client_fd = accept(server->listen_fd, NULL, NULL);
+    if (client_fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+	continue;
+      }
+      break;  // the listening socket was shut down
+    }
+    pthread_mutex_lock(&server->lock);
+    bool stopping = server->stopping;
+    if (!stopping) {
+      server->client_fds[worker->index] = client_fd;
+    }
+    pthread_mutex_unlock(&server->lock);
+    if (!stopping) {
+      serve_client(server, client_fd);
+    }
+    pthread_mutex_lock(&server->lock);
+    server->client_fds[worker->index] = -1;
+    pthread_mutex_unlock(&server->lock);
+    close(client_fd);
+  }
+  free(worker);
+  return NULL;
+}
+
+// serves until SIGINT or SIGTERM, then lets the running statements finish
+void serve(Db* db, const char* socket_path, uint32_t num_threads) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    printf("Socket path is too long.\n");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(address.sun_path, socket_path);
+  unlink(socket_path);
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1
+      || bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) == -1
+      || listen(listen_fd, SOMAXCONN) == -1) {
+    printf("Unable to listen on '%s'.\n", socket_path);
+    exit(EXIT_FAILURE);
+  }
+
+  // workers inherit the mask, the signals are only taken by `sigwait`
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  signal(SIGPIPE, SIG_IGN);  // a client went away, see `Output.failed`
+
+  Server server = {
+		   .db = db,
+		   .listen_fd = listen_fd,
+		   .num_threads = num_threads,
+		   .threads = malloc(num_threads * sizeof(pthread_t)),
+		   .client_fds = malloc(num_threads * sizeof(int)),
+		   .stopping = false,
+  };
+  pthread_mutex_init(&server.lock, NULL);
+  for (uint32_t i = 0; i < num_threads; i++) {
+    server.client_fds[i] = -1;
+    ServerWorker* worker = malloc(sizeof(ServerWorker));
+    worker->server = &server;
+    worker->index = i;
+    pthread_create(&server.threads[i], NULL, server_worker, worker);
+  }
+  printf("Listening on '%s'.\n", socket_path);
+  fflush(stdout);
+
+  int signal_number;
+  sigwait(&signals, &signal_number);
+  pthread_mutex_lock(&server.lock);
+  server.stopping = true;
+  shutdown(listen_fd, SHUT_RDWR);
+  for (uint32_t i = 0; i < num_threads; i++) {
+    if (server.client_fds[i] != -1) {
+      shutdown(server.client_fds[i], SHUT_RDWR);
+    }
+  }
+  pthread_mutex_unlock(&server.lock);
+  for (uint32_t i = 0; i < num_threads; i++) {
+    pthread_join(server.threads[i], NULL);
+  }
+  close(listen_fd);
+  unlink(socket_path);
+  pthread_mutex_destroy(&server.lock);
+  free(server.threads);
+  free(server.client_fds);
+}
+
 int main(int argc, char* argv[]) {
-  if (argc < 2) {
+  const char* filename = NULL;
+  const char* load_filename = NULL;
+  const char* output_filename = NULL;
+  const char* script_filename = NULL;
+  const char* socket_path = NULL;
+  uint32_t num_threads = DEFAULT_SERVER_THREADS;
+  bool single_transaction = false;
+  DbOptions options;
+  db_default_options(&options);
+  int fill_factor = options.fill_factor;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+      options.cache_size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--writeback-ms") == 0 && i + 1 < argc) {
+      options.writeback_ms = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--writeback-pages") == 0 && i + 1 < argc) {
+      options.writeback_pages = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--scan-threads") == 0 && i + 1 < argc) {
+      options.scan_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--read-ahead") == 0 && i + 1 < argc) {
+      options.read_ahead_pages = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      options.mmap = true;
+    } else if (strcmp(argv[i], "--no-wal") == 0) {
+      options.wal = false;
+    } else if (strcmp(argv[i], "--direct") == 0) {
+      options.direct_io = true;
+    } else if (strcmp(argv[i], "--huge-pages") == 0) {
+      options.huge_pages = true;
+    } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+      options.page_size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+      load_filename = argv[++i];
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      output_filename = argv[++i];
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      script_filename = argv[++i];
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--single-transaction") == 0) {
+      single_transaction = true;
+    } else if (strcmp(argv[i], "--fill-factor") == 0 && i + 1 < argc) {
+      fill_factor = atoi(argv[++i]);
+    } else {
+      filename = argv[i];
+    }
+  }
+  if (filename == NULL) {
     printf("Must supply a database filename.\n");
     exit(EXIT_FAILURE);
   }
-  Table *table = db_open(argv[1]);
+  if (fill_factor < 1 || fill_factor > 100) {
+    printf("Fill factor must be between 1 and 100.\n");
+    exit(EXIT_FAILURE);
+  }
+  options.fill_factor = fill_factor;
+  Db* db;
+  check(db_open(filename, &options, &db));
+  if (load_filename != NULL) {
+    // load and exit instead of starting the REPL
+    do_import(db, load_filename);
+    check(db_close(db));
+    return 0;
+  }
+  if (socket_path != NULL) {
+    if (num_threads < 1) {
+      printf("Must serve with at least one thread.\n");
+      exit(EXIT_FAILURE);
+    }
+    serve(db, socket_path, num_threads);
+    check(db_close(db));
+    return 0;
+  }
+  Session session = {
+		     .db = db,
+		     .cache = statement_cache_new(),
+		     .out = output_open(output_filename),
+		     .single_transaction = single_transaction,
+  };
+  if (script_filename != NULL) {
+    // run the script and exit instead of starting the REPL, `-` is stdin
+    if (strcmp(script_filename, "-") == 0) {
+      run_script(&session, STDIN_FILENO);
+    } else {
+      do_read(&session, script_filename);
+    }
+    do_meta_command(".exit", &session);
+  }
+
   InputBuffer* input_buffer = create_new_buffer();
   while (true) {
     print_promt();
     read_input(input_buffer);
 
     if (input_buffer->buffer[0] == '.') {
-      switch (do_meta_command(input_buffer, table)) {
+      switch (do_meta_command(input_buffer->buffer, &session)) {
       case (META_COMMAND_SUCCESS):
 	continue;
       case (META_COMMAND_UNRECOGNIZED):
@@ -785,35 +1064,9 @@ int main(int argc, char* argv[]) {
       }
     }
 
-    Statement statement;
-    switch (prepare_statement(input_buffer, &statement)) {
-    case (PREPARE_SUCCESS):
-      break;
-    case (PREPARE_UNRECOGNIZED_STATEMENT):
-      printf("Unrecognized keyword at start of '%s'\n", input_buffer->buffer);
-      continue;
-    case (PREPARE_SYNTAX_ERROR):
-      printf("Syntax Error. Could not parse query.\n");
-      continue;
-    case (PREPARE_STRING_TOO_LONG):
-      printf("String is too long.\n");
-      continue;
-    case (PREPARE_NEGATIVE_ID):
-      printf("ID must be positive.\n");
-      continue;
-    }
-
-    switch (execute_statement(&statement, table)) {
-    case (EXECUTE_SUCCESS):
-      printf("Executed.\n");
-      break;
-    case (EXECUTE_TABLE_FULL):
-      printf("Error: Table full.\n");
-      break;
-    case (EXECUTE_DUPLICATE_KEY):
-      printf("Error: Duplicate key.\n");
-      break;
-    }
+    DbResult result = run_statement(&session, input_buffer->buffer);
+    output_flush(session.out);
+    print_result(stdout, result, input_buffer->buffer);
   }
 
   return 0;
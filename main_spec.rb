@@ -1,11 +1,24 @@
 describe 'database' do
   before do
-    `rm -rf test.db`
+    `rm -rf test.db test.db-wal`
   end
 
-  def run_scripts(commands)
+  # same engine built with 3 keys per internal node, so that internal
+  # nodes split after a few dozen rows
+  def small_fanout_binary
+    system("make -s a.small-fanout.out")
+    "./a.small-fanout.out"
+  end
+
+  # pads a row's strings to their maximum length, 13 such rows fill a
+  # leaf, shorter rows pack more densely
+  def wide(username, email)
+    [username.ljust(32, "_"), email.ljust(255, "_")]
+  end
+
+  def run_scripts(commands, options = "", binary = "./a.out")
     raw_output = nil
-    IO.popen("./a.out test.db", "r+") do |pipe|
+    IO.popen("#{binary} #{options} test.db", "r+") do |pipe|
       commands.each do |command|
         begin
           pipe.puts command
@@ -31,16 +44,59 @@ describe 'database' do
                                   ])
   end
 
-  it 'prints error message when table is full' do
-    script = (1..1401).map do |i|
-      "insert #{i} user#{i} user#{i}@example.com"
+  it 'keeps inserting once the root internal node is full' do
+    script = (1..4500).map do |i|
+      "insert #{i} #{wide("user#{i}", "user#{i}@example.com").join(" ")}"
     end
+    script << ".btree"
+    script << "select"
     script << ".exit"
     result = run_scripts(script)
-    expect(result.last(2)).to eq([
-                                   "db > Executed.",
-                                   "db > Need to implement splitting internal node",
-                                 ])
+    # appends leave the nodes they split full
+    expect(result[4500..4502]).to eq([
+                                       "db > Tree:",
+                                       "- internal (size 1)",
+                                       " - internal (size 338)",
+                                     ])
+    expect(result.count { |line| line.start_with?("(", "db > (") }).to eq(4500)
+    expect(result[-3]).to eq("(4500, #{wide("user4500", "user4500@example.com").join(", ")})")
+  end
+
+  it 'prints the structure of a btree with split internal nodes' do
+    script = (1..92).map do |i|
+      "insert #{i} #{wide("user#{i}", "person#{i}@example.com").join(" ")}"
+    end
+    script << ".btree"
+    script << ".exit"
+    result = run_scripts(script, "", small_fanout_binary)
+
+    leaf = lambda do |ids|
+      ["  - leaf (size #{ids.size})"] + ids.map { |i| "   - #{i}" }
+    end
+    # appends fill a leaf before starting the next, and leave internal
+    # nodes they split with all but two of their children
+    expected = ["db > Tree:",
+                "- internal (size 2)",
+                " - internal (size 2)",
+                *leaf.call(1..13),
+                "  - key 13",
+                *leaf.call(14..26),
+                "  - key 26",
+                *leaf.call(27..39),
+                " - key 39",
+                " - internal (size 2)",
+                *leaf.call(40..52),
+                "  - key 52",
+                *leaf.call(53..65),
+                "  - key 65",
+                *leaf.call(66..78),
+                " - key 78",
+                " - internal (size 1)",
+                *leaf.call(79..91),
+                "  - key 91",
+                *leaf.call(92..92),
+                "db > "]
+    expect(result[92..result.length]).to eq(expected)
   end
 
   it 'inserts strings of maximum length' do
@@ -130,7 +186,7 @@ describe 'database' do
 
   it 'print 3 leaf node btree' do
     scripts = (1..14).map do |i|
-      "insert #{i} user#{i} user#{i}@example.com"
+      "insert #{i} #{wide("user#{i}", "user#{i}@example.com").join(" ")}"
     end
     scripts << ".btree"
     scripts << "insert 15 user15 user15@example.com"
@@ -141,22 +197,10 @@ describe 'database' do
       .to match_array([
                         "db > Tree:",
                         "- internal (size 1)",
-                        " - leaf (size 7)",
-                        "  - 1",
-                        "  - 2",
-                        "  - 3",
-                        "  - 4",
-                        "  - 5",
-                        "  - 6",
-                        "  - 7",
-                        " - key 7",
-                        " - leaf (size 7)",
-                        "  - 8",
-                        "  - 9",
-                        "  - 10",
-                        "  - 11",
-                        "  - 12",
-                        "  - 13",
+                        " - leaf (size 13)",
+                        *(1..13).map { |i| "  - #{i}" },
+                        " - key 13",
+                        " - leaf (size 1)",
                         "  - 14",
                         "db > Executed.",
                         "db > ",
@@ -196,36 +240,36 @@ describe 'database' do
     # this test case input copied directly from tutorial the order of
     # insertion is such that, tree will split into 4 leaf node
     scripts = [
-      "insert 18 user18 person18@example.com",
-      "insert 7 user7 person7@example.com",
-      "insert 10 user10 person10@example.com",
-      "insert 29 user29 person29@example.com",
-      "insert 23 user23 person23@example.com",
-      "insert 4 user4 person4@example.com",
-      "insert 14 user14 person14@example.com",
-      "insert 30 user30 person30@example.com",
-      "insert 15 user15 person15@example.com",
-      "insert 26 user26 person26@example.com",
-      "insert 22 user22 person22@example.com",
-      "insert 19 user19 person19@example.com",
-      "insert 2 user2 person2@example.com",
-      "insert 1 user1 person1@example.com",
-      "insert 21 user21 person21@example.com",
-      "insert 11 user11 person11@example.com",
-      "insert 6 user6 person6@example.com",
-      "insert 20 user20 person20@example.com",
-      "insert 5 user5 person5@example.com",
-      "insert 8 user8 person8@example.com",
-      "insert 9 user9 person9@example.com",
-      "insert 3 user3 person3@example.com",
-      "insert 12 user12 person12@example.com",
-      "insert 27 user27 person27@example.com",
-      "insert 17 user17 person17@example.com",
-      "insert 16 user16 person16@example.com",
-      "insert 13 user13 person13@example.com",
-      "insert 24 user24 person24@example.com",
-      "insert 25 user25 person25@example.com",
-      "insert 28 user28 person28@example.com",
+      "insert 18 #{wide("user18", "person18@example.com").join(" ")}",
+      "insert 7 #{wide("user7", "person7@example.com").join(" ")}",
+      "insert 10 #{wide("user10", "person10@example.com").join(" ")}",
+      "insert 29 #{wide("user29", "person29@example.com").join(" ")}",
+      "insert 23 #{wide("user23", "person23@example.com").join(" ")}",
+      "insert 4 #{wide("user4", "person4@example.com").join(" ")}",
+      "insert 14 #{wide("user14", "person14@example.com").join(" ")}",
+      "insert 30 #{wide("user30", "person30@example.com").join(" ")}",
+      "insert 15 #{wide("user15", "person15@example.com").join(" ")}",
+      "insert 26 #{wide("user26", "person26@example.com").join(" ")}",
+      "insert 22 #{wide("user22", "person22@example.com").join(" ")}",
+      "insert 19 #{wide("user19", "person19@example.com").join(" ")}",
+      "insert 2 #{wide("user2", "person2@example.com").join(" ")}",
+      "insert 1 #{wide("user1", "person1@example.com").join(" ")}",
+      "insert 21 #{wide("user21", "person21@example.com").join(" ")}",
+      "insert 11 #{wide("user11", "person11@example.com").join(" ")}",
+      "insert 6 #{wide("user6", "person6@example.com").join(" ")}",
+      "insert 20 #{wide("user20", "person20@example.com").join(" ")}",
+      "insert 5 #{wide("user5", "person5@example.com").join(" ")}",
+      "insert 8 #{wide("user8", "person8@example.com").join(" ")}",
+      "insert 9 #{wide("user9", "person9@example.com").join(" ")}",
+      "insert 3 #{wide("user3", "person3@example.com").join(" ")}",
+      "insert 12 #{wide("user12", "person12@example.com").join(" ")}",
+      "insert 27 #{wide("user27", "person27@example.com").join(" ")}",
+      "insert 17 #{wide("user17", "person17@example.com").join(" ")}",
+      "insert 16 #{wide("user16", "person16@example.com").join(" ")}",
+      "insert 13 #{wide("user13", "person13@example.com").join(" ")}",
+      "insert 24 #{wide("user24", "person24@example.com").join(" ")}",
+      "insert 25 #{wide("user25", "person25@example.com").join(" ")}",
+      "insert 28 #{wide("user28", "person28@example.com").join(" ")}",
       ".btree",
       ".exit",
     ]
@@ -275,4 +319,825 @@ describe 'database' do
 
     expect(result[30..(result.length)]).to match_array(expected)
   end
+
+  it 'keeps working when the tree outgrows the page cache' do
+    ids = (1..600).to_a.shuffle(random: Random.new(42))
+    script = ids.map do |i|
+      "insert #{i} #{wide("user#{i}", "person#{i}@example.com").join(" ")}"
+    end
+    script << ".exit"
+    run_scripts(script, "--cache-size 16", small_fanout_binary)
+    expect(File.size("test.db")).to be > 64 * 4096
+
+    result = run_scripts(["select", ".exit"], "--cache-size 16", small_fanout_binary)
+    expected = (1..600).map do |i|
+      "(#{i}, #{wide("user#{i}", "person#{i}@example.com").join(", ")})"
+    end
+    expected[0] = "db > " + expected[0]
+    expected << "Executed."
+    expected << "db > "
+    expect(result).to eq(expected)
+  end
+
+  it 'does not rewrite the file in a read-only session' do
+    run_scripts(["insert 1 user1 person1@example.com", ".exit"])
+    File.utime(Time.at(0), Time.at(0), "test.db")
+
+    run_scripts(["select", ".btree", ".exit"])
+    expect(File.mtime("test.db")).to eq(Time.at(0))
+  end
+
+  it 'writes dirty pages back before exit when write-back is enabled' do
+    IO.popen("./a.out --writeback-ms 10 test.db", "r+") do |pipe|
+      pipe.puts "insert 1 user1 person1@example.com"
+      pipe.flush
+      sleep 0.5
+      expect(File.binread("test.db")).to include("person1@example.com")
+      pipe.puts ".exit"
+      pipe.close_write
+      pipe.read
+    end
+  end
+
+  it 'reads and writes the same file through the mmap pager' do
+    script = (1..20).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_scripts(script, "--mmap")
+    expect(File.size("test.db") % 4096).to eq(0)
+
+    result = run_scripts(["select", ".exit"])
+    expect(result.length).to eq(22)
+    expect(result[19]).to eq("(20, user20, person20@example.com)")
+
+    result = run_scripts(["insert 21 user21 person21@example.com", "select", ".exit"], "--mmap")
+    expect(result[-3]).to eq("(21, user21, person21@example.com)")
+  end
+
+  it 'commits rows inserted between begin and commit together' do
+    result = run_scripts([
+                           "commit",
+                           "begin",
+                           "begin",
+                           "insert 1 user1 person1@example.com",
+                           "insert 2 user2 person2@example.com",
+                           "commit",
+                           "select",
+                           ".exit",
+                         ])
+    expect(result).to eq([
+                           "db > Error: No transaction is open.",
+                           "db > Executed.",
+                           "db > Error: Transaction already open.",
+                           "db > Executed.",
+                           "db > Executed.",
+                           "db > Executed.",
+                           "db > (1, user1, person1@example.com)",
+                           "(2, user2, person2@example.com)",
+                           "Executed.",
+                           "db > ",
+                         ])
+  end
+
+  it 'recovers committed rows from the WAL after a crash' do
+    pipe = IO.popen("./a.out test.db", "r+")
+    (1..20).each do |i|
+      pipe.puts "insert #{i} user#{i} person#{i}@example.com"
+    end
+    pipe.puts "begin"
+    pipe.puts "insert 21 user21 person21@example.com"
+    pipe.flush
+    sleep 0.5
+    Process.kill(:KILL, pipe.pid)
+    pipe.close
+
+    result = run_scripts(["select", ".exit"])
+    expect(result.length).to eq(22)
+    expect(result[-3]).to eq("(20, user20, person20@example.com)")
+    expect(File.exist?("test.db-wal")).to eq(false)
+  end
+
+  it 'bulk loads a csv file into packed leaves' do
+    File.open("test.csv", "w") do |f|
+      f.puts "id,username,email"
+      (1..30).to_a.shuffle.each { |i| f.puts "#{i},#{wide("user#{i}", "person#{i}@example.com").join(",")}" }
+      f.puts "7,again,again@example.com"
+    end
+    output = `./a.out --load test.csv test.db`
+    File.delete("test.csv")
+    expect(output.split("\n")).to eq(["Imported 30 rows.", "Skipped 2 lines."])
+
+    result = run_scripts(["select", ".btree", ".exit"])
+    expect(result[0]).to eq("db > (1, #{wide("user1", "person1@example.com").join(", ")})")
+    expect(result[29]).to eq("(30, #{wide("user30", "person30@example.com").join(", ")})")
+    expect(result).to include("- internal (size 2)")
+    expect(result.count(" - leaf (size 10)")).to eq(3)
+
+    # the first line of an id wins, whichever run of the sort it lands in
+    `rm -rf test.db test.db-wal`
+    File.open("test.csv", "w") do |f|
+      f.puts "3,first3,first3@example.com"
+      f.puts "5,u5,e5@example.com,extra"
+      f.puts "6,first6,first6@example.com"
+      f.puts "3,later3,later3@example.com"
+      f.puts "6,later6,later6@example.com"
+    end
+    output = `./a.out --load test.csv test.db`
+    File.delete("test.csv")
+    expect(output.split("\n")).to eq(["Imported 2 rows.", "Skipped 3 lines."])
+    expect(run_scripts(["select", ".exit"])).to eq([
+                                                   "db > (3, first3, first3@example.com)",
+                                                   "(6, first6, first6@example.com)",
+                                                   "Executed.",
+                                                   "db > ",
+                                                 ])
+  end
+
+  it 'packs short rows densely into a leaf' do
+    script = (1..100).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".btree"
+    (101..103).each { |i| script << "insert #{i} #{wide("user#{i}", "person#{i}@example.com").join(" ")}" }
+    script << ".btree"
+    script << ".exit"
+    result = run_scripts(script)
+    expect(result[100]).to eq("db > Tree:")
+    expect(result[101]).to eq("- leaf (size 100)")
+    expect(result).to include("- internal (size 1)")
+  end
+
+  it 'binds values to prepared statements' do
+    script = (1..5).map { |i| "insert ? ? ? using #{i} user#{i} person#{i}@example.com" }
+    script << "insert ? ? ? using 6 user6"
+    script << "insert ? ? ? using 7 #{"a" * 33} person7@example.com"
+    script << "select where id >= ? limit ? using 2 2"
+    script << "delete where id between ? and ? using 1 4"
+    script << "select"
+    script << ".exit"
+    result = run_scripts(script)
+    expect(result).to eq([
+                           *(["db > Executed."] * 5),
+                           "db > Syntax Error. Could not parse query.",
+                           "db > String is too long.",
+                           "db > (2, user2, person2@example.com)",
+                           "(3, user3, person3@example.com)",
+                           "Executed.",
+                           "db > Executed.",
+                           "db > (5, user5, person5@example.com)",
+                           "Executed.",
+                           "db > ",
+                         ])
+  end
+
+  it 'deletes single rows and ranges of ids' do
+    script = (1..50).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << "delete 3"
+    script << "delete where id between 10 and 45"
+    script << "delete 99"
+    script << "select"
+    script << ".exit"
+    result = run_scripts(script)
+    ids = result.grep(/\(\d+,/).map { |line| line[/\((\d+),/, 1].to_i }
+    expect(ids).to eq([1, 2, 4, 5, 6, 7, 8, 9, 46, 47, 48, 49, 50])
+  end
+
+  it 'reuses the pages of deleted rows' do
+    script = (1..300).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    run_scripts(script + ["delete where id between 1 and 300", ".exit"], "", small_fanout_binary)
+    size = File.size("test.db")
+    run_scripts(script + [".exit"], "", small_fanout_binary)
+    expect(File.size("test.db")).to eq(size)
+
+    result = run_scripts(["delete where id between 1 and 300", ".btree", ".exit"], "", small_fanout_binary)
+    expect(result).to include("db > Tree:", "- leaf (size 0)")
+  end
+
+  it 'selects rows by id, id range and limit' do
+    script = (1..40).map { |i| "insert #{i * 2} user#{i} person#{i}@example.com" }
+    script << "select where id = 14"
+    script << "select where id = 15"
+    script << "select where id >= 31 and id <= 40"
+    script << "select where id > 70 limit 2"
+    script << "select where id = abc"
+    script << ".exit"
+    result = run_scripts(script)
+    expect(result[40..-1]).to eq([
+                                   "db > (14, user7, person7@example.com)",
+                                   "Executed.",
+                                   "db > Executed.",
+                                   "db > (32, user16, person16@example.com)",
+                                   "(34, user17, person17@example.com)",
+                                   "(36, user18, person18@example.com)",
+                                   "(38, user19, person19@example.com)",
+                                   "(40, user20, person20@example.com)",
+                                   "Executed.",
+                                   "db > (72, user36, person36@example.com)",
+                                   "(74, user37, person37@example.com)",
+                                   "Executed.",
+                                   "db > Syntax Error. Could not parse query.",
+                                   "db > ",
+                                 ])
+  end
+
+  it 'embeds the engine as a library' do
+    system("make -s libdb.a")
+    File.write("client.c", <<~C)
+      #include <stdio.h>
+      #include "db.h"
+
+      int main() {
+        Db* db;
+        DbStatement* insert;
+        DbStatement* select;
+        DbOptions options;
+        db_default_options(&options);
+        options.fill_factor = 101;
+        printf("%d\\n", db_open("test.db", &options, &db) == DB_MISUSE);
+        if (db_open("test.db", NULL, &db) != DB_OK) {
+          printf("%s\\n", db_error_message());
+          return 1;
+        }
+        db_prepare(db, "insert ? ? ?", &insert);
+        for (uint32_t i = 1; i <= 3; i++) {
+          db_bind_id(insert, 0, i);
+          db_bind_text(insert, 1, "user");
+          db_bind_text(insert, 2, "user@example.com");
+          db_step(insert);
+          db_reset(insert);
+        }
+        db_finalize(insert);
+        db_prepare(db, "select where id >= ?", &select);
+        db_bind_id(select, 0, 2);
+        while (db_step(select) == DB_ROW) {
+          printf("%d %s\\n", db_row(select)->id, db_row(select)->username);
+        }
+        printf("%d\\n", db_step(select) == DB_DONE);
+        db_finalize(select);
+        return db_close(db) != DB_OK;
+      }
+    C
+    expect(system("gcc -I. client.c libdb.a -o client.out -lpthread")).to be_truthy
+    expect(`./client.out`.lines.map(&:chomp)).to eq(["1", "2 user", "3 user", "1"])
+    `rm -f client.c client.out`
+
+    result = run_scripts(["select", ".exit"])
+    expect(result).to eq([
+                           "db > (1, user, user@example.com)",
+                           "(2, user, user@example.com)",
+                           "(3, user, user@example.com)",
+                           "Executed.",
+                           "db > ",
+                         ])
+  end
+
+  it 'prints rows in csv, tsv and binary output modes' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com",
+      ".mode csv",
+      "select",
+      ".mode tsv",
+      "select where id = 2",
+      ".mode",
+      ".mode json",
+      ".exit",
+    ]
+    result = run_scripts(script)
+    expect(result[2..-1]).to eq([
+                                  "db > db > 1,user1,person1@example.com",
+                                  "2,user2,person2@example.com",
+                                  "Executed.",
+                                  "db > db > 2\tuser2\tperson2@example.com",
+                                  "Executed.",
+                                  "db > tsv",
+                                  "db > Unknown mode 'json', use table, csv, tsv or binary.",
+                                  "db > ",
+                                ])
+
+    run_scripts([".mode binary", "select", ".exit"], "--output rows.bin")
+    row = [1, 5, "user1", 19, "person1@example.com"].pack("LCa*Ca*")
+    expect(File.binread("rows.bin")[0, 4 + row.size]).to eq([row.size].pack("L") + row)
+    expect(File.size("rows.bin")).to eq(2 * (4 + row.size))
+
+    run_scripts([".mode csv", "select", ".exit"], "--output rows.csv")
+    `rm -rf test.db test.db-wal`
+    result = run_scripts([".import rows.csv", "select", ".exit"])
+    expect(result).to include("db > Imported 2 rows.", "(2, user2, person2@example.com)")
+    `rm -f rows.bin rows.csv`
+  end
+
+  it 'quotes csv and escapes tsv fields so exports load back' do
+    script = [
+      'insert 1 a,b c@d',
+      'insert 2 say"hi" back\\slash@example.com',
+      ".mode csv",
+      "select",
+      ".mode tsv",
+      "select where id = 2",
+      ".exit",
+    ]
+    result = run_scripts(script)
+    expect(result[2..-1]).to eq([
+                                  'db > db > 1,"a,b",c@d',
+                                  '2,"say""hi""",back\\slash@example.com',
+                                  "Executed.",
+                                  "db > db > 2\tsay\"hi\"\tback\\\\slash@example.com",
+                                  "Executed.",
+                                  "db > ",
+                                ])
+
+    rows = ["(1, a,b, c@d)", '(2, say"hi", back\\slash@example.com)']
+    ["csv", "tsv"].each do |mode|
+      run_scripts([".mode #{mode}", "select", ".exit"], "--output rows.#{mode}")
+      `mv test.db exported.db`
+      result = run_scripts([".import rows.#{mode}", "select", ".exit"])
+      expect(result.take(4)).to eq(["db > Imported 2 rows.", "db > #{rows[0]}", rows[1], "Executed."])
+      `rm -rf test.db test.db-wal; mv exported.db test.db`
+    end
+    `rm -f rows.csv rows.tsv`
+  end
+
+  it 'runs script files without prompts' do
+    File.write("script.sql", (1..50).map { |i| "insert #{i} user#{i} person#{i}@example.com\n" }.join +
+                             "insert 3 user3 person3@example.com\n\nselect where id > 48\n")
+    output = `./a.out -f script.sql --single-transaction test.db`
+    expect(output.lines.map(&:chomp)).to eq([
+                                              "Line 51: Error: Duplicate key.",
+                                              "(49, user49, person49@example.com)",
+                                              "(50, user50, person50@example.com)",
+                                            ])
+
+    output = `printf 'select where id = 7\n' | ./a.out -f - test.db`
+    expect(output).to eq("(7, user7, person7@example.com)\n")
+
+    result = run_scripts([".read script.sql", ".read missing.sql", ".exit"])
+    expect(result).to include("db > Line 1: Error: Duplicate key.",
+                              "(50, user50, person50@example.com)",
+                              "db > Unable to open file 'missing.sql'.")
+    `rm -f script.sql`
+  end
+
+  it 'serves concurrent clients over a unix socket' do
+    system("make -s dbclient")
+    `rm -f test.sock`
+    server = spawn("./a.out --serve test.sock --threads 4 test.db", out: File::NULL)
+    sleep 0.05 until File.exist?("test.sock")
+
+    clients = (0...4).map do |c|
+      Thread.new do
+        commands = (1..100).map { |i| "insert #{c * 100 + i} user#{i} person#{i}@example.com" }
+        commands << "select where id > #{c * 100 + 98} limit 2"
+        IO.popen("./dbclient test.sock", "r+") do |pipe|
+          pipe.puts commands
+          pipe.close_write
+          pipe.read.lines.map(&:chomp)
+        end
+      end
+    end
+    clients.each_with_index do |client, c|
+      expect(client.value).to eq(["Executed."] * 100 + [
+                                   "(#{c * 100 + 99}, user99, person99@example.com)",
+                                   "(#{c * 100 + 100}, user100, person100@example.com)",
+                                   "Executed.",
+                                 ])
+    end
+
+    output = `printf 'begin\ninsert 1 dup dup\n.btree\ninsert 401 a b\n' | ./dbclient test.sock`
+    expect(output.lines.map(&:chomp)).to eq([
+                                              "Executed.",
+                                              "Error: Duplicate key.",
+                                              "Unrecognized command '.btree'.",
+                                              "Executed.",
+                                            ])
+
+    Process.kill("TERM", server)
+    Process.wait(server)
+    expect(File.exist?("test.sock")).to eq(false)
+    result = run_scripts(["select where id > 399", ".exit"])
+    expect(result).to eq([
+                           "db > (400, user100, person100@example.com)",
+                           "(401, a, b)",
+                           "Executed.",
+                           "db > ",
+                         ])
+  end
+
+  it 'computes aggregates over partitions scanned in parallel' do
+    script = (1..200).map { |i| "insert #{i} user#{i % 3} person#{i}@example.com" }
+    script += [
+      "delete where id between 50 and 59",
+      "select count(*)",
+      "select sum(id) where id > 100",
+      "select min(id) where id >= 50",
+      "select max(id) where id < 60",
+      "select count(*) where username = user1 and id <= 30",
+      "select where username = user0 and id > 190",
+      "select max(id) where id > 500",
+      ".exit",
+    ]
+    result = run_scripts(script, "--scan-threads 4", small_fanout_binary)
+    expect(result[200..-1]).to eq([
+                                    "db > Executed.",
+                                    "db > (190)",
+                                    "Executed.",
+                                    "db > (15050)",
+                                    "Executed.",
+                                    "db > (60)",
+                                    "Executed.",
+                                    "db > (49)",
+                                    "Executed.",
+                                    "db > (10)",
+                                    "Executed.",
+                                    "db > (192, user0, person192@example.com)",
+                                    "(195, user0, person195@example.com)",
+                                    "(198, user0, person198@example.com)",
+                                    "Executed.",
+                                    "db > (NULL)",
+                                    "Executed.",
+                                    "db > ",
+                                  ])
+  end
+
+  it 'counts and pages through rows with subtree counts' do
+    script = (1..300).map { |i| "insert #{i * 2} user#{i} person#{i}@example.com" }
+    script += [
+      "delete where id between 101 and 200",
+      "select count(*)",
+      "select count(*) where id > 50 and id <= 300",
+      "select max(id) where id < 250",
+      "select limit 2 offset 200",
+      "select where id >= 400 limit 1 offset 3",
+      "select offset 249",
+      "select limit ? offset ? using 1 0",
+      # an aggregate is one row, which limit 0 or an offset skips
+      "select count(*) limit 1",
+      "select count(*) offset 1",
+      "select sum(id) limit 0",
+      ".exit",
+    ]
+    result = run_scripts(script, "", small_fanout_binary)
+    expect(result[301..-1]).to eq([
+                                    "db > (250)",
+                                    "Executed.",
+                                    "db > (75)",
+                                    "Executed.",
+                                    "db > (248)",
+                                    "Executed.",
+                                    "db > (502, user251, person251@example.com)",
+                                    "(504, user252, person252@example.com)",
+                                    "Executed.",
+                                    "db > (406, user203, person203@example.com)",
+                                    "Executed.",
+                                    "db > (600, user300, person300@example.com)",
+                                    "Executed.",
+                                    "db > (2, user1, person1@example.com)",
+                                    "Executed.",
+                                    "db > (250)",
+                                    "Executed.",
+                                    "db > Executed.",
+                                    "db > Executed.",
+                                    "db > ",
+                                  ])
+  end
+
+  it 'finds rows through an index on username or email' do
+    script = (1..400).map { |i| "insert #{i} user#{i % 7} person#{i}@example.com" }
+    script += [
+      "create index on username",
+      "delete where id between 1 and 300",
+      ".exit",
+    ]
+    run_scripts(script, "", small_fanout_binary)
+    result = run_scripts([
+                           "create index on email",
+                           "insert 401 user3 person401@example.com",
+                           "select where username = 'user3' limit 3",
+                           "select count(*) where username = user3",
+                           "select where email like person39% and id > 396",
+                           "select min(id) where email = person400@example.com",
+                           "create index on id",
+                           ".exit",
+                         ], "", small_fanout_binary)
+    expect(result).to eq([
+                           "db > Executed.",
+                           "db > Executed.",
+                           "db > (304, user3, person304@example.com)",
+                           "(311, user3, person311@example.com)",
+                           "(318, user3, person318@example.com)",
+                           "Executed.",
+                           "db > (15)",
+                           "Executed.",
+                           "db > (397, user5, person397@example.com)",
+                           "(398, user6, person398@example.com)",
+                           "(399, user0, person399@example.com)",
+                           "Executed.",
+                           "db > (400)",
+                           "Executed.",
+                           "db > Syntax Error. Could not parse query.",
+                           "db > ",
+                         ])
+  end
+
+  it 'reads leaves ahead without changing what scans return' do
+    ids = (1..600).to_a.shuffle(random: Random.new(7))
+    script = ids.map do |i|
+      "insert #{i} #{wide("user#{i % 5}", "person#{i}@example.com").join(" ")}"
+    end
+    script << ".exit"
+    run_scripts(script, "--cache-size 16", small_fanout_binary)
+
+    queries = [
+      "select where username = #{wide("user3", "").first}",
+      "select where id >= 100 and id <= 450 limit 5 offset 200",
+      "select sum(id) where id > 20",
+      ".exit",
+    ]
+    results = ["--read-ahead 0", "--read-ahead 8", "--read-ahead 64 --mmap"].map do |options|
+      run_scripts(queries, "--cache-size 16 #{options}", small_fanout_binary)
+    end
+    expect(results[0].length).to eq(120 + 1 + 5 + 2 + 2)
+    expect(results[0][-4..-1]).to eq(["Executed.", "db > (180090)", "Executed.", "db > "])
+    expect(results[1]).to eq(results[0])
+    expect(results[2]).to eq(results[0])
+  end
+
+  it 'reports engine statistics, statement times and the pages a statement touched' do
+    script = (1..150).map do |i|
+      "insert #{i} #{wide("user#{i}", "person#{i}@example.com").join(" ")}"
+    end
+    script += [
+      ".stats",
+      ".stats reset",
+      "explain select where id = 75",
+      ".timer on",
+      "select count(*)",
+      ".timer off",
+      ".stats",
+      ".exit",
+    ]
+    result = run_scripts(script, "--cache-size 16", small_fanout_binary)
+    stats = result.join("\n").split("db > ").select { |s| s.start_with?("Cache hits:") }.map do |s|
+      s.lines.map { |line| line.split(":").map(&:strip) }.to_h
+    end
+    expect(stats.length).to eq(2)
+    expect(stats[0]["Leaf splits"].to_i).to be > 0
+    expect(stats[0]["Internal splits"].to_i).to be > 0
+    expect(stats[0]["Pages written"].to_i).to be > 0
+    expect(stats[0]["Bytes written"].to_i).to eq(stats[0]["Pages written"].to_i * 4096)
+    expect(stats[0]["Tree depth"].to_i).to be > 2
+    expect(stats[1]["Leaf splits"]).to eq("0")
+    expect(stats[1]["Rows scanned"]).to eq("2")
+    expect(stats[1]["Tree depth"]).to eq(stats[0]["Tree depth"])
+
+    explained = result.index { |line| line.include?("person75@") }
+    expect(result[explained + 1]).to match(
+      /^Pages: #{stats[0]["Tree depth"]} touched, \d+ read, \d+ read ahead:( \d+)+$/
+    )
+    timed = result.index { |line| line.end_with?("> (150)") }
+    expect(result[timed + 1]).to match(/^Run Time: real \d+\.\d{3} user \d+\.\d{6} sys \d+\.\d{6}$/)
+    expect(result[timed + 2]).to eq("Executed.")
+  end
+
+  it 'bypasses the kernel page cache with direct I/O' do
+    script = (1..400).to_a.shuffle(random: Random.new(3)).map do |i|
+      "insert #{i} user#{i % 7} person#{i}@example.com"
+    end
+    script += [
+      "create index on username",
+      "delete where id between 100 and 199",
+      ".exit",
+    ]
+    run_scripts(script, "--direct --huge-pages --cache-size 16", small_fanout_binary)
+
+    queries = [
+      "select count(*)",
+      "select where username = user3 limit 3",
+      "select sum(id) where id > 350",
+      ".exit",
+    ]
+    direct = run_scripts(queries, "--direct --cache-size 16", small_fanout_binary)
+    expect(direct).to eq([
+      "db > (300)",
+      "Executed.",
+      "db > (3, user3, person3@example.com)",
+      "(10, user3, person10@example.com)",
+      "(17, user3, person17@example.com)",
+      "Executed.",
+      "db > (18775)",
+      "Executed.",
+      "db > ",
+    ])
+    expect(run_scripts(queries, "", small_fanout_binary)).to eq(direct)
+  end
+
+  it 'keeps the page size a db file was created with in its header' do
+    script = (1..600).to_a.shuffle(random: Random.new(11)).map do |i|
+      "insert #{i} #{wide("user#{i % 5}", "person#{i}@example.com").join(" ")}"
+    end
+    script << ".exit"
+    queries = [
+      "select where id >= 300 and id <= 302",
+      "select sum(id) where username = #{wide("user2", "").first}",
+      ".stats",
+      ".exit",
+    ]
+    results = ["", "--page-size 65536"].map do |options|
+      `rm -rf test.db test.db-wal`
+      run_scripts(script, "#{options} --cache-size 16", small_fanout_binary)
+      expect(File.size("test.db") % 65536).to eq(0) unless options.empty?
+      # reopened without the option, the size comes from the header
+      run_scripts(queries, "--cache-size 16", small_fanout_binary)
+    end
+    stats = results.map do |result|
+      result.select { |line| line.include?(":") }.map { |line| line.split(":").map(&:strip) }.to_h
+    end
+    expect(stats.map { |s| s["Page size"] }).to eq(["4096", "65536"])
+    expect(stats[1]["Tree depth"].to_i).to be < stats[0]["Tree depth"].to_i
+    expect(results[1].take(6)).to eq(results[0].take(6))
+    expect(results[0][4]).to eq("db > (35940)")
+
+    `rm -rf test.db test.db-wal`
+    expect(run_scripts([".exit"], "--page-size 10000", small_fanout_binary)).to eq([
+      "Page size must be a power of two from 4096 to 65536.",
+    ])
+  end
+
+  it 'reads and writes pages past 4 GiB' do
+    run_scripts([".exit"], "--page-size 65536")
+    # a sparse file, rows inserted now go to pages past 4 GiB
+    File.truncate("test.db", 65536 * 65536)
+    script = (1..1000).map do |i|
+      "insert #{i} #{wide("user#{i}", "person#{i}@example.com").join(" ")}"
+    end
+    script << ".exit"
+    run_scripts(script, "--cache-size 16")
+    expect(File.size("test.db")).to be > 65536 * 65536
+    result = run_scripts(["select count(*)", "select sum(id)", ".exit"], "--cache-size 16")
+    expect(result).to eq([
+      "db > (1000)",
+      "Executed.",
+      "db > (500500)",
+      "Executed.",
+      "db > ",
+    ])
+    `rm -rf test.db test.db-wal`
+  end
+
+  it 'refuses a db file shorter than the page count in its header' do
+    script = (1..200).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".exit"
+    run_scripts(script)
+    num_pages = File.size("test.db") / 4096
+    File.truncate("test.db", (num_pages - 1) * 4096)
+    expect(run_scripts(["select count(*)", ".exit"])).to eq([
+      "Db file has #{num_pages - 1} of its #{num_pages} pages. Truncated file.",
+    ])
+  end
+
+  it 'refuses a db file written with another internal node fan-out' do
+    run_scripts(["insert 1 user1 person1@example.com", ".exit"], "", small_fanout_binary)
+    expect(run_scripts(["select", ".exit"])).to eq([
+      "Db file was written with 3 keys per internal node, this build has 339.",
+    ])
+    expect(run_scripts(["select", ".exit"], "", small_fanout_binary)).to eq([
+      "db > (1, user1, person1@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'opens dbs of different page sizes in one process' do
+    `rm -rf test.db test.db-wal test-wide.db test-wide.db-wal`
+    system("make -s libdb.a")
+    File.write("client.c", <<~C)
+      #include <stdio.h>
+      #include "db.h"
+
+      int main() {
+        Db* dbs[2];
+        DbOptions options;
+        db_default_options(&options);
+        const char* filenames[2] = { "test.db", "test-wide.db" };
+        for (int d = 0; d < 2; d++) {
+          options.page_size = d == 0 ? 4096 : 65536;
+          if (db_open(filenames[d], &options, &dbs[d]) != DB_OK) {
+            printf("%s\\n", db_error_message());
+            return 1;
+          }
+        }
+        DbStatement* inserts[2];
+        for (int d = 0; d < 2; d++) {
+          db_prepare(dbs[d], "insert ? ? ?", &inserts[d]);
+        }
+        // turn by turn, so that splits of one db follow those of the other
+        for (uint32_t i = 1; i <= 3000; i++) {
+          for (int d = 0; d < 2; d++) {
+            db_bind_id(inserts[d], 0, (i * 7919) % 3001);
+            db_bind_text(inserts[d], 1, "user");
+            db_bind_text(inserts[d], 2, "user@example.com");
+            db_step(inserts[d]);
+            db_reset(inserts[d]);
+          }
+        }
+        for (int d = 0; d < 2; d++) {
+          db_finalize(inserts[d]);
+          DbStatement* count;
+          db_prepare(dbs[d], "select count(*) where id >= 1000", &count);
+          uint64_t value;
+          db_step(count);
+          db_value(count, &value);
+          DbStats stats;
+          db_stats(dbs[d], &stats);
+          printf("%d %d\\n", (int) value, stats.page_size);
+          db_finalize(count);
+        }
+        return db_close(dbs[0]) != DB_OK || db_close(dbs[1]) != DB_OK;
+      }
+    C
+    expect(system("gcc -I. client.c libdb.a -o client.out -lpthread")).to be_truthy
+    expect(`./client.out`.lines.map(&:chomp)).to eq(["2001 4096", "2001 65536"])
+    `rm -f client.c client.out test-wide.db test-wide.db-wal`
+  end
+
+  it 'fills leaves on appends and still finds duplicates past the last split' do
+    script = (1..300).map do |i|
+      "insert #{i} #{wide("user#{i}", "person#{i}@example.com").join(" ")}"
+    end
+    script += [
+      "insert 300 again again@example.com",
+      "insert 150 again again@example.com",
+      "insert 301 last last@example.com",
+      "select count(*)",
+      ".exit",
+    ]
+    result = run_scripts(script)
+    expect(result[300..-1]).to eq([
+                                    "db > Error: Duplicate key.",
+                                    "db > Error: Duplicate key.",
+                                    "db > Executed.",
+                                    "db > (301)",
+                                    "Executed.",
+                                    "db > ",
+                                  ])
+    # 13 such rows fill a leaf: 24 leaves, the root and the header
+    expect(File.size("test.db")).to eq(26 * 4096)
+  end
+
+  it 'backs up the db to a file while it stays open' do
+    `rm -rf test-backup.db test-backup.db-wal`
+    script = (1..200).map do |i|
+      "insert #{i} #{wide("user#{i}", "person#{i}@example.com").join(" ")}"
+    end
+    script += [
+      ".backup test-backup.db",
+      "insert 201 later later@example.com",
+      "begin",
+      ".backup test-backup.db",
+      "commit",
+      ".backup no-such-dir/test-backup.db",
+      ".backup test.db",
+      ".backup test.db-wal",
+      "select count(*)",
+      ".exit",
+    ]
+    result = run_scripts(script, "--cache-size 8")
+    expect(result[200..-1]).to eq([
+                                    "db > Backed up 18 pages.",
+                                    "db > Executed.",
+                                    "db > Executed.",
+                                    "db > Error: Cannot back up inside a transaction.",
+                                    "db > Executed.",
+                                    "db > Unable to write file 'no-such-dir/test-backup.db'.",
+                                    "db > Error: Cannot back up the db onto itself.",
+                                    "db > Error: Cannot back up the db onto itself.",
+                                    "db > (201)",
+                                    "Executed.",
+                                    "db > ",
+                                  ])
+
+    expect(File.exist?("test-backup.db.tmp")).to be false
+    # the backup is a db of its own, without the row inserted after it
+    `mv test-backup.db test.db`
+    result = run_scripts(["select count(*)", "select max(id)", "select where id = 200", ".exit"])
+    expect(result.take(2)).to eq(["db > (200)", "Executed."])
+    expect(result[2..3]).to eq(["db > (200)", "Executed."])
+    expect(result[4]).to start_with("db > (200, user200_")
+  end
+
+  it 'benchmarks the engine as a build target' do
+    expect(system("make -s bench")).to be_truthy
+    output = `./bench --rows 300 --cache-size 16,100 --ops 200 --scans 2 --threads 2 --file test.db --json`
+    require 'json'
+    results = JSON.parse(output)["results"]
+    expect(results.map { |r| r["workload"] }).to eq(
+      %w[insert-seq insert-random lookup range scan mixed] * 2
+    )
+    expect(results.map { |r| r["cache_size"] }.uniq).to eq([16, 100])
+    lookup = results.find { |r| r["workload"] == "lookup" }
+    expect(lookup["rows_read"]).to eq(200)
+    expect(lookup["latency_us"].keys).to eq(%w[p50 p99 p999 max])
+    expect(results.find { |r| r["workload"] == "scan" }["rows_read"]).to eq(600)
+    expect(results.first["pages_written"]).to be > 0
+    expect(File.exist?("test.db")).to be false
+  end
 end